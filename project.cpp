@@ -1,621 +1,7310 @@
 #include <iostream>
 #include <string>
 #include <vector>
-#include <queue>
-#include <stack>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <algorithm>
 #include <fstream>
 #include <limits>
+#include <string_view>
+#include <deque>
+#include <cstring>
+#include <thread>
+#include <iterator>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <shared_mutex>
+#include <array>
+#include <optional>
+#include <cmath>
+#include <cctype>
+#include <chrono>
+#include <ctime>
+#include <charconv>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+#include <atomic>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LIBRARY_HAVE_MMAP 1
+#elif defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <csignal>
+#define LIBRARY_HAVE_EPOLL 1
+#endif
+
+// Operation latency histograms, allocation counts and event counters. Build
+// with -DLIBRARY_NO_METRICS to compile the instrumentation out entirely.
+#ifndef LIBRARY_NO_METRICS
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#define LIBRARY_HAVE_METRICS 1
+#endif
+
+#ifdef LIBRARY_HAVE_METRICS
+// Each thread records into its own shard with plain relaxed stores (it is the
+// only writer), and dumps add the shards up on demand, so recording never
+// contends. Latencies go into log-linear buckets (16 per power of two, so a
+// quantile is within about 3% of the true value) covering 1 ns to 2^64 ns.
+namespace metrics {
+
+enum class Op {
+    Borrow, Return, AddBook, RemoveBook, LoadBooks, LoadBorrowers, LoadSnapshot,
+    ReplayLog, SaveData, Search, BooksInCategory, ListPage, Recommend, Count
+};
+
+enum class Event { BorrowRejected, ReturnRejected, HoldFilled, LogSync, LogCompaction, Count };
+
+constexpr size_t OPS = static_cast<size_t>(Op::Count);
+constexpr size_t EVENTS = static_cast<size_t>(Event::Count);
+constexpr unsigned SUB_BITS = 4;
+constexpr size_t SUB_BUCKETS = size_t{1} << SUB_BITS;
+constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+inline const char* opName(Op op) {
+    static const char* const names[OPS] = {
+        "borrow", "return", "add_book", "remove_book", "load_books", "load_borrowers", "load_snapshot",
+        "replay_log", "save_data", "search", "books_in_category", "list_page", "recommend"};
+    return names[static_cast<size_t>(op)];
+}
+
+inline const char* eventName(Event event) {
+    static const char* const names[EVENTS] = {
+        "borrow_rejected", "return_rejected", "hold_filled", "log_sync", "log_compaction"};
+    return names[static_cast<size_t>(event)];
+}
+
+inline unsigned floorLog2(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63u - static_cast<unsigned>(__builtin_clzll(v));
+#else
+    unsigned e = 0;
+    while (v >>= 1) ++e;
+    return e;
+#endif
+}
+
+inline size_t bucketFor(uint64_t ns) {
+    if (ns < SUB_BUCKETS) return static_cast<size_t>(ns);
+    unsigned e = floorLog2(ns);
+    return (e - SUB_BITS + 1) * SUB_BUCKETS + ((ns >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// Midpoint of the values that land in a bucket
+inline uint64_t bucketValue(size_t bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+    unsigned shift = static_cast<unsigned>(bucket / SUB_BUCKETS) - 1;
+    uint64_t low = (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return low + ((uint64_t{1} << shift) >> 1);
+}
+
+// Heap allocations made by this thread; counted by the global operator new
+inline thread_local uint64_t allocationCount = 0;
+
+struct Shard {
+    std::array<std::array<std::atomic<uint64_t>, BUCKETS>, OPS> buckets;
+    std::array<std::atomic<uint64_t>, OPS> totalNs, maxNs, allocations;
+    std::array<std::atomic<uint64_t>, EVENTS> events;
+};
+
+inline void bump(std::atomic<uint64_t>& counter, uint64_t by = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+// Shards are never freed, so counts from finished threads stay in the totals
+class Registry {
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Shard>> shards;
+
+public:
+    static Registry& instance() {
+        static Registry registry;
+        return registry;
+    }
+
+    Shard& local() {
+        thread_local Shard* shard = nullptr;
+        if (!shard) {
+            auto fresh = std::make_unique<Shard>();  // value-initialized, so all zero
+            shard = fresh.get();
+            std::lock_guard<std::mutex> lock(mutex);
+            shards.push_back(std::move(fresh));
+        }
+        return *shard;
+    }
+
+    template <typename Fn>
+    void forEachShard(Fn&& fn) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& shard : shards) fn(*shard);
+    }
+};
+
+inline void record(Op op, uint64_t ns, uint64_t allocations) {
+    Shard& shard = Registry::instance().local();
+    size_t i = static_cast<size_t>(op);
+    bump(shard.buckets[i][bucketFor(ns)]);
+    bump(shard.totalNs[i], ns);
+    bump(shard.allocations[i], allocations);
+    if (ns > shard.maxNs[i].load(std::memory_order_relaxed)) shard.maxNs[i].store(ns, std::memory_order_relaxed);
+}
+
+inline void count(Event event) {
+    bump(Registry::instance().local().events[static_cast<size_t>(event)]);
+}
+
+// Times the enclosing scope and counts the allocations made in it
+class ScopedTimer {
+private:
+    Op op;
+    uint64_t allocationsAtStart;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit ScopedTimer(Op o)
+        : op(o), allocationsAtStart(allocationCount), start(std::chrono::steady_clock::now()) {}
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+    ~ScopedTimer() {
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        record(op, static_cast<uint64_t>(elapsed.count()), allocationCount - allocationsAtStart);
+    }
+};
+
+struct Summary {
+    uint64_t count = 0, totalNs = 0, maxNs = 0, allocations = 0;
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(BUCKETS);
+
+    uint64_t quantile(double q) const {
+        if (count == 0) return 0;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * static_cast<double>(count))));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            seen += buckets[b];
+            if (seen >= rank) return std::min(bucketValue(b), maxNs);
+        }
+        return maxNs;
+    }
+};
+
+inline std::vector<Summary> summarize(std::array<uint64_t, EVENTS>& events) {
+    std::vector<Summary> ops(OPS);
+    events.fill(0);
+    Registry::instance().forEachShard([&](const Shard& shard) {
+        for (size_t i = 0; i < OPS; ++i) {
+            Summary& s = ops[i];
+            for (size_t b = 0; b < BUCKETS; ++b) {
+                uint64_t n = shard.buckets[i][b].load(std::memory_order_relaxed);
+                s.buckets[b] += n;
+                s.count += n;
+            }
+            s.totalNs += shard.totalNs[i].load(std::memory_order_relaxed);
+            s.maxNs = std::max(s.maxNs, shard.maxNs[i].load(std::memory_order_relaxed));
+            s.allocations += shard.allocations[i].load(std::memory_order_relaxed);
+        }
+        for (size_t e = 0; e < EVENTS; ++e) events[e] += shard.events[e].load(std::memory_order_relaxed);
+    });
+    return ops;
+}
+
+constexpr std::array<double, 4> QUANTILES = {0.5, 0.9, 0.99, 0.999};
+
+inline std::string seconds(uint64_t ns) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.9f", static_cast<double>(ns) / 1e9);
+    return buffer;
+}
+
+// Prometheus text exposition format
+inline std::string prometheus() {
+    std::array<uint64_t, EVENTS> events;
+    std::vector<Summary> ops = summarize(events);
+    std::string out =
+        "# HELP library_operation_latency_seconds Time spent in LibraryManager operations.\n"
+        "# TYPE library_operation_latency_seconds summary\n";
+    for (size_t i = 0; i < OPS; ++i) {
+        std::string label = std::string("op=\"") + opName(static_cast<Op>(i)) + "\"";
+        for (double q : QUANTILES) {
+            char quantile[16];
+            std::snprintf(quantile, sizeof(quantile), "%g", q);
+            out += "library_operation_latency_seconds{" + label + ",quantile=\"" + quantile + "\"} " +
+                   seconds(ops[i].quantile(q)) + "\n";
+        }
+        out += "library_operation_latency_seconds_sum{" + label + "} " + seconds(ops[i].totalNs) + "\n";
+        out += "library_operation_latency_seconds_count{" + label + "} " + std::to_string(ops[i].count) + "\n";
+    }
+    out += "# HELP library_operation_max_seconds Slowest call of each operation.\n"
+           "# TYPE library_operation_max_seconds gauge\n";
+    for (size_t i = 0; i < OPS; ++i) {
+        out += std::string("library_operation_max_seconds{op=\"") + opName(static_cast<Op>(i)) + "\"} " +
+               seconds(ops[i].maxNs) + "\n";
+    }
+    out += "# HELP library_operation_allocations_total Heap allocations made during LibraryManager operations.\n"
+           "# TYPE library_operation_allocations_total counter\n";
+    for (size_t i = 0; i < OPS; ++i) {
+        out += std::string("library_operation_allocations_total{op=\"") + opName(static_cast<Op>(i)) + "\"} " +
+               std::to_string(ops[i].allocations) + "\n";
+    }
+    out += "# HELP library_events_total Notable events in the library.\n"
+           "# TYPE library_events_total counter\n";
+    for (size_t e = 0; e < EVENTS; ++e) {
+        out += std::string("library_events_total{event=\"") + eventName(static_cast<Event>(e)) + "\"} " +
+               std::to_string(events[e]) + "\n";
+    }
+    return out;
+}
+
+// One JSON object; operations and events each on their own line
+inline std::string json() {
+    std::array<uint64_t, EVENTS> events;
+    std::vector<Summary> ops = summarize(events);
+    std::string out = "{\"operations\": {\n";
+    for (size_t i = 0; i < OPS; ++i) {
+        const Summary& s = ops[i];
+        out += std::string("  \"") + opName(static_cast<Op>(i)) + "\": {\"count\": " + std::to_string(s.count) +
+               ", \"total_ns\": " + std::to_string(s.totalNs) +
+               ", \"p50_ns\": " + std::to_string(s.quantile(0.5)) +
+               ", \"p90_ns\": " + std::to_string(s.quantile(0.9)) +
+               ", \"p99_ns\": " + std::to_string(s.quantile(0.99)) +
+               ", \"p999_ns\": " + std::to_string(s.quantile(0.999)) +
+               ", \"max_ns\": " + std::to_string(s.maxNs) +
+               ", \"allocations\": " + std::to_string(s.allocations) + "}" + (i + 1 < OPS ? ",\n" : "\n");
+    }
+    out += "}, \"events\": {\n";
+    for (size_t e = 0; e < EVENTS; ++e) {
+        out += std::string("  \"") + eventName(static_cast<Event>(e)) + "\": " + std::to_string(events[e]) +
+               (e + 1 < EVENTS ? ",\n" : "\n");
+    }
+    out += "}}\n";
+    return out;
+}
+
+} // namespace metrics
+
+// Replaces the global allocator entry points only to count allocations; the
+// standard library forwards the array, nothrow and sized forms to these
+void* operator new(std::size_t size) {
+    ++metrics::allocationCount;
+    if (size == 0) size = 1;
+    while (true) {
+        if (void* p = std::malloc(size)) return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+// Kept out of line: once inlined next to a new-expression, GCC flags the free() as mismatched
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((noinline))
+#endif
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { operator delete(p); }
+
+#define LIBRARY_TIMED(op) metrics::ScopedTimer metricsTimer(metrics::Op::op)
+#define LIBRARY_COUNT(event) metrics::count(metrics::Event::event)
+#else
+#define LIBRARY_TIMED(op) ((void)0)
+#define LIBRARY_COUNT(event) ((void)0)
+#endif
+
+// Forces a written stream's data to stable storage (fflush alone only reaches
+// the OS). False if either step failed.
+inline bool syncFile(std::FILE* file) {
+    if (std::fflush(file) != 0) return false;
+#if defined(LIBRARY_HAVE_MMAP)
+    return ::fsync(::fileno(file)) == 0;
+#elif defined(_WIN32)
+    return ::_commit(::_fileno(file)) == 0;
+#else
+    return true;
+#endif
+}
+
+// Makes a rename or newly created entry in path's directory durable. Windows
+// has no directory handle to sync; its renames are journalled by the filesystem.
+inline void syncParentDirectory(const std::string& path) {
+#if defined(LIBRARY_HAVE_MMAP)
+    std::string dir = std::filesystem::path(path).parent_path().string();
+    int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    ::fsync(fd);
+    ::close(fd);
+#else
+    (void)path;
+#endif
+}
+
+// Moves a fully written temporary file over path. The data is synced before
+// the rename and the directory after it, so a crash leaves either the old file
+// or the new one on disk, never a truncated mix of the two.
+inline bool replaceFile(const std::string& tmpPath, const std::string& path) {
+#if defined(LIBRARY_HAVE_MMAP)
+    int fd = ::open(tmpPath.c_str(), O_RDWR);
+    if (fd < 0) return false;
+    bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    if (!synced) return false;
+#elif defined(_WIN32)
+    int fd = ::_open(tmpPath.c_str(), _O_RDWR);
+    if (fd < 0) return false;
+    ::_commit(fd);
+    ::_close(fd);
+    std::remove(path.c_str());  // rename() does not replace existing files on Windows
+#endif
+    if (std::rename(tmpPath.c_str(), path.c_str()) != 0) return false;
+    syncParentDirectory(path);
+    return true;
+}
+
+// Read-only view of a whole file. Uses mmap where available so loading a large
+// CSV does not copy it through a stream buffer; otherwise reads it in one go.
+class MappedFile {
+private:
+    const char* data = nullptr;
+    size_t length = 0;
+    bool opened = false;
+    bool mapped = false;
+    std::string buffer;  // fallback storage when the file is not mapped
+
+public:
+    explicit MappedFile(const std::string& path) {
+#ifdef LIBRARY_HAVE_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (::fstat(fd, &st) == 0) {
+            opened = true;
+            length = static_cast<size_t>(st.st_size);
+            if (length > 0) {
+                void* p = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    ::madvise(p, length, MADV_SEQUENTIAL);
+                    data = static_cast<const char*>(p);
+                    mapped = true;
+                } else {
+                    opened = false;
+                }
+            }
+        }
+        ::close(fd);
+#else
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) return;
+        file.seekg(0, std::ios::end);
+        buffer.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0, std::ios::beg);
+        file.read(&buffer[0], static_cast<std::streamsize>(buffer.size()));
+        data = buffer.data();
+        length = buffer.size();
+        opened = true;
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef LIBRARY_HAVE_MMAP
+        if (mapped) ::munmap(const_cast<char*>(data), length);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return opened; }
+    std::string_view view() const { return std::string_view(data, length); }
+};
+
+// Splits CSV text into records of string_view fields without copying.
+// Lines without quotes take a fast path built on memchr (vectorized in libc);
+// quoted fields may contain commas, newlines and doubled quotes ("" -> ").
+class CsvReader {
+private:
+    std::string_view text;
+    size_t pos = 0;
+    std::deque<std::string> unescaped;  // stable storage for fields that needed unquoting
+
+    static std::string_view trimCR(std::string_view field) {
+        if (!field.empty() && field.back() == '\r') field.remove_suffix(1);
+        return field;
+    }
+
+    // Slow path: walk the record character by character, honouring quotes.
+    // A newline inside quotes does not end the record.
+    void parseQuotedRecord(std::vector<std::string_view>& fields) {
+        while (true) {
+            if (pos < text.size() && text[pos] == '"') {
+                ++pos;
+                size_t start = pos;
+                bool needsCopy = false;
+                while (pos < text.size()) {
+                    if (text[pos] == '"') {
+                        if (pos + 1 < text.size() && text[pos + 1] == '"') {
+                            needsCopy = true;
+                            pos += 2;
+                            continue;
+                        }
+                        break;
+                    }
+                    ++pos;
+                }
+                std::string_view raw = text.substr(start, pos - start);
+                if (pos < text.size()) ++pos;  // closing quote
+                if (needsCopy) {
+                    std::string value;
+                    value.reserve(raw.size());
+                    for (size_t i = 0; i < raw.size(); ++i) {
+                        value += raw[i];
+                        if (raw[i] == '"') ++i;
+                    }
+                    unescaped.push_back(std::move(value));
+                    fields.push_back(unescaped.back());
+                } else {
+                    fields.push_back(raw);
+                }
+                // Skip anything between the closing quote and the next delimiter
+                while (pos < text.size() && text[pos] != ',' && text[pos] != '\n') ++pos;
+            } else {
+                size_t start = pos;
+                while (pos < text.size() && text[pos] != ',' && text[pos] != '\n') ++pos;
+                fields.push_back(trimCR(text.substr(start, pos - start)));
+            }
+            if (pos >= text.size()) return;
+            if (text[pos++] == '\n') return;
+        }
+    }
+
+public:
+    explicit CsvReader(std::string_view t) : text(t) {}
+
+    bool atEnd() const { return pos >= text.size(); }
+
+    // Unread portion of the input, e.g. the body after the header record
+    std::string_view remaining() const { return text.substr(pos); }
+
+    // Reads the next record into 'fields'. Returns false at end of input.
+    // Views stay valid until the next call (or for the lifetime of the input text
+    // when the field did not need unescaping).
+    bool nextRecord(std::vector<std::string_view>& fields) {
+        fields.clear();
+        unescaped.clear();
+        if (pos >= text.size()) return false;
+
+        const char* base = text.data();
+        const char* nl = static_cast<const char*>(std::memchr(base + pos, '\n', text.size() - pos));
+        size_t end = nl ? static_cast<size_t>(nl - base) : text.size();
+
+        if (std::memchr(base + pos, '"', end - pos) != nullptr) {
+            parseQuotedRecord(fields);
+            return true;
+        }
+
+        std::string_view line = trimCR(text.substr(pos, end - pos));
+        pos = nl ? end + 1 : text.size();
+        while (true) {
+            const char* comma = static_cast<const char*>(std::memchr(line.data(), ',', line.size()));
+            if (!comma) {
+                fields.push_back(line);
+                break;
+            }
+            size_t len = static_cast<size_t>(comma - line.data());
+            fields.push_back(line.substr(0, len));
+            line.remove_prefix(len + 1);
+        }
+        return true;
+    }
+};
+
+// Quotes a field for CSV output when it contains a delimiter, quote or newline
+inline std::string csvEscape(const std::string& field) {
+    if (field.find_first_of(",\"\r\n") == std::string::npos) return field;
+    std::string out = "\"";
+    for (char c : field) {
+        if (c == '"') out += '"';
+        out += c;
+    }
+    out += '"';
+    return out;
+}
+
+// Splits CSV text into at most 'parts' chunks, each ending on a record boundary.
+// Quoted fields may hide newlines, so a newline only ends a record when an even
+// number of quotes precede it (a doubled "" inside a field keeps the parity).
+inline std::vector<std::string_view> splitCsvChunks(std::string_view text, size_t parts) {
+    std::vector<std::string_view> chunks;
+    if (parts <= 1) {
+        chunks.push_back(text);
+        return chunks;
+    }
+    size_t target = text.size() / parts;
+    size_t start = 0;
+    size_t pos = 0;       // text before pos has been scanned for quotes
+    bool quoted = false;  // parity of the quotes before pos
+    while (start < text.size()) {
+        size_t end = text.size();
+        if (chunks.size() + 1 < parts) {
+            size_t goal = std::min(text.size(), start + target);
+            if (goal > pos) {
+                quoted ^= (std::count(text.begin() + pos, text.begin() + goal, '"') & 1) != 0;
+                pos = goal;
+            }
+            for (; pos < text.size(); ++pos) {
+                if (text[pos] == '"') {
+                    quoted = !quoted;
+                } else if (text[pos] == '\n' && !quoted) {
+                    break;
+                }
+            }
+            end = pos < text.size() ? ++pos : text.size();
+        }
+        chunks.push_back(text.substr(start, end - start));
+        start = end;
+    }
+    return chunks;
+}
+
+// Runs parse(chunk, out) over each chunk on its own thread and appends the
+// results to 'records' in file order.
+template <typename Record, typename Parser>
+void parseChunksInParallel(const std::vector<std::string_view>& chunks, Parser parse,
+                           std::vector<Record>& records) {
+    if (chunks.size() == 1) {
+        parse(chunks[0], records);
+        return;
+    }
+    std::vector<std::vector<Record>> partial(chunks.size());
+    std::vector<std::thread> workers;
+    workers.reserve(chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        workers.emplace_back([&, i] { parse(chunks[i], partial[i]); });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    size_t total = records.size();
+    for (const auto& part : partial) total += part.size();
+    records.reserve(total);
+    for (auto& part : partial) {
+        std::move(part.begin(), part.end(), std::back_inserter(records));
+    }
+}
+
+// Process-wide pool of deduplicated strings. Authors and categories repeat
+// across thousands of books, so each distinct value is stored once and books
+// keep a pointer to it. Pooled strings are never freed: pointers stay valid and
+// two books share a category exactly when their category pointers are equal.
+class StringPool {
+private:
+    // Parser threads pool three strings per book, so the pool is split by
+    // hash into independently locked shards, and a value already pooled (most
+    // authors and categories) only needs a shared lock on its shard
+    static constexpr size_t SHARDS = 64;
+
+    struct Entry {
+        std::unique_ptr<const std::string> value;
+        std::atomic<size_t> refs{0};
+        bool pinned = false;
+    };
+
+    struct Shard {
+        std::shared_mutex mutex;
+        std::unordered_map<std::string_view, Entry> lookup;  // keys view *Entry::value
+    };
+    std::array<Shard, SHARDS> shards;
+
+    static Shard& shardFor(std::string_view value) {
+        static StringPool pool;
+        return pool.shards[std::hash<std::string_view>{}(value) % SHARDS];
+    }
+
+    // Returns the pooled copy of 'value', adding it if needed, with one more
+    // reference or pinned for good
+    static const std::string* add(std::string_view value, bool pin) {
+        Shard& shard = shardFor(value);
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.lookup.find(value);
+            if (it != shard.lookup.end() && (!pin || it->second.pinned)) {
+                if (!pin) it->second.refs.fetch_add(1, std::memory_order_relaxed);
+                return it->second.value.get();
+            }
+        }
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.lookup.find(value);  // another thread may have added it meanwhile
+        if (it == shard.lookup.end()) {
+            auto owned = std::make_unique<const std::string>(value);
+            it = shard.lookup.try_emplace(std::string_view(*owned)).first;
+            it->second.value = std::move(owned);
+        }
+        if (pin) {
+            it->second.pinned = true;
+        } else {
+            it->second.refs.fetch_add(1, std::memory_order_relaxed);
+        }
+        return it->second.value.get();
+    }
+
+public:
+    // Pools a value for the life of the process. For categories, which key
+    // long-lived indexes and statistics and are few.
+    static const std::string* intern(std::string_view value) { return add(value, true); }
+
+    // Counted references, for ISBNs and authors: a value no book or loan
+    // refers to any more is freed, so a long-running server that adds and
+    // removes books does not grow without bound. Hold one through Ref.
+    static const std::string* acquire(std::string_view value) { return add(value, false); }
+
+    // 'pooled' must already hold a reference (or be pinned)
+    static void retain(const std::string* pooled) {
+        Shard& shard = shardFor(*pooled);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        shard.lookup.find(*pooled)->second.refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void release(const std::string* pooled) {
+        Shard& shard = shardFor(*pooled);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.lookup.find(*pooled);
+        if (it->second.refs.fetch_sub(1, std::memory_order_relaxed) == 1 && !it->second.pinned) {
+            auto owned = std::move(it->second.value);  // the key views it until erased
+            shard.lookup.erase(it);
+        }
+    }
+
+    // Returns nullptr when no book or loan uses this value. The pointer is
+    // only for comparing with keys the caller's records hold.
+    static const std::string* find(std::string_view value) {
+        Shard& shard = shardFor(value);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.lookup.find(value);
+        return it != shard.lookup.end() ? it->second.value.get() : nullptr;
+    }
+
+    // One counted reference to a pooled value, released when it goes
+    class Ref {
+    private:
+        const std::string* pooled = nullptr;
+
+    public:
+        Ref() = default;
+        explicit Ref(std::string_view value) : pooled(acquire(value)) {}
+        Ref(const Ref& other) : pooled(other.pooled) {
+            if (pooled) retain(pooled);
+        }
+        Ref(Ref&& other) noexcept : pooled(std::exchange(other.pooled, nullptr)) {}
+        Ref& operator=(Ref other) noexcept {
+            std::swap(pooled, other.pooled);
+            return *this;
+        }
+        ~Ref() {
+            if (pooled) release(pooled);
+        }
+
+        const std::string* get() const { return pooled; }
+    };
+};
 
 // Book class definition
 class Book {
 private:
     std::string title;
-    std::string author;
-    std::string isbn;
+    StringPool::Ref author;
+    StringPool::Ref isbn;         // doubles as the book's handle in loan lists
     bool isAvailable;
-    std::string category;
+    bool reserved = false;        // held by a prepared cross-shard transfer; never saved
+    const std::string* category;  // pooled
 
 public:
     Book(const std::string& t = "", const std::string& a = "", const std::string& i = "", 
          const std::string& cat = "") 
-        : title(t), author(a), isbn(i), isAvailable(true), category(cat) {}
+        : title(t), author(a), isbn(i), isAvailable(true),
+          category(StringPool::intern(cat)) {}
+
+    // Getters
+    const std::string& getTitle() const { return title; }
+    const std::string& getAuthor() const { return *author.get(); }
+    const std::string& getISBN() const { return *isbn.get(); }
+    bool getAvailability() const { return isAvailable; }
+    bool isReserved() const { return reserved; }
+    const std::string& getCategory() const { return *category; }
+
+    // Pooled identity of the category/author: compare these instead of the strings
+    const std::string* getCategoryKey() const { return category; }
+    const std::string* getAuthorKey() const { return author.get(); }
+    const std::string* getISBNKey() const { return isbn.get(); }
+
+    // Setters
+    void setTitle(const std::string& t) { title = t; }
+    void setAuthor(const std::string& a) { author = StringPool::Ref(a); }
+    void setISBN(const std::string& i) { isbn = StringPool::Ref(i); }
+    void setAvailability(bool status) { isAvailable = status; }
+    void setReserved(bool held) { reserved = held; }
+    void setCategory(const std::string& cat) { category = StringPool::intern(cat); }
+
+    // CSV format conversion
+    std::string toCSV() const {
+        return csvEscape(title) + "," + csvEscape(getAuthor()) + "," + csvEscape(getISBN()) + "," + 
+               std::to_string(isAvailable) + "," + csvEscape(*category);
+    }
+};
+
+// Formats for book listings and reports
+enum class ReportFormat {
+    Text,   // the interactive display layout
+    CSV,    // the books.csv layout, header included
+    JSONL   // one JSON object per book
+};
+
+// Buffered writer for book listings. Records are formatted straight into one
+// reusable buffer that is handed to the C stream in large writes, so dumping
+// the catalog is bound by the disk rather than by per-field stream calls.
+// Free text (headings, separators) only appears in the Text format, which
+// keeps CSV and JSONL output machine-readable.
+class ReportWriter {
+private:
+    static constexpr size_t FLUSH_AT = 256 * 1024;
+
+    std::FILE* out;
+    ReportFormat format;
+    bool showCategory;
+    std::string buffer;
+    bool headerWritten = false;
+    bool failed = false;
+
+    void csvField(const std::string& field) {
+        if (field.find_first_of(",\"\r\n") == std::string::npos) {
+            buffer += field;
+            return;
+        }
+        buffer += '"';
+        for (char c : field) {
+            if (c == '"') buffer += '"';
+            buffer += c;
+        }
+        buffer += '"';
+    }
+
+    void jsonField(std::string_view name, const std::string& value) {
+        buffer += '"';
+        buffer += name;
+        buffer += "\":\"";
+        for (char c : value) {
+            switch (c) {
+                case '"': buffer += "\\\""; break;
+                case '\\': buffer += "\\\\"; break;
+                case '\n': buffer += "\\n"; break;
+                case '\r': buffer += "\\r"; break;
+                case '\t': buffer += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        char escaped[8];
+                        std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+                        buffer += escaped;
+                    } else {
+                        buffer += c;
+                    }
+            }
+        }
+        buffer += '"';
+    }
+
+    void drain() {
+        if (std::fwrite(buffer.data(), 1, buffer.size(), out) != buffer.size()) failed = true;
+        buffer.clear();
+    }
+
+public:
+    // withCategory = false leaves the Category line out of the Text format
+    explicit ReportWriter(std::FILE* stream, ReportFormat fmt = ReportFormat::Text, bool withCategory = true)
+        : out(stream), format(fmt), showCategory(withCategory) {
+        buffer.reserve(FLUSH_AT + 4096);
+    }
+
+    ReportWriter(const ReportWriter&) = delete;
+    ReportWriter& operator=(const ReportWriter&) = delete;
+
+    ~ReportWriter() { flush(); }
+
+    void text(std::string_view s) {
+        if (format != ReportFormat::Text) return;
+        buffer += s;
+        if (buffer.size() >= FLUSH_AT) drain();
+    }
+
+    void text(uint64_t n) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), n);
+        text(std::string_view(digits, static_cast<size_t>(result.ptr - digits)));
+    }
+
+    void book(const Book& b) {
+        switch (format) {
+            case ReportFormat::Text:
+                buffer += "Title: ";
+                buffer += b.getTitle();
+                buffer += "\nAuthor: ";
+                buffer += b.getAuthor();
+                buffer += "\nISBN: ";
+                buffer += b.getISBN();
+                buffer += b.getAvailability() ? "\nStatus: Available\n" : "\nStatus: Borrowed\n";
+                if (showCategory) {
+                    buffer += "Category: ";
+                    buffer += b.getCategory();
+                    buffer += '\n';
+                }
+                buffer += "----------------------------------------\n";
+                break;
+            case ReportFormat::CSV:
+                if (!headerWritten) {
+                    buffer += "Title,Author,ISBN,Available,Category\n";
+                    headerWritten = true;
+                }
+                csvField(b.getTitle());
+                buffer += ',';
+                csvField(b.getAuthor());
+                buffer += ',';
+                csvField(b.getISBN());
+                buffer += b.getAvailability() ? ",1," : ",0,";
+                csvField(b.getCategory());
+                buffer += '\n';
+                break;
+            case ReportFormat::JSONL:
+                buffer += '{';
+                jsonField("isbn", b.getISBN());
+                buffer += ',';
+                jsonField("title", b.getTitle());
+                buffer += ',';
+                jsonField("author", b.getAuthor());
+                buffer += ',';
+                jsonField("category", b.getCategory());
+                buffer += b.getAvailability() ? ",\"available\":true}\n" : ",\"available\":false}\n";
+                break;
+        }
+        if (buffer.size() >= FLUSH_AT) drain();
+    }
+
+    // Returns false if any write so far has failed
+    bool flush() {
+        if (!buffer.empty()) drain();
+        if (std::fflush(out) != 0) failed = true;
+        return !failed;
+    }
+};
+
+// Compressed set of 32-bit book positions, organised like a Roaring bitmap:
+// positions are grouped by their high 16 bits, and each group is stored as a
+// sorted array while sparse or as a 65536-bit bitset once it holds more than
+// ARRAY_LIMIT entries.
+class RoaringBitmap {
+private:
+    static constexpr size_t ARRAY_LIMIT = 4096;
+    static constexpr size_t BITSET_WORDS = 65536 / 64;
+
+    struct Container {
+        std::vector<uint16_t> array;  // used while sparse
+        std::vector<uint64_t> bits;   // used once dense
+        uint32_t cardinality = 0;
+
+        bool isBitset() const { return !bits.empty(); }
+
+        bool contains(uint16_t low) const {
+            if (isBitset()) return (bits[low >> 6] >> (low & 63)) & 1;
+            return std::binary_search(array.begin(), array.end(), low);
+        }
+
+        bool add(uint16_t low) {
+            if (isBitset()) {
+                uint64_t mask = uint64_t(1) << (low & 63);
+                if (bits[low >> 6] & mask) return false;
+                bits[low >> 6] |= mask;
+            } else {
+                auto it = std::lower_bound(array.begin(), array.end(), low);
+                if (it != array.end() && *it == low) return false;
+                array.insert(it, low);
+                if (array.size() > ARRAY_LIMIT) {
+                    bits.assign(BITSET_WORDS, 0);
+                    for (uint16_t v : array) bits[v >> 6] |= uint64_t(1) << (v & 63);
+                    std::vector<uint16_t>().swap(array);
+                }
+            }
+            ++cardinality;
+            return true;
+        }
+
+        bool remove(uint16_t low) {
+            if (isBitset()) {
+                uint64_t mask = uint64_t(1) << (low & 63);
+                if (!(bits[low >> 6] & mask)) return false;
+                bits[low >> 6] &= ~mask;
+                if (--cardinality <= ARRAY_LIMIT) {
+                    forEach(0, [this](uint32_t v) { array.push_back(static_cast<uint16_t>(v)); return true; });
+                    std::vector<uint64_t>().swap(bits);
+                }
+                return true;
+            }
+            auto it = std::lower_bound(array.begin(), array.end(), low);
+            if (it == array.end() || *it != low) return false;
+            array.erase(it);
+            --cardinality;
+            return true;
+        }
+
+        // Calls fn(high | low) for each member in order; stops when fn returns false
+        template <typename Fn>
+        bool forEach(uint32_t high, Fn&& fn) const {
+            if (!isBitset()) {
+                for (uint16_t v : array) {
+                    if (!fn(high | v)) return false;
+                }
+                return true;
+            }
+            for (size_t w = 0; w < bits.size(); ++w) {
+                uint64_t word = bits[w];
+                while (word) {
+                    unsigned bit = static_cast<unsigned>(__builtin_ctzll(word));
+                    if (!fn(high | static_cast<uint32_t>(w * 64 + bit))) return false;
+                    word &= word - 1;
+                }
+            }
+            return true;
+        }
+
+        template <typename Fn>
+        static bool forEachCommon(const Container& a, const Container& b, uint32_t high, Fn&& fn) {
+            if (a.isBitset() && b.isBitset()) {
+                for (size_t w = 0; w < BITSET_WORDS; ++w) {
+                    uint64_t word = a.bits[w] & b.bits[w];
+                    while (word) {
+                        unsigned bit = static_cast<unsigned>(__builtin_ctzll(word));
+                        if (!fn(high | static_cast<uint32_t>(w * 64 + bit))) return false;
+                        word &= word - 1;
+                    }
+                }
+                return true;
+            }
+            if (!a.isBitset() && !b.isBitset()) {
+                auto i = a.array.begin(), j = b.array.begin();
+                while (i != a.array.end() && j != b.array.end()) {
+                    if (*i < *j) ++i;
+                    else if (*j < *i) ++j;
+                    else {
+                        if (!fn(high | *i)) return false;
+                        ++i;
+                        ++j;
+                    }
+                }
+                return true;
+            }
+            const Container& sparse = a.isBitset() ? b : a;
+            const Container& dense = a.isBitset() ? a : b;
+            for (uint16_t v : sparse.array) {
+                if (dense.contains(v) && !fn(high | v)) return false;
+            }
+            return true;
+        }
+    };
+
+    std::map<uint32_t, Container> containers;  // keyed by position >> 16
+    size_t count = 0;
+
+public:
+    void add(uint32_t pos) {
+        if (containers[pos >> 16].add(static_cast<uint16_t>(pos))) ++count;
+    }
+
+    void remove(uint32_t pos) {
+        auto it = containers.find(pos >> 16);
+        if (it == containers.end() || !it->second.remove(static_cast<uint16_t>(pos))) return;
+        --count;
+        if (it->second.cardinality == 0) containers.erase(it);
+    }
+
+    void set(uint32_t pos, bool value) {
+        if (value) add(pos);
+        else remove(pos);
+    }
+
+    bool contains(uint32_t pos) const {
+        auto it = containers.find(pos >> 16);
+        return it != containers.end() && it->second.contains(static_cast<uint16_t>(pos));
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    void clear() {
+        containers.clear();
+        count = 0;
+    }
+
+    // Visits members in ascending order; fn returns false to stop early
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        for (const auto& [high, container] : containers) {
+            if (!container.forEach(high << 16, fn)) return;
+        }
+    }
+
+    // Visits members of a AND b in ascending order without materializing the result
+    template <typename Fn>
+    static void forEachIntersection(const RoaringBitmap& a, const RoaringBitmap& b, Fn&& fn) {
+        auto i = a.containers.begin(), j = b.containers.begin();
+        while (i != a.containers.end() && j != b.containers.end()) {
+            if (i->first < j->first) ++i;
+            else if (j->first < i->first) ++j;
+            else {
+                if (!Container::forEachCommon(i->second, j->second, i->first << 16, fn)) return;
+                ++i;
+                ++j;
+            }
+        }
+    }
+};
+
+// Category -> book position posting lists plus one availability bitmap, so
+// "available books in category X" is a bitmap AND rather than a catalog scan.
+// Positions index LibraryManager::books and are kept in step as books come and go.
+class CategoryIndex {
+private:
+    std::unordered_map<const std::string*, RoaringBitmap> members;  // keyed by pooled category
+    RoaringBitmap available;
+    const RoaringBitmap emptyBitmap;
+
+    const RoaringBitmap& postings(const std::string* category) const {
+        auto it = members.find(category);
+        return it != members.end() ? it->second : emptyBitmap;
+    }
+
+public:
+    void clear() {
+        members.clear();
+        available.clear();
+    }
+
+    void add(uint32_t pos, const std::string* category, bool isAvailable) {
+        members[category].add(pos);
+        available.set(pos, isAvailable);
+    }
+
+    void remove(uint32_t pos, const std::string* category) {
+        auto it = members.find(category);
+        if (it != members.end()) {
+            it->second.remove(pos);
+            if (it->second.empty()) members.erase(it);
+        }
+        available.remove(pos);
+    }
+
+    void setAvailability(uint32_t pos, bool isAvailable) {
+        available.set(pos, isAvailable);
+    }
+
+    size_t countIn(const std::string* category) const { return postings(category).size(); }
+
+    // Category names in alphabetical order
+    std::vector<std::string> categories() const {
+        std::vector<std::string> names;
+        names.reserve(members.size());
+        for (const auto& entry : members) {
+            names.push_back(*entry.first);
+        }
+        std::sort(names.begin(), names.end());
+        return names;
+    }
+
+    // fn(pos) for every book in the category, in position order; return false to stop
+    template <typename Fn>
+    void forEachIn(const std::string* category, Fn&& fn) const {
+        postings(category).forEach(fn);
+    }
+
+    // fn(pos) for every available book in the category, in position order; return false to stop
+    template <typename Fn>
+    void forEachAvailableIn(const std::string* category, Fn&& fn) const {
+        RoaringBitmap::forEachIntersection(postings(category), available, fn);
+    }
+};
+
+// Book positions kept in a fixed order without moving the books themselves.
+// Entries live in blocks of up to 2 * BLOCK positions: a lookup binary-searches
+// the last entry of each block and then one block, and a Fenwick tree over the
+// block sizes finds the block holding the k-th entry. Insert, erase and "entry
+// k" are O(log N) plus a memmove within one block; only splitting or dropping
+// a block rebuilds the (N / BLOCK)-sized Fenwick tree. Less must be a strict
+// total order on positions (break ties on the position itself).
+template <typename Less>
+class OrderedView {
+private:
+    static constexpr size_t BLOCK = 512;
+
+    Less less;
+    std::vector<std::vector<uint32_t>> blocks;
+    std::vector<size_t> fenwick;  // 1-based, over blocks[i].size()
+    size_t count = 0;
+
+    void rebuildFenwick() {
+        fenwick.assign(blocks.size() + 1, 0);
+        for (size_t i = 1; i <= blocks.size(); ++i) {
+            fenwick[i] += blocks[i - 1].size();
+            size_t parent = i + (i & (~i + 1));
+            if (parent <= blocks.size()) fenwick[parent] += fenwick[i];
+        }
+    }
+
+    void adjust(size_t block, bool grow) {
+        for (size_t i = block + 1; i <= blocks.size(); i += i & (~i + 1)) {
+            if (grow) ++fenwick[i];
+            else --fenwick[i];
+        }
+    }
+
+    // First block whose last entry is not before pos (the last block if none is)
+    size_t blockFor(uint32_t pos) const {
+        size_t lo = 0, hi = blocks.size() - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (less(blocks[mid].back(), pos)) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+public:
+    explicit OrderedView(Less order) : less(order) {}
+
+    size_t size() const { return count; }
+
+    void clear() {
+        blocks.clear();
+        fenwick.clear();
+        count = 0;
+    }
+
+    // Bulk load, replacing the current contents. 'sorted' skips the sort for
+    // positions already in order (from a snapshot); they are still checked.
+    void assign(std::vector<uint32_t> positions, bool sorted = false) {
+        if (!sorted || !std::is_sorted(positions.begin(), positions.end(), less)) {
+            std::sort(positions.begin(), positions.end(), less);
+        }
+        blocks.clear();
+        for (size_t at = 0; at < positions.size(); at += BLOCK) {
+            blocks.emplace_back(positions.begin() + at, positions.begin() + std::min(positions.size(), at + BLOCK));
+        }
+        count = positions.size();
+        rebuildFenwick();
+    }
+
+    // Adds many positions at once: they are sorted among themselves and merged
+    // in, which beats one insert at a time once the batch is sizeable
+    void insertMany(std::vector<uint32_t> positions) {
+        std::sort(positions.begin(), positions.end(), less);
+        std::vector<uint32_t> merged;
+        merged.reserve(count + positions.size());
+        auto next = positions.begin();
+        for (const auto& block : blocks) {
+            for (uint32_t pos : block) {
+                while (next != positions.end() && less(*next, pos)) merged.push_back(*next++);
+                merged.push_back(pos);
+            }
+        }
+        merged.insert(merged.end(), next, positions.end());
+        blocks.clear();
+        for (size_t at = 0; at < merged.size(); at += BLOCK) {
+            blocks.emplace_back(merged.begin() + at, merged.begin() + std::min(merged.size(), at + BLOCK));
+        }
+        count = merged.size();
+        rebuildFenwick();
+    }
+
+    void insert(uint32_t pos) {
+        if (blocks.empty()) {
+            blocks.push_back({pos});
+            count = 1;
+            rebuildFenwick();
+            return;
+        }
+        size_t b = blockFor(pos);
+        auto& block = blocks[b];
+        block.insert(std::lower_bound(block.begin(), block.end(), pos, less), pos);
+        ++count;
+        if (block.size() > 2 * BLOCK) {
+            std::vector<uint32_t> upper(block.begin() + BLOCK, block.end());
+            block.resize(BLOCK);
+            blocks.insert(blocks.begin() + b + 1, std::move(upper));
+            rebuildFenwick();
+        } else {
+            adjust(b, true);
+        }
+    }
+
+    bool erase(uint32_t pos) {
+        if (blocks.empty()) return false;
+        size_t b = blockFor(pos);
+        auto& block = blocks[b];
+        auto it = std::lower_bound(block.begin(), block.end(), pos, less);
+        if (it == block.end() || *it != pos) return false;
+        block.erase(it);
+        --count;
+        if (block.empty()) {
+            blocks.erase(blocks.begin() + b);
+            rebuildFenwick();
+        } else {
+            adjust(b, false);
+        }
+        return true;
+    }
+
+    // fn(pos) for the entries from rank 'first' onwards, in order; return false to stop
+    template <typename Fn>
+    void forEachFrom(size_t first, Fn&& fn) const {
+        if (first >= count) return;
+        // Fenwick descent: the block holding entry 'first' and the entries before it
+        size_t b = 0, before = 0;
+        size_t step = 1;
+        while (step * 2 <= blocks.size()) step *= 2;
+        for (; step > 0; step /= 2) {
+            if (b + step <= blocks.size() && before + fenwick[b + step] <= first) {
+                b += step;
+                before += fenwick[b];
+            }
+        }
+        for (size_t offset = first - before; b < blocks.size(); ++b, offset = 0) {
+            for (size_t i = offset; i < blocks[b].size(); ++i) {
+                if (!fn(blocks[b][i])) return;
+            }
+        }
+    }
+};
+
+// Full-text index over book titles and authors. Terms live in a trie so a
+// query can expand prefixes ("harr" -> "harry") and match typos by walking the
+// trie with a Levenshtein DP row per node, pruning branches that can no longer
+// come within the allowed distance. Matches are ranked with BM25.
+class SearchIndex {
+public:
+    struct Hit {
+        std::string isbn;
+        double score;
+    };
+
+private:
+    struct Posting {
+        uint32_t doc;
+        uint32_t tf;
+    };
+
+    struct TrieNode {
+        std::vector<std::pair<char, uint32_t>> children;  // sorted by char
+        int32_t term = -1;
+    };
+
+    static constexpr double K1 = 1.2;
+    static constexpr double B = 0.75;
+    static constexpr size_t MAX_EXPANSIONS = 64;  // prefix/fuzzy terms considered per query token
+    static constexpr double PREFIX_WEIGHT = 0.9;
+    static constexpr double FUZZY_WEIGHT = 0.7;
+
+    std::vector<TrieNode> trie{1};                  // node 0 is the root
+    std::vector<std::vector<Posting>> postings;     // by term id
+    std::vector<std::string> docIsbn;               // by doc id; empty = free slot
+    std::vector<uint32_t> docLength;                // tokens per doc
+    std::vector<uint32_t> freeDocs;
+    std::unordered_map<std::string, uint32_t> docByIsbn;
+    uint64_t totalLength = 0;
+
+    uint32_t child(uint32_t node, char c) const {
+        const auto& kids = trie[node].children;
+        auto it = std::lower_bound(kids.begin(), kids.end(), c,
+            [](const std::pair<char, uint32_t>& e, char ch) { return e.first < ch; });
+        return (it != kids.end() && it->first == c) ? it->second : 0;
+    }
+
+    uint32_t termFor(const std::string& token) {
+        uint32_t node = 0;
+        for (char c : token) {
+            uint32_t next = child(node, c);
+            if (next == 0) {
+                next = static_cast<uint32_t>(trie.size());
+                trie.emplace_back();
+                auto& kids = trie[node].children;
+                auto it = std::lower_bound(kids.begin(), kids.end(), c,
+                    [](const std::pair<char, uint32_t>& e, char ch) { return e.first < ch; });
+                kids.insert(it, {c, next});
+            }
+            node = next;
+        }
+        if (trie[node].term < 0) {
+            trie[node].term = static_cast<int32_t>(postings.size());
+            postings.emplace_back();
+        }
+        return static_cast<uint32_t>(trie[node].term);
+    }
+
+    int32_t findTerm(const std::string& token) const {
+        uint32_t node = 0;
+        for (char c : token) {
+            node = child(node, c);
+            if (node == 0) return -1;
+        }
+        return trie[node].term;
+    }
+
+    // Terms under 'prefix', shortest first
+    void expandPrefix(const std::string& prefix, std::vector<uint32_t>& terms) const {
+        uint32_t node = 0;
+        for (char c : prefix) {
+            node = child(node, c);
+            if (node == 0) return;
+        }
+        std::deque<uint32_t> frontier{node};
+        while (!frontier.empty() && terms.size() < MAX_EXPANSIONS) {
+            uint32_t n = frontier.front();
+            frontier.pop_front();
+            if (trie[n].term >= 0 && !postings[trie[n].term].empty()) terms.push_back(trie[n].term);
+            for (const auto& kid : trie[n].children) frontier.push_back(kid.second);
+        }
+    }
+
+    // Terms within maxEdits of 'word' (Levenshtein automaton simulated over the
+    // trie; adjacent transpositions count as one edit, as in "tolkein")
+    void fuzzyMatch(const std::string& word, int maxEdits, std::vector<uint32_t>& terms) const {
+        std::vector<int> firstRow(word.size() + 1);
+        for (size_t i = 0; i <= word.size(); ++i) firstRow[i] = static_cast<int>(i);
+        for (const auto& kid : trie[0].children) {
+            fuzzyWalk(kid.second, kid.first, '\0', word, firstRow, firstRow, maxEdits, terms);
+        }
+    }
+
+    void fuzzyWalk(uint32_t node, char c, char prevChar, const std::string& word,
+                   const std::vector<int>& prev2, const std::vector<int>& prev,
+                   int maxEdits, std::vector<uint32_t>& terms) const {
+        if (terms.size() >= MAX_EXPANSIONS) return;
+        std::vector<int> row(prev.size());
+        row[0] = prev[0] + 1;
+        int best = row[0];
+        for (size_t i = 1; i < row.size(); ++i) {
+            int cost = word[i - 1] == c ? 0 : 1;
+            row[i] = std::min({row[i - 1] + 1, prev[i] + 1, prev[i - 1] + cost});
+            if (i > 1 && prevChar != '\0' && word[i - 1] == prevChar && word[i - 2] == c) {
+                row[i] = std::min(row[i], prev2[i - 2] + 1);
+            }
+            best = std::min(best, row[i]);
+        }
+        if (row.back() <= maxEdits && trie[node].term >= 0 && !postings[trie[node].term].empty()) {
+            terms.push_back(static_cast<uint32_t>(trie[node].term));
+        }
+        // A transposition can still reach back one row, so prune only when both rows are out of range
+        int bestPrev = *std::min_element(prev.begin(), prev.end());
+        if (best > maxEdits && bestPrev + 1 > maxEdits) return;
+        for (const auto& kid : trie[node].children) {
+            fuzzyWalk(kid.second, kid.first, c, word, prev, row, maxEdits, terms);
+        }
+    }
+
+    void accumulate(uint32_t term, double weight, std::unordered_map<uint32_t, double>& scores) const {
+        const auto& list = postings[term];
+        double liveDocs = static_cast<double>(docByIsbn.size());
+        double avgLength = liveDocs > 0 ? static_cast<double>(totalLength) / liveDocs : 1.0;
+        double df = static_cast<double>(list.size());
+        double idf = std::log(1.0 + (liveDocs - df + 0.5) / (df + 0.5));
+        for (const auto& p : list) {
+            double tf = p.tf;
+            double norm = K1 * (1.0 - B + B * docLength[p.doc] / avgLength);
+            scores[p.doc] += weight * idf * (tf * (K1 + 1.0)) / (tf + norm);
+        }
+    }
+
+public:
+    // Lower-cased alphanumeric runs
+    static std::vector<std::string> tokenize(std::string_view text) {
+        std::vector<std::string> tokens;
+        std::string current;
+        for (char ch : text) {
+            unsigned char c = static_cast<unsigned char>(ch);
+            if (std::isalnum(c) || c >= 0x80) {
+                current += static_cast<char>(std::tolower(c));
+            } else if (!current.empty()) {
+                tokens.push_back(std::move(current));
+                current.clear();
+            }
+        }
+        if (!current.empty()) tokens.push_back(std::move(current));
+        return tokens;
+    }
+
+    void clear() {
+        *this = SearchIndex();
+    }
+
+    size_t size() const { return docByIsbn.size(); }
+
+    // Indexes a book; a second book with an already indexed ISBN is ignored
+    void add(const std::string& isbn, const std::string& title, const std::string& author) {
+        if (docByIsbn.count(isbn)) return;
+        uint32_t doc;
+        if (!freeDocs.empty()) {
+            doc = freeDocs.back();
+            freeDocs.pop_back();
+        } else {
+            doc = static_cast<uint32_t>(docIsbn.size());
+            docIsbn.emplace_back();
+            docLength.push_back(0);
+        }
+        docIsbn[doc] = isbn;
+        docByIsbn.emplace(isbn, doc);
+
+        std::vector<std::string> tokens = tokenize(title);
+        std::vector<std::string> authorTokens = tokenize(author);
+        tokens.insert(tokens.end(), authorTokens.begin(), authorTokens.end());
+        docLength[doc] = static_cast<uint32_t>(tokens.size());
+        totalLength += tokens.size();
+
+        std::sort(tokens.begin(), tokens.end());
+        for (size_t i = 0; i < tokens.size();) {
+            size_t j = i;
+            while (j < tokens.size() && tokens[j] == tokens[i]) ++j;
+            auto& list = postings[termFor(tokens[i])];
+            auto it = std::lower_bound(list.begin(), list.end(), doc,
+                [](const Posting& p, uint32_t d) { return p.doc < d; });
+            list.insert(it, Posting{doc, static_cast<uint32_t>(j - i)});
+            i = j;
+        }
+    }
+
+    // Unindexes a book; title/author must be what was passed to add()
+    void remove(const std::string& isbn, const std::string& title, const std::string& author) {
+        auto found = docByIsbn.find(isbn);
+        if (found == docByIsbn.end()) return;
+        uint32_t doc = found->second;
+
+        std::vector<std::string> tokens = tokenize(title);
+        std::vector<std::string> authorTokens = tokenize(author);
+        tokens.insert(tokens.end(), authorTokens.begin(), authorTokens.end());
+        std::sort(tokens.begin(), tokens.end());
+        tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+        for (const auto& token : tokens) {
+            int32_t term = findTerm(token);
+            if (term < 0) continue;
+            auto& list = postings[term];
+            auto it = std::lower_bound(list.begin(), list.end(), doc,
+                [](const Posting& p, uint32_t d) { return p.doc < d; });
+            if (it != list.end() && it->doc == doc) list.erase(it);
+        }
+
+        totalLength -= docLength[doc];
+        docLength[doc] = 0;
+        docIsbn[doc].clear();
+        freeDocs.push_back(doc);
+        docByIsbn.erase(found);
+    }
+
+    // Top-k books for a free-text query. Every token matches exactly and, when
+    // long enough, within 1-2 typos; the last token also matches as a prefix.
+    std::vector<Hit> search(const std::string& query, size_t k) const {
+        std::vector<std::string> tokens = tokenize(query);
+        std::unordered_map<uint32_t, double> scores;
+        for (size_t t = 0; t < tokens.size(); ++t) {
+            const std::string& token = tokens[t];
+            std::vector<uint32_t> exact, expanded;
+            int32_t term = findTerm(token);
+            if (term >= 0) exact.push_back(static_cast<uint32_t>(term));
+            double expandedWeight = FUZZY_WEIGHT;
+            if (t + 1 == tokens.size()) {
+                expandPrefix(token, expanded);
+                expandedWeight = PREFIX_WEIGHT;
+            }
+            int maxEdits = token.size() >= 8 ? 2 : (token.size() >= 4 ? 1 : 0);
+            if (expanded.empty() && maxEdits > 0) {
+                fuzzyMatch(token, maxEdits, expanded);
+                expandedWeight = FUZZY_WEIGHT;
+            }
+            for (uint32_t e : exact) accumulate(e, 1.0, scores);
+            for (uint32_t e : expanded) {
+                if (term < 0 || e != static_cast<uint32_t>(term)) accumulate(e, expandedWeight, scores);
+            }
+        }
+
+        std::vector<std::pair<double, uint32_t>> ranked;
+        ranked.reserve(scores.size());
+        for (const auto& [doc, score] : scores) ranked.emplace_back(score, doc);
+        size_t top = std::min(k, ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + top, ranked.end(),
+            [](const auto& a, const auto& b) { return a.first > b.first || (a.first == b.first && a.second < b.second); });
+
+        std::vector<Hit> hits;
+        hits.reserve(top);
+        for (size_t i = 0; i < top; ++i) {
+            hits.push_back(Hit{docIsbn[ranked[i].second], ranked[i].first});
+        }
+        return hits;
+    }
+};
+
+// Category affinity learned from borrowing: two categories are linked with a
+// weight equal to the number of borrowers who have borrowed from both. For
+// recommendations the weights are laid out as a CSR graph (Model) and each
+// category's related categories are ranked by personalized PageRank.
+//
+// The graph itself is guarded by the owner's lock, but ranking is not done
+// under it: lookup() hands out a published Model (or the edges to build a new
+// one), rank() runs the walk without the lock, and publish() swaps the model
+// in and caches the result. A walk from a category only reaches its connected
+// component, so a new link invalidates only the rankings in the component(s)
+// it joins; rankings elsewhere stay cached.
+class CoBorrowGraph {
+public:
+    struct Related {
+        const std::string* category;
+        double score;
+    };
+
+    struct Link {
+        const std::string* from;
+        const std::string* to;
+        uint32_t weight;
+    };
+
+    // Copy of the links at one version, enough to build a Model from
+    struct Edges {
+        uint64_t version = 0;
+        std::vector<const std::string*> nodes;
+        std::vector<std::pair<uint64_t, uint32_t>> weights;
+    };
+
+    // Read-only CSR adjacency at one version; shared by concurrent rankings
+    class Model {
+    public:
+        uint64_t version;
+        std::vector<const std::string*> nodes;
+        std::vector<uint32_t> offsets, targets;
+        std::vector<double> transition;  // edge weight / total weight of the source node
+
+        explicit Model(const Edges& edges) : version(edges.version), nodes(edges.nodes) {
+            std::vector<uint32_t> degree(nodes.size() + 1, 0);
+            for (const auto& entry : edges.weights) {
+                ++degree[entry.first >> 32];
+                ++degree[entry.first & 0xFFFFFFFFu];
+            }
+            offsets.assign(nodes.size() + 1, 0);
+            for (size_t i = 0; i < nodes.size(); ++i) offsets[i + 1] = offsets[i] + degree[i];
+            targets.assign(offsets.back(), 0);
+            transition.assign(offsets.back(), 0.0);
+            std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+            std::vector<double> total(nodes.size(), 0.0);
+            for (const auto& [k, w] : edges.weights) {
+                uint32_t a = static_cast<uint32_t>(k >> 32), b = static_cast<uint32_t>(k & 0xFFFFFFFFu);
+                targets[fill[a]] = b;
+                transition[fill[a]++] = w;
+                targets[fill[b]] = a;
+                transition[fill[b]++] = w;
+                total[a] += w;
+                total[b] += w;
+            }
+            for (size_t n = 0; n < nodes.size(); ++n) {
+                for (uint32_t e = offsets[n]; e < offsets[n + 1]; ++e) transition[e] /= total[n];
+            }
+        }
+    };
+
+    // What a ranking done outside the lock needs
+    struct RankJob {
+        uint32_t source = 0;
+        std::shared_ptr<const Model> model;  // null: build one from 'edges'
+        Edges edges;
+    };
+
+private:
+    static constexpr size_t TOP_K = 5;
+    static constexpr double RESTART = 0.15;
+    static constexpr int ITERATIONS = 20;
+
+    std::unordered_map<const std::string*, uint32_t> nodeOf;
+    std::vector<const std::string*> nodes;
+    std::unordered_map<uint64_t, uint32_t> weights;  // (low node << 32 | high node) -> weight
+    uint64_t version = 0;
+    uint64_t clearedAt = 0;  // models and rankings from before this refer to old nodes
+
+    // Connected components (union-find) and, per root, the version of the
+    // last link added inside that component
+    std::vector<uint32_t> parent;
+    std::vector<uint64_t> changedAt;
+
+    std::shared_ptr<const Model> model;  // latest published, possibly stale
+
+    struct Ranking {
+        bool valid = false;
+        uint64_t version = 0;
+        std::vector<Related> top;
+    };
+    std::vector<Ranking> rankings;
+
+    uint32_t node(const std::string* category) {
+        auto it = nodeOf.find(category);
+        if (it != nodeOf.end()) return it->second;
+        uint32_t id = static_cast<uint32_t>(nodes.size());
+        nodeOf.emplace(category, id);
+        nodes.push_back(category);
+        parent.push_back(id);
+        changedAt.push_back(version);
+        rankings.emplace_back();
+        return id;
+    }
+
+    uint32_t root(uint32_t n) {
+        while (parent[n] != n) {
+            parent[n] = parent[parent[n]];
+            n = parent[n];
+        }
+        return n;
+    }
+
+    static uint64_t key(uint32_t a, uint32_t b) {
+        if (a > b) std::swap(a, b);
+        return (static_cast<uint64_t>(a) << 32) | b;
+    }
+
+public:
+    void clear() {
+        uint64_t next = version + 1;
+        *this = CoBorrowGraph();
+        version = clearedAt = next;
+    }
+
+    // One more borrower has borrowed from both categories
+    void addCoBorrow(const std::string* a, const std::string* b) {
+        if (a == b) return;
+        uint32_t na = node(a), nb = node(b);
+        ++weights[key(na, nb)];
+        ++version;
+        uint32_t ra = root(na), rb = root(nb);
+        if (ra != rb) parent[rb] = ra;
+        changedAt[ra] = version;
+    }
+
+    // Caller holds the graph's lock. Returns true with the related categories,
+    // best first, in 'out' when a current ranking is cached (or the category
+    // has no links). Otherwise returns false and prepares 'job' for rank().
+    bool lookup(const std::string* category, std::vector<Related>& out, RankJob& job) {
+        out.clear();
+        auto it = nodeOf.find(category);
+        if (it == nodeOf.end()) return true;
+        uint32_t source = it->second;
+        const Ranking& ranking = rankings[source];
+        if (ranking.valid && ranking.version >= changedAt[root(source)]) {
+            out = ranking.top;
+            return true;
+        }
+        job.source = source;
+        if (model && model->version == version) {
+            job.model = model;
+        } else {
+            job.model = nullptr;
+            job.edges.version = version;
+            job.edges.nodes = nodes;
+            job.edges.weights.assign(weights.begin(), weights.end());
+        }
+        return false;
+    }
+
+    // Personalized PageRank from job.source; needs no lock. Builds the model
+    // first if lookup() could not hand out a current one.
+    static std::vector<Related> rank(RankJob& job) {
+        if (!job.model) job.model = std::make_shared<const Model>(job.edges);
+        const Model& m = *job.model;
+        size_t count = m.nodes.size();
+        uint32_t source = job.source;
+        std::vector<double> score(count, 0.0), next(count);
+        score[source] = 1.0;
+        for (int iter = 0; iter < ITERATIONS; ++iter) {
+            std::fill(next.begin(), next.end(), 0.0);
+            next[source] = RESTART;
+            for (size_t n = 0; n < count; ++n) {
+                if (score[n] == 0.0) continue;
+                if (m.offsets[n] == m.offsets[n + 1]) {
+                    next[source] += (1.0 - RESTART) * score[n];  // dangling: jump back home
+                    continue;
+                }
+                for (uint32_t e = m.offsets[n]; e < m.offsets[n + 1]; ++e) {
+                    next[m.targets[e]] += (1.0 - RESTART) * score[n] * m.transition[e];
+                }
+            }
+            score.swap(next);
+        }
+
+        std::vector<Related> top;
+        for (size_t n = 0; n < count; ++n) {
+            if (n != source && score[n] > 0.0) top.push_back(Related{m.nodes[n], score[n]});
+        }
+        size_t k = std::min(TOP_K, top.size());
+        std::partial_sort(top.begin(), top.begin() + k, top.end(),
+            [](const Related& a, const Related& b) { return a.score > b.score; });
+        top.resize(k);
+        return top;
+    }
+
+    // Caller holds the graph's lock again. Publishes the job's model if it is
+    // newer than the current one and caches the ranking unless a link added
+    // meanwhile has already made it stale.
+    void publish(const RankJob& job, const std::vector<Related>& top) {
+        uint64_t built = job.model->version;
+        if (built < clearedAt) return;
+        if (!model || model->version < built) model = job.model;
+        if (changedAt[root(job.source)] > built) return;
+        Ranking& ranking = rankings[job.source];
+        ranking.valid = true;
+        ranking.version = built;
+        ranking.top = top;
+    }
+
+    // Every link once, heaviest first
+    std::vector<Link> links() const {
+        std::vector<Link> result;
+        result.reserve(weights.size());
+        for (const auto& [k, w] : weights) {
+            result.push_back(Link{nodes[k >> 32], nodes[k & 0xFFFFFFFFu], w});
+        }
+        std::sort(result.begin(), result.end(), [](const Link& a, const Link& b) {
+            return a.weight != b.weight ? a.weight > b.weight : *a.from + *a.to < *b.from + *b.to;
+        });
+        return result;
+    }
+};
+
+// "Patrons who borrowed this also borrowed": item-to-item similarity over the
+// borrower x book matrix. Each book is represented by the set of borrowers
+// who have had it. MinHash signatures, cut into LSH bands, pick the candidate
+// pairs; candidates are then scored exactly (cosine of the two borrower sets)
+// by intersecting the sorted borrower lists. Building works on a private copy
+// of the loans and is split across threads; the finished model is read-only.
+class ItemSimilarity {
+public:
+    struct Neighbor {
+        uint32_t item;
+        float score;
+    };
+
+private:
+    static constexpr size_t TOP_K = 10;
+    static constexpr int BANDS = 16;
+    static constexpr int ROWS = 2;  // hashes per band
+    static constexpr int HASHES = BANDS * ROWS;
+    static constexpr size_t BUCKET_SCAN = 32;  // neighbours looked at on each side, per band
+
+    std::unordered_map<std::string, uint32_t> itemOf;
+    std::vector<std::string> itemIsbn;
+    std::vector<std::vector<Neighbor>> neighbors;
+
+    static uint64_t mix(uint64_t x) {
+        x += 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+
+    // Size of the intersection of two sorted lists; gallops through the longer
+    // one when the lengths are far apart (a popular book against a rare one)
+    static uint32_t overlap(const uint32_t* a, size_t na, const uint32_t* b, size_t nb) {
+        if (na > nb) {
+            std::swap(a, b);
+            std::swap(na, nb);
+        }
+        uint32_t count = 0;
+        if (nb > 32 * na) {
+            const uint32_t* from = b;
+            for (size_t i = 0; i < na && from != b + nb; ++i) {
+                from = std::lower_bound(from, b + nb, a[i]);
+                if (from != b + nb && *from == a[i]) ++count;
+            }
+            return count;
+        }
+        size_t i = 0, j = 0;
+        while (i < na && j < nb) {
+            if (a[i] < b[j]) ++i;
+            else if (b[j] < a[i]) ++j;
+            else { ++count; ++i; ++j; }
+        }
+        return count;
+    }
+
+    template <typename Fn>
+    static void parallelFor(size_t count, unsigned threads, Fn fn) {
+        threads = std::max(1u, std::min(threads, static_cast<unsigned>(count / 1024 + 1)));
+        if (threads == 1) {
+            fn(size_t(0), count);
+            return;
+        }
+        std::vector<std::thread> workers;
+        size_t step = (count + threads - 1) / threads;
+        for (size_t begin = 0; begin < count; begin += step) {
+            workers.emplace_back(fn, begin, std::min(count, begin + step));
+        }
+        for (auto& worker : workers) worker.join();
+    }
+
+public:
+    // isbns names the items; baskets[b] lists, without repeats, the items
+    // borrower b has borrowed
+    void build(std::vector<std::string> isbns, const std::vector<std::vector<uint32_t>>& baskets,
+               unsigned threads) {
+        const size_t items = isbns.size();
+        itemIsbn = std::move(isbns);
+        itemOf.clear();
+        for (size_t i = 0; i < items; ++i) itemOf.emplace(itemIsbn[i], static_cast<uint32_t>(i));
+
+        // Transpose to item -> borrowers; visiting borrowers in order leaves each list sorted
+        std::vector<uint32_t> offsets(items + 1, 0);
+        for (const auto& basket : baskets) {
+            for (uint32_t item : basket) ++offsets[item + 1];
+        }
+        for (size_t i = 0; i < items; ++i) offsets[i + 1] += offsets[i];
+        std::vector<uint32_t> users(offsets.back());
+        {
+            std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+            for (size_t b = 0; b < baskets.size(); ++b) {
+                for (uint32_t item : baskets[b]) users[fill[item]++] = static_cast<uint32_t>(b);
+            }
+        }
+        auto borrowed = [&](size_t item) { return offsets[item] != offsets[item + 1]; };
+
+        // MinHash signatures
+        std::vector<uint64_t> signature(items * HASHES, ~uint64_t(0));
+        parallelFor(items, threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                uint64_t* sig = &signature[i * HASHES];
+                for (uint32_t e = offsets[i]; e < offsets[i + 1]; ++e) {
+                    uint64_t h = mix(users[e]);
+                    for (int k = 0; k < HASHES; ++k) sig[k] = std::min(sig[k], mix(h + k));
+                }
+            }
+        });
+
+        // LSH: per band, items sorted by the hash of their rows; equal hashes share a bucket
+        std::vector<std::vector<std::pair<uint64_t, uint32_t>>> buckets(BANDS);
+        std::vector<uint32_t> slot(BANDS * items);  // where each item landed in each band
+        parallelFor(BANDS, threads, [&](size_t begin, size_t end) {
+            for (size_t band = begin; band < end; ++band) {
+                auto& keys = buckets[band];
+                for (size_t i = 0; i < items; ++i) {
+                    if (!borrowed(i)) continue;
+                    uint64_t key = band;
+                    for (int r = 0; r < ROWS; ++r) key = mix(key ^ signature[i * HASHES + band * ROWS + r]);
+                    keys.emplace_back(key, static_cast<uint32_t>(i));
+                }
+                std::sort(keys.begin(), keys.end());
+                for (size_t at = 0; at < keys.size(); ++at) slot[band * items + keys[at].second] = static_cast<uint32_t>(at);
+            }
+        });
+
+        // Exact scores for the candidates, best TOP_K kept per item
+        neighbors.assign(items, {});
+        parallelFor(items, threads, [&](size_t begin, size_t end) {
+            std::vector<uint32_t> candidates;
+            for (size_t i = begin; i < end; ++i) {
+                if (!borrowed(i)) continue;
+                candidates.clear();
+                for (int band = 0; band < BANDS; ++band) {
+                    const auto& keys = buckets[band];
+                    size_t at = slot[band * items + i];
+                    for (size_t j = at, n = 0; j-- > 0 && keys[j].first == keys[at].first && n < BUCKET_SCAN; ++n) {
+                        candidates.push_back(keys[j].second);
+                    }
+                    for (size_t j = at + 1, n = 0; j < keys.size() && keys[j].first == keys[at].first && n < BUCKET_SCAN; ++j, ++n) {
+                        candidates.push_back(keys[j].second);
+                    }
+                }
+                std::sort(candidates.begin(), candidates.end());
+                candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+                auto& best = neighbors[i];
+                size_t na = offsets[i + 1] - offsets[i];
+                for (uint32_t other : candidates) {
+                    size_t nb = offsets[other + 1] - offsets[other];
+                    uint32_t shared = overlap(&users[offsets[i]], na, &users[offsets[other]], nb);
+                    if (shared == 0) continue;
+                    best.push_back(Neighbor{other, static_cast<float>(shared / std::sqrt(double(na) * double(nb)))});
+                }
+                size_t k = std::min(TOP_K, best.size());
+                std::partial_sort(best.begin(), best.begin() + k, best.end(),
+                    [](const Neighbor& a, const Neighbor& b) { return a.score > b.score || (a.score == b.score && a.item < b.item); });
+                best.resize(k);
+                best.shrink_to_fit();
+            }
+        });
+    }
+
+    // ISBNs most often borrowed by the same patrons as 'isbn', best first
+    std::vector<std::string> similarTo(const std::string& isbn, size_t limit) const {
+        std::vector<std::string> result;
+        auto it = itemOf.find(isbn);
+        if (it == itemOf.end()) return result;
+        for (const Neighbor& n : neighbors[it->second]) {
+            if (result.size() >= limit) break;
+            result.push_back(itemIsbn[n.item]);
+        }
+        return result;
+    }
+};
+
+// Persistent category hierarchy. A category such as "Fiction/Mystery" is a
+// node under "Fiction"; books stay in LibraryManager::books and are reached
+// through CategoryIndex by the node's pooled path, so the tree itself only
+// holds names and counts. Nodes live in one vector and refer to each other by
+// index, and they are kept (empty) after their last book goes, so adding,
+// removing or re-categorising a book is a walk up its ancestors.
+class CategoryTree {
+public:
+    static constexpr char SEPARATOR = '/';
+    static constexpr uint32_t ROOT = 0;
+
+    struct Node {
+        std::string name;                // last path segment
+        const std::string* path;         // pooled full path, the CategoryIndex key
+        uint32_t parent;
+        std::vector<uint32_t> children;  // sorted by name
+        size_t direct = 0;               // books filed exactly here
+        size_t total = 0;                // books here and in all subcategories
+    };
+
+private:
+    std::vector<Node> nodes;
+    std::unordered_map<const std::string*, uint32_t> byPath;
+
+    uint32_t ensure(const std::string* path) {
+        auto it = byPath.find(path);
+        if (it != byPath.end()) return it->second;
+
+        uint32_t parent = ROOT;
+        size_t cut = path->rfind(SEPARATOR);
+        if (cut != std::string::npos && cut > 0) {
+            parent = ensure(StringPool::intern(std::string_view(*path).substr(0, cut)));
+        }
+        uint32_t id = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(Node{cut == std::string::npos ? *path : path->substr(cut + 1), path, parent, {}});
+        auto& siblings = nodes[parent].children;
+        siblings.insert(std::lower_bound(siblings.begin(), siblings.end(), id,
+            [this](uint32_t a, uint32_t b) { return nodes[a].name < nodes[b].name; }), id);
+        byPath.emplace(path, id);
+        return id;
+    }
+
+public:
+    CategoryTree() { clear(); }
+
+    void clear() {
+        nodes.clear();
+        byPath.clear();
+        nodes.push_back(Node{"", nullptr, ROOT, {}});
+    }
+
+    void add(const std::string* category) {
+        uint32_t id = ensure(category);
+        ++nodes[id].direct;
+        for (; id != ROOT; id = nodes[id].parent) ++nodes[id].total;
+        ++nodes[ROOT].total;
+    }
+
+    void remove(const std::string* category) {
+        auto it = byPath.find(category);
+        if (it == byPath.end()) return;
+        uint32_t id = it->second;
+        --nodes[id].direct;
+        for (; id != ROOT; id = nodes[id].parent) --nodes[id].total;
+        --nodes[ROOT].total;
+    }
+
+    // ROOT for an empty path; nullopt if no book was ever filed under it
+    std::optional<uint32_t> find(const std::string& path) const {
+        if (path.empty()) return ROOT;
+        const std::string* key = StringPool::find(path);
+        if (!key) return std::nullopt;
+        auto it = byPath.find(key);
+        if (it == byPath.end()) return std::nullopt;
+        return it->second;
+    }
+
+    const Node& node(uint32_t id) const { return nodes[id]; }
+};
+
+// Graph structure for category relationships
+struct CategoryGraph {
+    struct Edge {
+        std::string from;
+        std::string to;
+        int weight;  // Number of borrowers who have borrowed from both categories
+        
+        Edge(const std::string& f, const std::string& t, int w) 
+            : from(f), to(t), weight(w) {}
+    };
+    
+    std::map<std::string, std::vector<Edge>> adjacencyList;
+    
+    void addEdge(const std::string& from, const std::string& to, int weight) {
+        adjacencyList[from].push_back(Edge(from, to, weight));
+        adjacencyList[to].push_back(Edge(to, from, weight));  // Undirected graph
+    }
+    
+    void display() const {
+        std::cout << "\nCategory Relationships Graph:\n";
+        std::cout << "============================\n";
+        
+        // Display each category and its connections
+        for (const auto& [category, edges] : adjacencyList) {
+            if (!edges.empty()) {
+                std::cout << category << " is connected to:\n";
+                for (const auto& edge : edges) {
+                    std::cout << "  - " << edge.to 
+                             << " (Strength: " << edge.weight << " shared books)\n";
+                }
+                std::cout << "\n";
+            }
+        }
+    }
+};
+
+// A borrower's loans, held as pooled ISBNs (Book::getISBNKey) rather than
+// string copies. The first INLINE loans are stored in the object itself, so
+// the common patron with a handful of loans costs no allocation; longer lists
+// move to one heap array, and past INDEX_AFTER a position index makes
+// contains/remove O(1) for borrowers (schools, branches) holding thousands.
+// A book is on loan to a borrower at most once. Removal swaps the last loan
+// into the gap, so the order is not the checkout order.
+class LoanList {
+public:
+    using Key = const std::string*;
+
+private:
+    static constexpr uint32_t INLINE = 3;
+    static constexpr uint32_t INDEX_AFTER = 32;
+
+    uint32_t count = 0;
+    Key local[INLINE] = {};
+    std::vector<Key> spilled;  // every loan, once there have been more than INLINE
+    std::unique_ptr<std::unordered_map<Key, uint32_t>> index;  // loan -> position in spilled
+
+    Key* data() { return spilled.empty() ? local : spilled.data(); }
+    const Key* data() const { return spilled.empty() ? local : spilled.data(); }
+
+    // Position of 'key', or count when it is not on loan
+    uint32_t find(Key key) const {
+        if (index) {
+            auto it = index->find(key);
+            return it != index->end() ? it->second : count;
+        }
+        const Key* keys = data();
+        uint32_t i = 0;
+        while (i < count && keys[i] != key) ++i;
+        return i;
+    }
+
+public:
+    class const_iterator {
+    private:
+        const Key* at;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::string;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string*;
+        using reference = const std::string&;
+
+        explicit const_iterator(const Key* p) : at(p) {}
+        const std::string& operator*() const { return **at; }
+        const std::string* operator->() const { return *at; }
+        Key key() const { return *at; }
+        const_iterator& operator++() { ++at; return *this; }
+        bool operator==(const const_iterator& other) const { return at == other.at; }
+        bool operator!=(const const_iterator& other) const { return at != other.at; }
+    };
+
+    // Each key on the list holds a StringPool reference, so the ISBN of a
+    // book removed while on loan stays valid until it is returned
+    LoanList() = default;
+
+    LoanList(LoanList&& other) noexcept
+        : count(std::exchange(other.count, 0)), spilled(std::move(other.spilled)), index(std::move(other.index)) {
+        std::copy(std::begin(other.local), std::end(other.local), local);
+        other.spilled.clear();
+    }
+
+    LoanList& operator=(LoanList&& other) noexcept {
+        if (this != &other) {
+            LoanList(std::move(other)).swap(*this);
+        }
+        return *this;
+    }
+
+    LoanList(const LoanList& other)
+        : count(other.count), spilled(other.spilled),
+          index(other.index ? std::make_unique<std::unordered_map<Key, uint32_t>>(*other.index) : nullptr) {
+        std::copy(std::begin(other.local), std::end(other.local), local);
+        for (uint32_t i = 0; i < count; ++i) StringPool::retain(data()[i]);
+    }
+
+    LoanList& operator=(const LoanList& other) {
+        if (this != &other) LoanList(other).swap(*this);
+        return *this;
+    }
+
+    ~LoanList() {
+        for (uint32_t i = 0; i < count; ++i) StringPool::release(data()[i]);
+    }
+
+    void swap(LoanList& other) noexcept {
+        std::swap(count, other.count);
+        std::swap(local, other.local);
+        spilled.swap(other.spilled);
+        index.swap(other.index);
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const_iterator begin() const { return const_iterator(data()); }
+    const_iterator end() const { return const_iterator(data() + count); }
+
+    bool contains(Key key) const { return find(key) < count; }
+
+    // False if the book was already on the list
+    bool add(Key key) {
+        if (contains(key)) return false;
+        StringPool::retain(key);
+        if (spilled.empty() && count == INLINE) spilled.assign(local, local + count);
+        if (spilled.empty()) {
+            local[count] = key;
+        } else {
+            spilled.push_back(key);
+        }
+        if (index) {
+            index->emplace(key, count);
+        } else if (count + 1 > INDEX_AFTER) {
+            index = std::make_unique<std::unordered_map<Key, uint32_t>>();
+            index->reserve(count + 1);
+            for (uint32_t i = 0; i <= count; ++i) index->emplace(spilled[i], i);
+        }
+        ++count;
+        return true;
+    }
+
+    // False if the book was not on the list
+    bool remove(Key key) {
+        uint32_t pos = find(key);
+        if (pos == count) return false;
+        Key* keys = data();
+        Key last = keys[count - 1];
+        keys[pos] = last;
+        if (index) {
+            (*index)[last] = pos;
+            index->erase(key);
+        }
+        if (!spilled.empty()) spilled.pop_back();
+        --count;
+        if (count == 0) {
+            // Hand the heap array and the index back once a large list drains
+            std::vector<Key>().swap(spilled);
+            index.reset();
+        }
+        StringPool::release(key);
+        return true;
+    }
+};
+
+// Borrower class definition
+class Borrower {
+private:
+    std::string id;
+    std::string name;
+    LoanList borrowedBooks; // ISBNs of borrowed books
+
+public:
+    Borrower(const std::string& i = "", const std::string& n = "")
+        : id(i), name(n) {}
+
+    // Getters
+    const std::string& getID() const { return id; }
+    const std::string& getName() const { return name; }
+    const LoanList& getBorrowedBooks() const { return borrowedBooks; }
+
+    bool hasBorrowed(const std::string* isbnKey) const {
+        return borrowedBooks.contains(isbnKey);
+    }
+
+    bool hasBorrowed(std::string_view isbn) const {
+        const std::string* key = StringPool::find(isbn);
+        return key && borrowedBooks.contains(key);
+    }
+
+    // Setters
+    void setID(const std::string& i) { id = i; }
+    void setName(const std::string& n) { name = n; }
+
+    // Borrowing operations; pass Book::getISBNKey() where the book is at hand
+    void borrowBook(const std::string* isbnKey) {
+        borrowedBooks.add(isbnKey);
+    }
+
+    void borrowBook(std::string_view isbn) {
+        StringPool::Ref key(isbn);
+        borrowedBooks.add(key.get());
+    }
+
+    void returnBook(const std::string* isbnKey) {
+        borrowedBooks.remove(isbnKey);
+    }
+
+    void returnBook(std::string_view isbn) {
+        // An ISBN that was never pooled cannot be on anyone's list
+        if (const std::string* key = StringPool::find(isbn)) borrowedBooks.remove(key);
+    }
+
+    // CSV format conversion
+    std::string toCSV() const {
+        std::string books;
+        for (const auto& isbn : borrowedBooks) {
+            books += isbn + ";";
+        }
+        return csvEscape(id) + "," + csvEscape(name) + "," + csvEscape(books);
+    }
+};
+
+// Immutable point-in-time copy of the books and borrowers, for readers that
+// walk the whole catalog (full listings, saves) without holding up circulation.
+// Records live in fixed-size chunks that consecutive versions share, so
+// publishing a version copies only the chunks changed since the previous one.
+// A version, and any chunk no newer version shares, is freed when its last
+// reader lets go of it.
+class CatalogVersion {
+public:
+    static constexpr size_t CHUNK = 64;
+    template <typename T>
+    using Chunk = std::shared_ptr<const std::vector<T>>;
+
+    uint64_t epoch = 0;  // publication number; later versions have larger epochs
+    std::vector<Chunk<Book>> bookChunks;
+    std::vector<Chunk<Borrower>> borrowerChunks;
+    size_t bookTotal = 0;
+    size_t borrowerTotal = 0;
+
+    size_t bookCount() const { return bookTotal; }
+    size_t borrowerCount() const { return borrowerTotal; }
+    const Book& book(size_t i) const { return (*bookChunks[i / CHUNK])[i % CHUNK]; }
+    const Borrower& borrower(size_t i) const { return (*borrowerChunks[i / CHUNK])[i % CHUNK]; }
+
+    // Builds the next version from the live records. Chunks not flagged in
+    // 'changed' (and not resized) are shared with 'previous' rather than copied.
+    template <typename T>
+    static void copyChunks(const std::vector<T>& live, const std::vector<Chunk<T>>* previous,
+                           const std::vector<bool>& changed, std::vector<Chunk<T>>& out) {
+        size_t chunks = (live.size() + CHUNK - 1) / CHUNK;
+        out.resize(chunks);
+        for (size_t c = 0; c < chunks; ++c) {
+            size_t begin = c * CHUNK, end = std::min(live.size(), begin + CHUNK);
+            bool reusable = previous && c < previous->size() && (c >= changed.size() || !changed[c]) &&
+                            (*previous)[c]->size() == end - begin;
+            out[c] = reusable ? (*previous)[c]
+                              : std::make_shared<const std::vector<T>>(live.begin() + begin, live.begin() + end);
+        }
+    }
+};
+
+// Binary snapshot of the catalog (library.snap). Layout, all integers little-endian:
+//   SnapshotHeader
+//   string table   - concatenated UTF-8 bytes, referenced by (offset, length)
+//   book records   - fixed-width SnapshotBook entries
+//   borrower records
+//   loan list      - StringRefs to ISBNs, sliced by SnapshotBorrower::firstLoan/loanCount
+//   title, author and category orders - book record numbers in listing order
+// Every section starts on an 8-byte boundary so the file can be mapped and read in place.
+// The live catalog is made of mutable Book and Borrower objects, so startup
+// still copies each record out of the mapping, but without parsing any text.
+// The index sections hold what is costly to rebuild: the sorted listing
+// orders, which would otherwise mean sorting the catalog three times. The
+// ISBN and ID hash indexes are rebuilt in one linear pass instead of being
+// stored (version 1 stored them as sorted lookup tables nothing read).
+namespace snapshot {
+
+constexpr char MAGIC[8] = {'L', 'I', 'B', 'S', 'N', 'A', 'P', '\0'};
+constexpr uint32_t VERSION = 3;
+constexpr uint32_t BOOK_AVAILABLE = 1u << 0;
+
+struct StringRef {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct Section {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t bookCount;
+    uint32_t borrowerCount;
+    uint32_t loanCount;
+    Section strings;
+    Section books;
+    Section borrowers;
+    Section loans;
+    Section titleOrder;
+    Section authorOrder;
+    Section categoryOrder;
+};
+
+// Book record numbers in each listing order, as kept by LibraryManager's views
+struct Orders {
+    std::vector<uint32_t> title;
+    std::vector<uint32_t> author;
+    std::vector<uint32_t> category;
+};
+
+struct BookRecord {
+    StringRef title;
+    StringRef author;
+    StringRef isbn;
+    StringRef category;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct BorrowerRecord {
+    StringRef id;
+    StringRef name;
+    uint32_t firstLoan;
+    uint32_t loanCount;
+};
+
+// Read-only view over a mapped snapshot. Opening it checks every section,
+// string reference and loan slice against the file, so a truncated or corrupt
+// snapshot is rejected up front and the accessors can read without checks.
+class View {
+private:
+    MappedFile file;
+    const char* base = nullptr;
+    const Header* header = nullptr;
+
+    template <typename T>
+    const T* section(const Section& s) const {
+        return reinterpret_cast<const T*>(base + s.offset);
+    }
+
+    static bool sectionFits(const Section& s, size_t count, size_t width, size_t fileSize) {
+        return s.offset % 8 == 0 && s.offset <= fileSize && s.size <= fileSize - s.offset &&
+               s.size >= static_cast<uint64_t>(count) * width;
+    }
+
+    bool fits(const StringRef& ref) const {
+        return static_cast<uint64_t>(ref.offset) + ref.length <= header->strings.size;
+    }
+
+    bool recordsFit() const {
+        for (uint32_t i = 0; i < header->bookCount; ++i) {
+            const BookRecord& b = book(i);
+            if (!fits(b.title) || !fits(b.author) || !fits(b.isbn) || !fits(b.category)) return false;
+        }
+        for (uint32_t i = 0; i < header->borrowerCount; ++i) {
+            const BorrowerRecord& b = borrower(i);
+            if (!fits(b.id) || !fits(b.name) ||
+                static_cast<uint64_t>(b.firstLoan) + b.loanCount > header->loanCount) {
+                return false;
+            }
+        }
+        const StringRef* loans = section<StringRef>(header->loans);
+        for (uint32_t k = 0; k < header->loanCount; ++k) {
+            if (!fits(loans[k])) return false;
+        }
+        return true;
+    }
+
+public:
+    explicit View(const std::string& path) : file(path) {
+        std::string_view bytes = file.view();
+        if (!file.isOpen() || bytes.size() < sizeof(Header)) return;
+        const Header* h = reinterpret_cast<const Header*>(bytes.data());
+        if (std::memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0 || h->version != VERSION) return;
+        size_t n = bytes.size();
+        if (!sectionFits(h->strings, 0, 1, n) ||
+            !sectionFits(h->books, h->bookCount, sizeof(BookRecord), n) ||
+            !sectionFits(h->borrowers, h->borrowerCount, sizeof(BorrowerRecord), n) ||
+            !sectionFits(h->loans, h->loanCount, sizeof(StringRef), n) ||
+            !sectionFits(h->titleOrder, h->bookCount, sizeof(uint32_t), n) ||
+            !sectionFits(h->authorOrder, h->bookCount, sizeof(uint32_t), n) ||
+            !sectionFits(h->categoryOrder, h->bookCount, sizeof(uint32_t), n)) {
+            return;
+        }
+        base = bytes.data();
+        header = h;
+        if (!recordsFit()) header = nullptr;
+    }
+
+    bool isValid() const { return header != nullptr; }
+    uint32_t bookCount() const { return header->bookCount; }
+    uint32_t borrowerCount() const { return header->borrowerCount; }
+
+    std::string_view str(const StringRef& ref) const {
+        return std::string_view(base + header->strings.offset + ref.offset, ref.length);
+    }
+
+    // i < bookCount()
+    const BookRecord& book(uint32_t i) const { return section<BookRecord>(header->books)[i]; }
+    // i < borrowerCount()
+    const BorrowerRecord& borrower(uint32_t i) const { return section<BorrowerRecord>(header->borrowers)[i]; }
+
+    // k < b.loanCount
+    std::string_view loan(const BorrowerRecord& b, uint32_t k) const {
+        return str(section<StringRef>(header->loans)[b.firstLoan + k]);
+    }
+
+    // bookCount() record numbers each; not checked to be a permutation here
+    const uint32_t* titleOrder() const { return section<uint32_t>(header->titleOrder); }
+    const uint32_t* authorOrder() const { return section<uint32_t>(header->authorOrder); }
+    const uint32_t* categoryOrder() const { return section<uint32_t>(header->categoryOrder); }
+};
+
+// Serializes a catalog version and its listing orders into the snapshot layout
+// above. The file is written next to 'path' and renamed into place so a crash
+// never leaves a torn snapshot. Fails without writing anything if the strings
+// or counts do not fit the format's 32-bit fields.
+inline bool write(const std::string& path, const CatalogVersion& catalog, const Orders& orders) {
+    std::string strings;
+    std::unordered_map<std::string, StringRef> interned;  // authors/categories repeat a lot
+    auto intern = [&](const std::string& s) {
+        auto it = interned.find(s);
+        if (it != interned.end()) return it->second;
+        StringRef ref{static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(s.size())};
+        strings += s;
+        interned.emplace(s, ref);
+        return ref;
+    };
+
+    std::vector<BookRecord> bookRecords;
+    bookRecords.reserve(catalog.bookCount());
+    for (size_t i = 0; i < catalog.bookCount(); ++i) {
+        const Book& b = catalog.book(i);
+        bookRecords.push_back({intern(b.getTitle()), intern(b.getAuthor()), intern(b.getISBN()),
+                               intern(b.getCategory()), b.getAvailability() ? BOOK_AVAILABLE : 0u, 0});
+    }
+
+    std::vector<BorrowerRecord> borrowerRecords;
+    std::vector<StringRef> loans;
+    borrowerRecords.reserve(catalog.borrowerCount());
+    for (size_t i = 0; i < catalog.borrowerCount(); ++i) {
+        const Borrower& b = catalog.borrower(i);
+        BorrowerRecord rec{intern(b.getID()), intern(b.getName()),
+                           static_cast<uint32_t>(loans.size()),
+                           static_cast<uint32_t>(b.getBorrowedBooks().size())};
+        for (const auto& isbn : b.getBorrowedBooks()) {
+            loans.push_back(intern(isbn));
+        }
+        borrowerRecords.push_back(rec);
+    }
+
+    constexpr uint64_t LIMIT = std::numeric_limits<uint32_t>::max();
+    if (strings.size() > LIMIT || bookRecords.size() > LIMIT || borrowerRecords.size() > LIMIT ||
+        loans.size() > LIMIT || orders.title.size() != bookRecords.size() ||
+        orders.author.size() != bookRecords.size() || orders.category.size() != bookRecords.size()) {
+        return false;
+    }
+
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.bookCount = static_cast<uint32_t>(bookRecords.size());
+    header.borrowerCount = static_cast<uint32_t>(borrowerRecords.size());
+    header.loanCount = static_cast<uint32_t>(loans.size());
+
+    uint64_t offset = sizeof(Header);
+    auto place = [&offset](Section& s, uint64_t size) {
+        offset = (offset + 7) & ~uint64_t(7);
+        s.offset = offset;
+        s.size = size;
+        offset += size;
+    };
+    place(header.strings, strings.size());
+    place(header.books, bookRecords.size() * sizeof(BookRecord));
+    place(header.borrowers, borrowerRecords.size() * sizeof(BorrowerRecord));
+    place(header.loans, loans.size() * sizeof(StringRef));
+    place(header.titleOrder, orders.title.size() * sizeof(uint32_t));
+    place(header.authorOrder, orders.author.size() * sizeof(uint32_t));
+    place(header.categoryOrder, orders.category.size() * sizeof(uint32_t));
+
+    std::string tmpPath = path + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) return false;
+    uint64_t written = 0;
+    auto emit = [&](const Section& s, const void* data) {
+        static const char zeros[8] = {};
+        file.write(zeros, static_cast<std::streamsize>(s.offset - written));
+        file.write(static_cast<const char*>(data), static_cast<std::streamsize>(s.size));
+        written = s.offset + s.size;
+    };
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    written = sizeof(header);
+    emit(header.strings, strings.data());
+    emit(header.books, bookRecords.data());
+    emit(header.borrowers, borrowerRecords.data());
+    emit(header.loans, loans.data());
+    emit(header.titleOrder, orders.title.data());
+    emit(header.authorOrder, orders.author.data());
+    emit(header.categoryOrder, orders.category.data());
+    file.close();
+    if (!file) return false;
+    return replaceFile(tmpPath, path);
+}
+
+} // namespace snapshot
+
+// Append-only, checksummed log of catalog changes (library.wal). Each record is
+//   uint32 payload length | uint32 CRC-32 of payload | payload
+// where the payload is one op byte followed by length-prefixed string fields.
+// Records are buffered and written with a single fsync per batch (group commit).
+// While a save is writing the data files, the records it covers wait in a
+// rotated file (library.wal.1) and new records start a fresh log.
+class TransactionLog {
+public:
+    enum class Op : uint8_t {
+        AddBook = 1,      // title, author, isbn, category, available ("1"/"0")
+        RemoveBook = 2,   // isbn
+        AddBorrower = 3,  // id, name
+        Borrow = 4,       // isbn, borrower id, checkout (epoch seconds; absent in older logs)
+        Return = 5,       // isbn, borrower id, return time (epoch seconds; absent in older logs)
+        PlaceHold = 6,    // isbn, borrower id, tier, expiry (epoch seconds), "1" if first in its tier (optional)
+        CancelHold = 7,   // isbn, borrower id
+        SetCategory = 8,  // isbn, category
+        AdjustFine = 9,   // borrower id, cents added (negative refunds), balance afterwards (absent in older logs)
+        PrepareTransfer = 10,   // txid, BORROW|RETURN, isbn, borrower id (older logs add a deadline)
+        EndTransfer = 11,       // txid, "1" committed or "0" aborted
+        // Written by ShardRouter to router.wal rather than by a library:
+        CommitDecision = 12,    // txid, book shard address, borrower shard address
+        DecisionDelivered = 13, // txid; both shards have acknowledged the decision
+        // In both: the outcome of the transfer no longer needs remembering
+        ForgetTransfer = 14,    // txid
+        // router.wal only:
+        TransferBegun = 15,     // txid, book shard address, borrower shard address
+        AbortDecision = 16      // txid
+    };
+
+private:
+    std::string path;
+    std::string rotatedPath;
+    mutable std::mutex mutex;  // appends come from concurrent circulation calls
+    std::FILE* file = nullptr;
+    std::string pending;       // serialized records not yet written
+    size_t pendingCount = 0;
+    size_t groupSize;
+    size_t batchDepth = 0;
+    uint64_t bytesOnDisk = 0;
+
+    static uint32_t crc32(std::string_view data) {
+        static const std::vector<uint32_t> table = [] {
+            std::vector<uint32_t> t(256);
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                t[i] = c;
+            }
+            return t;
+        }();
+        uint32_t crc = 0xFFFFFFFFu;
+        for (unsigned char ch : data) crc = table[(crc ^ ch) & 0xFF] ^ (crc >> 8);
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    static void putU32(std::string& out, uint32_t v) {
+        char bytes[4];
+        std::memcpy(bytes, &v, sizeof(v));
+        out.append(bytes, sizeof(bytes));
+    }
+
+    static uint32_t getU32(const char* p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    // 0 for a missing log, and for one whose size cannot be read (not a
+    // regular file), which would otherwise read as (uintmax_t)-1
+    static uint64_t sizeOf(const std::string& logPath) {
+        std::error_code ec;
+        uint64_t size = std::filesystem::file_size(logPath, ec);
+        return ec ? 0 : size;
+    }
+
+    bool open() {
+        if (!file) file = std::fopen(path.c_str(), "ab");
+        return file != nullptr;
+    }
+
+    bool syncToDisk() {
+        LIBRARY_COUNT(LogSync);
+        return syncFile(file);
+    }
+
+    // Caller holds mutex. On failure the records stay pending for the next
+    // attempt and anything partly written is cut off again, so a retry never
+    // leaves a torn record in the middle of the log.
+    bool flushPending() {
+        if (pending.empty()) return true;
+        if (!open()) return false;
+        if (std::fwrite(pending.data(), 1, pending.size(), file) == pending.size() && syncToDisk()) {
+            bytesOnDisk += pending.size();
+            pending.clear();
+            pendingCount = 0;
+            return true;
+        }
+        std::fclose(file);
+        file = nullptr;
+        std::error_code ec;
+        std::filesystem::resize_file(path, bytesOnDisk, ec);
+        return false;
+    }
+
+    // Caller holds mutex
+    template <typename Apply>
+    size_t replayFile(const std::string& logPath, Apply& apply) {
+        size_t applied = 0;
+        uint64_t validBytes = 0;
+        {
+            MappedFile log(logPath);
+            if (!log.isOpen()) return 0;
+            std::string_view data = log.view();
+            std::vector<std::string_view> fields;
+            size_t pos = 0;
+            while (data.size() - pos >= 8) {
+                uint32_t length = getU32(data.data() + pos);
+                uint32_t checksum = getU32(data.data() + pos + 4);
+                if (length == 0 || data.size() - pos - 8 < length) break;
+                std::string_view payload = data.substr(pos + 8, length);
+                if (crc32(payload) != checksum) break;
+
+                fields.clear();
+                size_t p = 1;
+                bool wellFormed = true;
+                while (p < payload.size()) {
+                    if (payload.size() - p < 4) { wellFormed = false; break; }
+                    uint32_t len = getU32(payload.data() + p);
+                    p += 4;
+                    if (payload.size() - p < len) { wellFormed = false; break; }
+                    fields.push_back(payload.substr(p, len));
+                    p += len;
+                }
+                if (!wellFormed) break;
+                apply(static_cast<Op>(payload[0]), fields);
+                ++applied;
+                pos += 8 + length;
+            }
+            validBytes = pos;
+        }
+        std::error_code ec;
+        if (validBytes < std::filesystem::file_size(logPath, ec) && !ec) {
+            std::filesystem::resize_file(logPath, validBytes, ec);
+        }
+        return applied;
+    }
+
+public:
+    explicit TransactionLog(const std::string& p, size_t batch = 64)
+        : path(p), rotatedPath(p + ".1"), groupSize(batch), bytesOnDisk(sizeOf(path)) {}
+
+    ~TransactionLog() {
+        commit();
+        if (file) std::fclose(file);
+    }
+
+    TransactionLog(const TransactionLog&) = delete;
+    TransactionLog& operator=(const TransactionLog&) = delete;
+
+    uint64_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bytesOnDisk + pending.size();
+    }
+
+    void append(Op op, std::initializer_list<std::string_view> fields) {
+        std::string payload(1, static_cast<char>(op));
+        for (auto field : fields) {
+            putU32(payload, static_cast<uint32_t>(field.size()));
+            payload.append(field.data(), field.size());
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        putU32(pending, static_cast<uint32_t>(payload.size()));
+        putU32(pending, crc32(payload));
+        pending += payload;
+        if (++pendingCount >= groupSize && batchDepth == 0) flushPending();
+    }
+
+    // Appends between beginBatch() and the matching endBatch() are kept back
+    // and written and synced together, so a bulk operation costs one sync
+    void beginBatch() {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++batchDepth;
+    }
+
+    void endBatch() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--batchDepth == 0) flushPending();
+    }
+
+    // Writes the pending batch and forces it to stable storage; false if the
+    // records could not be made durable (they are kept for the next commit)
+    bool commit() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return flushPending();
+    }
+
+    // Calls apply(op, fields) for every intact record in file order, the
+    // rotated file first. A torn or corrupt tail (e.g. from a crash mid-write)
+    // ends that file's replay and is cut off.
+    template <typename Apply>
+    size_t replay(Apply apply) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t applied = replayFile(rotatedPath, apply);
+        applied += replayFile(path, apply);
+        bytesOnDisk = sizeOf(path);
+        return applied;
+    }
+
+    // Moves the records so far aside (see above) so a save can cover them
+    // while new records go to a fresh log. If an earlier save failed, its
+    // rotated records are kept and these are appended after them.
+    bool rotate() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!flushPending()) return false;
+        if (file) {
+            std::fclose(file);
+            file = nullptr;
+        }
+        std::error_code ec;
+        bytesOnDisk = 0;
+        if (!std::filesystem::exists(path, ec)) return true;
+        if (!std::filesystem::exists(rotatedPath, ec)) {
+            if (std::rename(path.c_str(), rotatedPath.c_str()) != 0) return false;
+            syncParentDirectory(path);
+            return true;
+        }
+        // A previous save failed and left library.wal.1 behind. Its records and
+        // the live log's must both be on disk in the rotated file before the live
+        // log is emptied, or a crash in between loses acknowledged changes.
+        std::FILE* out = std::fopen(rotatedPath.c_str(), "ab");
+        if (!out) return false;
+        bool copied = true;
+        {
+            MappedFile in(path);
+            std::string_view data = in.view();
+            copied = in.isOpen() && std::fwrite(data.data(), 1, data.size(), out) == data.size();
+        }
+        copied = syncFile(out) && !std::ferror(out) && copied;
+        if (std::fclose(out) != 0 || !copied) return false;
+        std::filesystem::resize_file(path, 0, ec);
+        return !ec;
+    }
+
+    // Called once the save that followed rotate() is on disk
+    void dropRotated() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::error_code ec;
+        std::filesystem::remove(rotatedPath, ec);
+    }
+};
+
+// Fixed-capacity ring buffer of circulation events. Records are 64-byte PODs
+// that refer to books and borrowers through small stable handles, so recording
+// an event never allocates once both keys have been seen. Each record also
+// links to the previous record for the same book and for the same borrower,
+// which lets per-ISBN and per-borrower history be read in time proportional to
+// the number of results. The newest records can be popped for undo.
+class TransactionHistory {
+public:
+    enum class Op : uint8_t {
+        Borrow = 1,
+        Return = 2,
+        HoldFilled = 3  // a return handed straight to the next patron with a hold
+    };
+
+    // For a Return: the loan it closed and the fine charged, so undo can
+    // reopen the loan as it was. Zero-initialized when there is none.
+    struct ClosedLoan {
+        int64_t checkedOut;  // 0 when the loan was not dated
+        int64_t due;
+        int64_t fine;        // cents
+    };
+
+    // For a HoldFilled, or a Borrow by a patron who had a hold: the hold it
+    // used up, so undo can put it back. Zero-initialized when there is none.
+    struct FilledHold {
+        uint8_t tier;       // HoldTier
+        int64_t expiresAt;  // 0 when there is none
+    };
+
+    struct Entry {
+        int64_t timestamp;
+        Op op;
+        std::string isbn;
+        std::string borrowerId;
+        ClosedLoan closed;
+        FilledHold hold;
+    };
+
+private:
+    static constexpr uint64_t NONE = ~uint64_t(0);
+
+    struct Record {
+        int64_t timestamp;
+        uint32_t book;
+        uint32_t borrower;
+        uint32_t prevSameBook;      // ring slot distance back (0 = none)
+        uint32_t prevSameBorrower;
+        Op op;
+        uint8_t holdTier;
+        ClosedLoan closed;
+        int64_t holdExpires;
+    };
+
+    std::vector<Record> ring;
+    uint64_t nextSeq = 0;           // sequence number of the next record
+    uint64_t oldestSeq = 0;         // oldest sequence number still valid
+
+    // Stable handles: ISBN/borrower ID -> small integer, never reused
+    std::unordered_map<std::string, uint32_t> bookHandles, borrowerHandles;
+    std::vector<std::string> isbnByHandle, borrowerByHandle;
+    std::vector<uint64_t> lastByBook, lastByBorrower;  // newest sequence per handle, or NONE
+
+    static uint32_t handleFor(const std::string& key, std::unordered_map<std::string, uint32_t>& handles,
+                              std::vector<std::string>& names, std::vector<uint64_t>& last) {
+        auto it = handles.find(key);
+        if (it != handles.end()) return it->second;
+        uint32_t handle = static_cast<uint32_t>(names.size());
+        handles.emplace(key, handle);
+        names.push_back(key);
+        last.push_back(NONE);
+        return handle;
+    }
+
+    bool live(uint64_t seq) const { return seq != NONE && seq >= oldestSeq && seq < nextSeq; }
+
+    const Record& at(uint64_t seq) const { return ring[seq % ring.size()]; }
+
+    Entry entryAt(uint64_t seq) const {
+        const Record& r = at(seq);
+        return Entry{r.timestamp, r.op, isbnByHandle[r.book], borrowerByHandle[r.borrower], r.closed,
+                     FilledHold{r.holdTier, r.holdExpires}};
+    }
+
+    template <typename Next>
+    std::vector<Entry> walk(uint64_t seq, size_t limit, Next next) const {
+        std::vector<Entry> entries;
+        while (entries.size() < limit && live(seq)) {
+            entries.push_back(entryAt(seq));
+            uint32_t back = next(at(seq));
+            if (back == 0 || back > seq) break;
+            seq -= back;
+        }
+        return entries;
+    }
+
+public:
+    explicit TransactionHistory(size_t capacity = 65536) : ring(capacity) {}
+
+    size_t size() const { return static_cast<size_t>(nextSeq - oldestSeq); }
+    size_t capacity() const { return ring.size(); }
+
+    void record(Op op, const std::string& isbn, const std::string& borrowerId, int64_t timestamp,
+                const ClosedLoan& closed = ClosedLoan{}, const FilledHold& hold = FilledHold{}) {
+        uint32_t book = handleFor(isbn, bookHandles, isbnByHandle, lastByBook);
+        uint32_t borrower = handleFor(borrowerId, borrowerHandles, borrowerByHandle, lastByBorrower);
+        uint64_t seq = nextSeq++;
+        if (nextSeq - oldestSeq > ring.size()) ++oldestSeq;  // overwrite the oldest record
+
+        auto distance = [seq, this](uint64_t prev) {
+            return live(prev) && seq - prev < ring.size() ? static_cast<uint32_t>(seq - prev) : 0u;
+        };
+        ring[seq % ring.size()] = Record{timestamp, book, borrower, distance(lastByBook[book]),
+                                         distance(lastByBorrower[borrower]), op, hold.tier, closed,
+                                         hold.expiresAt};
+        lastByBook[book] = seq;
+        lastByBorrower[borrower] = seq;
+    }
+
+    // Removes and returns the newest record (for undo)
+    std::optional<Entry> popNewest() {
+        if (nextSeq == oldestSeq) return std::nullopt;
+        uint64_t seq = nextSeq - 1;
+        Entry entry = entryAt(seq);
+        const Record& r = at(seq);
+        lastByBook[r.book] = r.prevSameBook ? seq - r.prevSameBook : NONE;
+        lastByBorrower[r.borrower] = r.prevSameBorrower ? seq - r.prevSameBorrower : NONE;
+        --nextSeq;
+        return entry;
+    }
+
+    std::optional<Entry> newest() const {
+        if (nextSeq == oldestSeq) return std::nullopt;
+        return entryAt(nextSeq - 1);
+    }
+
+    // Newest first
+    std::vector<Entry> recent(size_t limit) const {
+        std::vector<Entry> entries;
+        for (uint64_t seq = nextSeq; seq > oldestSeq && entries.size() < limit; --seq) {
+            entries.push_back(entryAt(seq - 1));
+        }
+        return entries;
+    }
+
+    // Book and borrower handles of the loans still in the ring (Borrow and
+    // HoldFilled records), oldest first. Handles are never reused, so a
+    // caller can keep the names it has resolved and fetch only newer ones.
+    std::vector<std::pair<uint32_t, uint32_t>> loanHandles() const {
+        std::vector<std::pair<uint32_t, uint32_t>> loans;
+        loans.reserve(size());
+        for (uint64_t seq = oldestSeq; seq < nextSeq; ++seq) {
+            const Record& r = at(seq);
+            if (r.op != Op::Return) loans.emplace_back(r.book, r.borrower);
+        }
+        return loans;
+    }
+
+    // Appends the ISBNs and borrower IDs of handles not yet in the lists
+    void namesSince(std::vector<std::string>& isbns, std::vector<std::string>& borrowerIds) const {
+        isbns.insert(isbns.end(), isbnByHandle.begin() + isbns.size(), isbnByHandle.end());
+        borrowerIds.insert(borrowerIds.end(), borrowerByHandle.begin() + borrowerIds.size(),
+                           borrowerByHandle.end());
+    }
+
+    std::vector<Entry> forBook(const std::string& isbn, size_t limit) const {
+        auto it = bookHandles.find(isbn);
+        if (it == bookHandles.end()) return {};
+        return walk(lastByBook[it->second], limit, [](const Record& r) { return r.prevSameBook; });
+    }
+
+    std::vector<Entry> forBorrower(const std::string& borrowerId, size_t limit) const {
+        auto it = borrowerHandles.find(borrowerId);
+        if (it == borrowerHandles.end()) return {};
+        return walk(lastByBorrower[it->second], limit, [](const Record& r) { return r.prevSameBorrower; });
+    }
+
+    static const char* opName(Op op) {
+        switch (op) {
+            case Op::Borrow: return "Borrow";
+            case Op::Return: return "Return";
+            case Op::HoldFilled: return "Hold filled";
+        }
+        return "?";
+    }
+};
+
+// Live circulation figures, updated as books come, go and circulate so every
+// read is O(1) (the top-titles list is O(TOP_CAPACITY)). Most-borrowed titles
+// use the Space-Saving heavy-hitters summary: TOP_CAPACITY counters, and a
+// title that is not being counted takes over the smallest counter, inheriting
+// its count as the error bound. Any title borrowed more than total/TOP_CAPACITY
+// times is guaranteed a counter.
+class CirculationStats {
+public:
+    struct Usage {
+        size_t books = 0;
+        size_t onLoan = 0;
+        uint64_t loans = 0;  // checkouts since startup
+
+        double utilization() const { return books ? static_cast<double>(onLoan) / books : 0.0; }
+    };
+
+    struct Title {
+        std::string isbn;
+        uint64_t count;  // upper bound on checkouts since startup
+        uint64_t error;  // count may overstate by at most this much
+    };
+
+    static constexpr size_t TOP_CAPACITY = 64;
+
+private:
+    std::unordered_map<const std::string*, Usage> byCategory;  // keyed by pooled category
+    Usage overall;
+    std::vector<uint64_t> loansByBorrower;  // by borrower position
+
+    // Space-Saving counters, with a min-heap on count to find the one to evict
+    std::vector<Title> counters;
+    std::unordered_map<std::string, size_t> counterOf;
+    std::vector<size_t> heap;     // counter indexes
+    std::vector<size_t> heapPos;  // counter index -> place in heap
+
+    bool heapLess(size_t a, size_t b) const { return counters[heap[a]].count < counters[heap[b]].count; }
+
+    void heapSwap(size_t a, size_t b) {
+        std::swap(heap[a], heap[b]);
+        heapPos[heap[a]] = a;
+        heapPos[heap[b]] = b;
+    }
+
+    void siftUp(size_t at) {
+        while (at > 0 && heapLess(at, (at - 1) / 2)) {
+            heapSwap(at, (at - 1) / 2);
+            at = (at - 1) / 2;
+        }
+    }
+
+    void siftDown(size_t at) {
+        while (true) {
+            size_t smallest = at, left = 2 * at + 1, right = left + 1;
+            if (left < heap.size() && heapLess(left, smallest)) smallest = left;
+            if (right < heap.size() && heapLess(right, smallest)) smallest = right;
+            if (smallest == at) return;
+            heapSwap(at, smallest);
+            at = smallest;
+        }
+    }
+
+    void countTitle(const std::string& isbn) {
+        auto it = counterOf.find(isbn);
+        if (it != counterOf.end()) {
+            ++counters[it->second].count;
+            siftDown(heapPos[it->second]);
+        } else if (counters.size() < TOP_CAPACITY) {
+            size_t index = counters.size();
+            counters.push_back(Title{isbn, 1, 0});
+            counterOf.emplace(isbn, index);
+            heap.push_back(index);
+            heapPos.push_back(heap.size() - 1);
+            siftUp(heap.size() - 1);
+        } else {
+            size_t victim = heap[0];
+            Title& counter = counters[victim];
+            counterOf.erase(counter.isbn);
+            counter.isbn = isbn;
+            counter.error = counter.count;
+            ++counter.count;
+            counterOf.emplace(isbn, victim);
+            siftDown(0);
+        }
+    }
+
+public:
+    void clear() {
+        *this = CirculationStats();
+    }
+
+    void bookAdded(const std::string* category, bool available) {
+        Usage& usage = byCategory[category];
+        ++usage.books;
+        ++overall.books;
+        if (!available) {
+            ++usage.onLoan;
+            ++overall.onLoan;
+        }
+    }
+
+    void bookRemoved(const std::string* category, bool available) {
+        Usage& usage = byCategory[category];
+        --usage.books;
+        --overall.books;
+        if (!available) {
+            --usage.onLoan;
+            --overall.onLoan;
+        }
+    }
+
+    // Borrower position for a checkout whose borrower is kept by another shard
+    static constexpr uint32_t REMOTE_BORROWER = std::numeric_limits<uint32_t>::max();
+
+    // counted = false moves the loan count without recording a checkout (replay, undo)
+    void loaned(const std::string* category, const std::string& isbn, uint32_t borrowerPos, bool counted) {
+        Usage& usage = byCategory[category];
+        ++usage.onLoan;
+        ++overall.onLoan;
+        if (!counted) return;
+        ++usage.loans;
+        ++overall.loans;
+        if (borrowerPos != REMOTE_BORROWER) borrowerLoaned(borrowerPos);
+        countTitle(isbn);
+    }
+
+    // The borrower's half of a checkout; on its own when the book is kept by another shard
+    void borrowerLoaned(uint32_t borrowerPos) {
+        if (borrowerPos >= loansByBorrower.size()) loansByBorrower.resize(borrowerPos + 1, 0);
+        ++loansByBorrower[borrowerPos];
+    }
+
+    void returned(const std::string* category) {
+        --byCategory[category].onLoan;
+        --overall.onLoan;
+    }
+
+    Usage category(const std::string* category) const {
+        auto it = byCategory.find(category);
+        return it != byCategory.end() ? it->second : Usage{};
+    }
+
+    const Usage& total() const { return overall; }
+
+    uint64_t loansBy(uint32_t borrowerPos) const {
+        return borrowerPos < loansByBorrower.size() ? loansByBorrower[borrowerPos] : 0;
+    }
+
+    // Most borrowed titles, best first
+    std::vector<Title> top(size_t n) const {
+        std::vector<Title> best(counters);
+        size_t k = std::min(n, best.size());
+        std::partial_sort(best.begin(), best.begin() + k, best.end(),
+            [](const Title& a, const Title& b) { return a.count > b.count || (a.count == b.count && a.isbn < b.isbn); });
+        best.resize(k);
+        return best;
+    }
+};
+
+// Priority tiers for holds; lower values are served first
+enum class HoldTier : uint8_t {
+    Staff = 0,
+    Accessibility = 1,
+    Regular = 2
+};
+
+// Per-ISBN hold queues. Each ISBN has one FIFO per priority tier, so placing a
+// hold and taking the next one are O(1). Expiry is driven by a timing wheel of
+// hourly slots: advancing the clock only visits the slots that have come due.
+// Expired or cancelled holds are dropped from the lookup tables immediately
+// and skipped lazily when they reach the front of their FIFO.
+class HoldQueues {
+public:
+    static constexpr size_t TIER_COUNT = 3;
+
+    struct HoldRecord {
+        std::string isbn;
+        std::string borrowerId;
+        HoldTier tier;
+        int64_t expiresAt;  // seconds since the epoch
+    };
+
+private:
+    static constexpr int64_t TICK_SECONDS = 3600;
+    static constexpr size_t WHEEL_SLOTS = 512;  // ~21 days per revolution
+
+    struct Queue {
+        std::array<std::deque<uint64_t>, TIER_COUNT> tiers;
+        std::unordered_map<std::string, uint64_t> byBorrower;
+    };
+
+    std::unordered_map<uint64_t, HoldRecord> active;   // hold id -> hold
+    std::unordered_map<std::string, Queue> queues;     // ISBN -> its queues
+    std::array<std::vector<uint64_t>, WHEEL_SLOTS> wheel;
+    int64_t currentTick = -1;
+    uint64_t nextId = 1;
+
+    void drop(uint64_t id) {
+        auto it = active.find(id);
+        if (it == active.end()) return;
+        auto q = queues.find(it->second.isbn);
+        if (q != queues.end()) {
+            q->second.byBorrower.erase(it->second.borrowerId);
+            if (q->second.byBorrower.empty()) queues.erase(q);  // stale FIFO entries go with it
+        }
+        active.erase(it);
+    }
+
+public:
+    size_t size() const { return active.size(); }
+
+    size_t pendingFor(const std::string& isbn) const {
+        auto q = queues.find(isbn);
+        return q == queues.end() ? 0 : q->second.byBorrower.size();
+    }
+
+    // Returns false if the borrower already holds this ISBN. 'first' puts the
+    // hold at the head of its tier, for one given back by an undone hand-off.
+    bool place(const std::string& isbn, const std::string& borrowerId, HoldTier tier, int64_t expiresAt,
+               bool first = false) {
+        Queue& q = queues[isbn];
+        if (q.byBorrower.count(borrowerId)) return false;
+        uint64_t id = nextId++;
+        active.emplace(id, HoldRecord{isbn, borrowerId, tier, expiresAt});
+        q.byBorrower.emplace(borrowerId, id);
+        auto& fifo = q.tiers[static_cast<size_t>(tier)];
+        if (first) {
+            fifo.push_front(id);
+        } else {
+            fifo.push_back(id);
+        }
+        wheel[static_cast<size_t>(expiresAt / TICK_SECONDS) % WHEEL_SLOTS].push_back(id);
+        return true;
+    }
+
+    // Returns the cancelled hold, or nothing if the borrower had none
+    std::optional<HoldRecord> cancel(const std::string& isbn, const std::string& borrowerId) {
+        auto q = queues.find(isbn);
+        if (q == queues.end()) return std::nullopt;
+        auto it = q->second.byBorrower.find(borrowerId);
+        if (it == q->second.byBorrower.end()) return std::nullopt;
+        std::optional<HoldRecord> hold = active.at(it->second);
+        drop(it->second);
+        return hold;
+    }
+
+    // Removes and returns the next live hold for the ISBN (highest tier, then
+    // oldest). Holds past their deadline at 'now' are expired on the way.
+    std::optional<HoldRecord> popNext(const std::string& isbn, int64_t now) {
+        while (true) {
+            // Looked up afresh each time: dropping a queue's last hold erases it
+            auto q = queues.find(isbn);
+            if (q == queues.end()) return std::nullopt;
+            std::optional<HoldRecord> hold;
+            for (auto& fifo : q->second.tiers) {
+                while (!hold && !fifo.empty()) {  // fifo may be gone once hold is set
+                    uint64_t id = fifo.front();
+                    fifo.pop_front();
+                    auto it = active.find(id);
+                    if (it == active.end()) continue;  // expired or cancelled
+                    hold = it->second;
+                    drop(id);
+                }
+                if (hold) break;
+            }
+            if (!hold) return std::nullopt;
+            if (hold->expiresAt > now) return hold;
+            // Past its deadline, but its wheel slot has not come round yet
+        }
+    }
+
+    // Expires every hold whose deadline is at or before 'now'
+    void advanceTo(int64_t now) {
+        int64_t target = now / TICK_SECONDS;
+        if (currentTick < 0) currentTick = target - static_cast<int64_t>(WHEEL_SLOTS);
+        if (target - currentTick > static_cast<int64_t>(WHEEL_SLOTS)) {
+            currentTick = target - static_cast<int64_t>(WHEEL_SLOTS);  // one full turn covers every slot
+        }
+        for (int64_t tick = currentTick + 1; tick <= target; ++tick) {
+            auto& slot = wheel[static_cast<size_t>(tick) % WHEEL_SLOTS];
+            size_t kept = 0;
+            for (uint64_t id : slot) {
+                auto it = active.find(id);
+                if (it == active.end()) continue;
+                if (it->second.expiresAt <= now) {
+                    drop(id);
+                } else {
+                    slot[kept++] = id;  // due on a later revolution
+                }
+            }
+            slot.resize(kept);
+        }
+        currentTick = std::max(currentTick, target);
+    }
+
+    // Live holds in service order per ISBN, for saving
+    std::vector<HoldRecord> all() const {
+        std::vector<HoldRecord> records;
+        records.reserve(active.size());
+        for (const auto& [isbn, q] : queues) {
+            for (const auto& fifo : q.tiers) {
+                for (uint64_t id : fifo) {
+                    auto it = active.find(id);
+                    if (it != active.end()) records.push_back(it->second);
+                }
+            }
+        }
+        return records;
+    }
+
+    void clear() {
+        *this = HoldQueues();
+    }
+};
+
+// Due dates of the loans out on this catalog's books, keyed by pooled ISBN.
+// The loans are kept column-wise (ISBN, borrower, checkout, due) in dense
+// arrays, so the fine pass is one branch-free loop over the due column. An
+// index of daily buckets (a calendar queue) answers "overdue" and "due in
+// the next N hours" by visiting only the days in range: every bucket holds
+// at least one loan, so the cost is proportional to the loans reported.
+// A late return is charged when the book comes back, into the borrower's
+// balance; loans still out accrue until then.
+class DueDates {
+public:
+    using Key = const std::string*;
+    static constexpr int64_t DAY_SECONDS = 24 * 3600;
+
+    struct Loan {
+        std::string isbn;
+        std::string borrowerId;
+        int64_t checkedOut;  // seconds since the epoch
+        int64_t due;
+    };
+
+    struct Fine {
+        std::string borrowerId;
+        uint32_t lateLoans;  // still out and overdue
+        int64_t balance;     // charged for late returns, in cents
+        int64_t cents;       // balance plus what the late loans have accrued so far
+    };
+
+private:
+    // Column i describes one loan; removal swaps the last loan into the gap
+    std::vector<Key> isbns;
+    std::vector<std::string> borrowerIds;
+    std::vector<int64_t> checkedOut;
+    std::vector<int64_t> due;
+    std::vector<uint32_t> bucketSlot;  // position of the loan in its day's bucket
+
+    std::unordered_map<Key, uint32_t> byIsbn;       // ISBN -> column
+    std::map<int64_t, std::vector<Key>> byDay;      // due day -> loans due that day
+    std::unordered_map<std::string, int64_t> balances;  // borrower ID -> cents charged, never 0
+
+    static int64_t dayOf(int64_t time) {
+        return time >= 0 ? time / DAY_SECONDS : (time - DAY_SECONDS + 1) / DAY_SECONDS;
+    }
+
+    Loan loanAt(uint32_t i) const { return Loan{*isbns[i], borrowerIds[i], checkedOut[i], due[i]}; }
+
+    void unbucket(uint32_t i) {
+        auto bucket = byDay.find(dayOf(due[i]));
+        std::vector<Key>& keys = bucket->second;
+        Key moved = keys.back();
+        keys[bucketSlot[i]] = moved;
+        bucketSlot[byIsbn[moved]] = bucketSlot[i];
+        keys.pop_back();
+        if (keys.empty()) byDay.erase(bucket);
+    }
+
+    // Loans with from <= due < to, earliest first
+    std::vector<Loan> dueIn(int64_t from, int64_t to) const {
+        std::vector<Loan> result;
+        if (from >= to) return result;
+        auto end = byDay.upper_bound(dayOf(to - 1));
+        for (auto it = byDay.lower_bound(dayOf(from)); it != end; ++it) {
+            for (Key key : it->second) {
+                uint32_t i = byIsbn.at(key);
+                if (due[i] >= from && due[i] < to) result.push_back(loanAt(i));
+            }
+        }
+        std::sort(result.begin(), result.end(), [](const Loan& a, const Loan& b) {
+            return a.due < b.due || (a.due == b.due && a.isbn < b.isbn);
+        });
+        return result;
+    }
+
+public:
+    size_t size() const { return isbns.size(); }
+
+    // Fine for a loan due at 'due' if it comes back at 'at': perDay for every
+    // started day past due, up to cap
+    static int64_t fineFor(int64_t due, int64_t at, int64_t perDay, int64_t cap) {
+        int64_t days = (at - due + DAY_SECONDS - 1) / DAY_SECONDS;
+        days = days > 0 ? days : 0;
+        int64_t fine = days * perDay;
+        return fine < cap ? fine : cap;
+    }
+
+    // Adds to (or, negative, takes from) a borrower's balance
+    void charge(const std::string& borrowerId, int64_t cents) {
+        if (cents == 0) return;
+        auto it = balances.emplace(borrowerId, 0).first;
+        it->second += cents;
+        if (it->second == 0) balances.erase(it);
+    }
+
+    void setBalance(const std::string& borrowerId, int64_t cents) {
+        if (cents == 0) {
+            balances.erase(borrowerId);
+        } else {
+            balances[borrowerId] = cents;
+        }
+    }
+
+    int64_t balanceOf(const std::string& borrowerId) const {
+        auto it = balances.find(borrowerId);
+        return it != balances.end() ? it->second : 0;
+    }
+
+    // Every non-zero balance, for saving
+    std::vector<std::pair<std::string, int64_t>> allBalances() const {
+        return std::vector<std::pair<std::string, int64_t>>(balances.begin(), balances.end());
+    }
+
+    // Records a checkout, replacing any loan already recorded for the ISBN
+    void lend(Key isbn, const std::string& borrowerId, int64_t checkedOutAt, int64_t dueAt) {
+        release(isbn);
+        uint32_t i = static_cast<uint32_t>(isbns.size());
+        std::vector<Key>& bucket = byDay[dayOf(dueAt)];
+        isbns.push_back(isbn);
+        borrowerIds.push_back(borrowerId);
+        checkedOut.push_back(checkedOutAt);
+        due.push_back(dueAt);
+        bucketSlot.push_back(static_cast<uint32_t>(bucket.size()));
+        bucket.push_back(isbn);
+        byIsbn.emplace(isbn, i);
+    }
+
+    // Returns false if no loan was recorded for the ISBN
+    bool release(Key isbn) {
+        auto it = byIsbn.find(isbn);
+        if (it == byIsbn.end()) return false;
+        uint32_t i = it->second;
+        unbucket(i);
+        byIsbn.erase(it);
+        uint32_t last = static_cast<uint32_t>(isbns.size() - 1);
+        if (i != last) {
+            isbns[i] = isbns[last];
+            borrowerIds[i] = std::move(borrowerIds[last]);
+            checkedOut[i] = checkedOut[last];
+            due[i] = due[last];
+            bucketSlot[i] = bucketSlot[last];
+            byIsbn[isbns[i]] = i;
+        }
+        isbns.pop_back();
+        borrowerIds.pop_back();
+        checkedOut.pop_back();
+        due.pop_back();
+        bucketSlot.pop_back();
+        return true;
+    }
+
+    std::optional<Loan> find(Key isbn) const {
+        auto it = byIsbn.find(isbn);
+        if (it == byIsbn.end()) return std::nullopt;
+        return loanAt(it->second);
+    }
+
+    // Loans past their due date at 'now', most overdue first
+    std::vector<Loan> overdue(int64_t now) const {
+        return dueIn(byDay.empty() ? now : std::min(now, byDay.begin()->first * DAY_SECONDS), now);
+    }
+
+    // Loans not yet overdue that fall due within 'seconds' of 'now', soonest first
+    std::vector<Loan> dueWithin(int64_t now, int64_t seconds) const {
+        return dueIn(now, now + seconds);
+    }
+
+    // What every borrower with a balance or a late loan owes at 'now',
+    // largest first. Late loans accrue as fineFor describes.
+    std::vector<Fine> fines(int64_t now, int64_t perDay, int64_t cap) const {
+        size_t n = due.size();
+        std::vector<int64_t> cents(n);
+        const int64_t* dueAt = due.data();
+        int64_t* out = cents.data();
+        for (size_t i = 0; i < n; ++i) out[i] = fineFor(dueAt[i], now, perDay, cap);
+
+        std::unordered_map<std::string_view, size_t> slot;
+        std::vector<Fine> result;
+        for (const auto& [borrowerId, balance] : balances) {
+            slot.emplace(borrowerId, result.size());
+            result.push_back(Fine{borrowerId, 0, balance, balance});
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (cents[i] == 0) continue;
+            auto [it, added] = slot.emplace(borrowerIds[i], result.size());
+            if (added) result.push_back(Fine{borrowerIds[i], 0, 0, 0});
+            ++result[it->second].lateLoans;
+            result[it->second].cents += cents[i];
+        }
+        std::sort(result.begin(), result.end(), [](const Fine& a, const Fine& b) {
+            return a.cents > b.cents || (a.cents == b.cents && a.borrowerId < b.borrowerId);
+        });
+        return result;
+    }
+
+    // Every recorded loan, for saving
+    std::vector<Loan> all() const {
+        std::vector<Loan> loans;
+        loans.reserve(isbns.size());
+        for (uint32_t i = 0; i < isbns.size(); ++i) loans.push_back(loanAt(i));
+        return loans;
+    }
+
+    void clear() {
+        *this = DueDates();
+    }
+};
+
+// Orders the catalog can be listed in
+enum class BookOrder {
+    Title,     // then author
+    Author,    // then title
+    Category   // then title
+};
+
+// Outcome of one item in a batch call
+enum class BatchStatus {
+    Ok,
+    UnknownBook,
+    UnknownBorrower,
+    Unavailable,  // borrow: the book is already checked out; return: it is not on loan to
+                  // that borrower, or a cross-shard transfer holds it
+    Duplicate     // add: the ISBN is already in the catalog, so the item was skipped
+};
+
+// Where LibraryManager reads its initial state from
+enum class DataSource {
+    Auto,      // the binary snapshot when it is newer than the CSV files, else the CSV files
+    CSV,
+    Snapshot
+};
+
+// Library Manager class definition
+class LibraryManager {
+private:
+    std::vector<Book> books;
+    std::vector<Borrower> borrowers;
+    HoldQueues holds;            // per-ISBN reservation queues, guarded by holdsMutex
+    TransactionHistory history;  // bounded circulation history, guarded by bookkeepingMutex
+    CirculationStats stats;      // live counts for dashboards, guarded by bookkeepingMutex
+    DueDates dueDates;           // due dates of books out, guarded by bookkeepingMutex
+    CategoryIndex categoryIndex; // category posting lists and availability, for search and recommendations
+    SearchIndex searchIndex;     // title/author full-text search
+    CategoryTree categoryTree;   // category hierarchy with per-node counts, kept in step with categoryIndex
+
+    // Sorted views over book positions, patched on every add and remove so
+    // listings never sort (or reorder) the books themselves. Each order ends
+    // on ISBN and then position so it is total.
+    struct ByTitle {
+        const std::vector<Book>* books;
+        bool operator()(uint32_t a, uint32_t b) const {
+            const Book& x = (*books)[a];
+            const Book& y = (*books)[b];
+            if (int c = x.getTitle().compare(y.getTitle())) return c < 0;
+            if (x.getAuthorKey() != y.getAuthorKey()) return x.getAuthor() < y.getAuthor();
+            if (int c = x.getISBN().compare(y.getISBN())) return c < 0;
+            return a < b;
+        }
+    };
+    struct ByAuthor {
+        const std::vector<Book>* books;
+        bool operator()(uint32_t a, uint32_t b) const {
+            const Book& x = (*books)[a];
+            const Book& y = (*books)[b];
+            if (x.getAuthorKey() != y.getAuthorKey()) return x.getAuthor() < y.getAuthor();
+            if (int c = x.getTitle().compare(y.getTitle())) return c < 0;
+            if (int c = x.getISBN().compare(y.getISBN())) return c < 0;
+            return a < b;
+        }
+    };
+    struct ByCategory {
+        const std::vector<Book>* books;
+        bool operator()(uint32_t a, uint32_t b) const {
+            const Book& x = (*books)[a];
+            const Book& y = (*books)[b];
+            if (x.getCategoryKey() != y.getCategoryKey()) return x.getCategory() < y.getCategory();
+            if (int c = x.getTitle().compare(y.getTitle())) return c < 0;
+            if (int c = x.getISBN().compare(y.getISBN())) return c < 0;
+            return a < b;
+        }
+    };
+    OrderedView<ByTitle> byTitle{ByTitle{&books}};
+    OrderedView<ByAuthor> byAuthor{ByAuthor{&books}};
+    OrderedView<ByCategory> byCategory{ByCategory{&books}};
+
+    // Which categories each borrower (by position) has borrowed from, and the
+    // category links learned from that; both guarded by bookkeepingMutex
+    CoBorrowGraph categoryAffinity;
+    std::vector<std::vector<const std::string*>> borrowerCategories;
+
+    // "Also borrowed" lists, rebuilt from loans and recent history when first
+    // asked for and again once enough new loans have come in. Rebuilds run on
+    // similarityWorker, one at a time, while queries keep reading the model
+    // published before. The pointer and flag are guarded by bookkeepingMutex.
+    static constexpr uint64_t SIMILARITY_REFRESH = 4096;
+    std::shared_ptr<const ItemSimilarity> alsoBorrowed;
+    uint64_t loansSinceSimilarity = 0;
+    bool similarityRebuilding = false;
+    std::condition_variable similarityPublished;
+    std::thread similarityWorker;
+    // History handle names copied so far; only similarityWorker touches them
+    std::vector<std::string> historyIsbns, historyBorrowers;
+
+    // Hash indexes for O(1) lookups (ISBN -> position in books, ID -> position in borrowers)
+    std::unordered_map<std::string, size_t> bookIndex;
+    std::unordered_map<std::string, size_t> borrowerIndex;
+
+    // File paths
+    const std::string BOOKS_FILE = "books.csv";
+    const std::string BORROWERS_FILE = "borrowers.csv";
+    const std::string SNAPSHOT_FILE = "library.snap";
+    const std::string LOG_FILE = "library.wal";
+    const std::string HOLDS_FILE = "holds.csv";
+    const std::string LOANS_FILE = "loans.csv";
+    const std::string FINES_FILE = "fines.csv";
+
+    static constexpr int64_t HOLD_DAYS = 14;
+    static constexpr int64_t LOAN_DAYS = 21;
+    static constexpr int64_t FINE_PER_DAY_CENTS = 25;
+    static constexpr int64_t FINE_CAP_CENTS = 1000;  // per loan
+
+    // Changes since the last save are logged here; once the log outgrows this
+    // it is folded into the base files
+    static constexpr uint64_t LOG_COMPACT_THRESHOLD = 16 * 1024 * 1024;
+    TransactionLog transactionLog{LOG_FILE};
+    bool replaying = false;
+
+    // Files smaller than this are parsed on the calling thread
+    static constexpr size_t PARALLEL_LOAD_THRESHOLD = 4 * 1024 * 1024;
+    unsigned parserThreads = 1;
+
+    // Locking: borrowBook/returnBook run under a shared catalogMutex plus one
+    // striped lock for the book and one for the borrower (always taken in that
+    // order), so desks working on different books proceed in parallel and two
+    // desks can never both check out the same copy. Adding, removing or
+    // reordering records takes catalogMutex exclusively; reads that walk the
+    // whole catalog use a CatalogVersion, which needs the exclusive lock only
+    // for as long as it takes to copy the chunks changed since the last one.
+    using ReadLock = std::shared_lock<std::shared_mutex>;
+    using WriteLock = std::unique_lock<std::shared_mutex>;
+    static constexpr size_t LOCK_STRIPES = 64;
+    mutable std::shared_mutex catalogMutex;
+    mutable std::array<std::mutex, LOCK_STRIPES> bookLocks;
+    mutable std::array<std::mutex, LOCK_STRIPES> borrowerLocks;
+    std::mutex bookkeepingMutex;  // categoryIndex availability bits, history, stats and category affinity
+    std::mutex holdsMutex;        // taken after any book/borrower stripe
+    std::mutex saveMutex;         // one save at a time; taken before catalogMutex
+    std::mutex transferMutex;     // preparedTransfers; taken before any book/borrower stripe
+
+    // Cross-shard checkouts and returns voted on but not yet decided, by
+    // transaction id. A vote is logged before it is answered, so it survives
+    // a restart, and it stands until the router decides: after voting yes a
+    // shard may not abort on its own.
+    struct PreparedTransfer {
+        bool borrowing;
+        std::string isbn;
+        std::string borrowerId;
+    };
+    std::unordered_map<std::string, PreparedTransfer> preparedTransfers;
+
+    // How decided transfers ended (true = committed), so a decision the router
+    // delivers again gets the same answer. Kept, across saves and restarts,
+    // until the router says FORGET once both shards have acknowledged.
+    std::unordered_map<std::string, bool> finishedTransfers;
+
+    // The newest published CatalogVersion and the chunks of books/borrowers
+    // changed since it was taken; guarded by bookkeepingMutex
+    std::shared_ptr<const CatalogVersion> catalogVersion;
+    std::vector<bool> changedBookChunks, changedBorrowerChunks;
+    bool catalogChanged = true;
+    uint64_t versionEpoch = 0;
+
+public:
+    enum class TransferState { Committed, Aborted, Unknown };
+
+    // loadThreads = 0 uses one parser thread per hardware core
+    explicit LibraryManager(unsigned loadThreads = 0, DataSource source = DataSource::Auto) {
+        setLoadThreads(loadThreads);
+        loadData(source);
+    }
+
+    ~LibraryManager() {
+        if (similarityWorker.joinable()) similarityWorker.join();
+    }
+
+    void setLoadThreads(unsigned threads) {
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        parserThreads = threads;
+    }
+
+    // Data persistence methods
+    void loadData(DataSource source = DataSource::Auto) {
+        WriteLock lock(catalogMutex);
+        if (source == DataSource::Snapshot ||
+            (source == DataSource::Auto && snapshotIsCurrent())) {
+            if (!loadSnapshot()) {
+                std::cout << "Warning: " << SNAPSHOT_FILE << " is missing or invalid. Loading CSV files.\n";
+                loadBooks();
+                loadBorrowers();
+            }
+        } else {
+            loadBooks();
+            loadBorrowers();
+        }
+        {
+            std::lock_guard<std::mutex> versionLock(bookkeepingMutex);
+            catalogVersion.reset();  // every record is new, so the next version copies them all
+            catalogChanged = true;
+        }
+        rebuildSearchIndex();
+        rebuildCategoryAffinity();
+        loadHolds();
+        loadLoans();
+        replayLog();
+    }
+
+    // Only taking the snapshot to write waits for in-flight checkouts; the
+    // files themselves are written while circulation carries on
+    void saveData() {
+        std::lock_guard<std::mutex> saving(saveMutex);
+        writeDataFiles();
+    }
+
+    // Point-in-time view of every book and borrower. Cheap when nothing has
+    // changed since the last call; otherwise it briefly takes catalogMutex
+    // exclusively to copy the changed chunks.
+    std::shared_ptr<const CatalogVersion> snapshot() {
+        {
+            std::lock_guard<std::mutex> lock(bookkeepingMutex);
+            if (catalogVersion && !catalogChanged) return catalogVersion;
+        }
+        WriteLock lock(catalogMutex);
+        return publishVersionLocked();
+    }
+
+    // Forces logged changes to disk without waiting for a full batch. False
+    // if they could not be written; they are retried by the next commit.
+    bool commitLog() {
+        return transactionLog.commit();
+    }
+
+    // Book management
+    void addBook(const Book& book) {
+        LIBRARY_TIMED(AddBook);
+        {
+            WriteLock lock(catalogMutex);
+            addBookLocked(book);
+        }
+        compactLogIfNeeded();
+    }
+
+    void removeBook(const std::string& isbn) {
+        LIBRARY_TIMED(RemoveBook);
+        {
+            WriteLock lock(catalogMutex);
+            removeBookLocked(isbn);
+        }
+        compactLogIfNeeded();
+    }
+
+    // Borrower management
+    void addBorrower(const Borrower& borrower) {
+        {
+            WriteLock lock(catalogMutex);
+            addBorrowerLocked(borrower);
+        }
+        compactLogIfNeeded();
+    }
+
+    // Borrowing operations; safe to call from many threads at once
+    bool borrowBook(const std::string& isbn, const std::string& borrowerId) {
+        LIBRARY_TIMED(Borrow);
+        bool borrowed;
+        {
+            ReadLock lock(catalogMutex);
+            borrowed = borrowBookLocked(isbn, borrowerId, currentTime());
+        }
+        if (!borrowed) LIBRARY_COUNT(BorrowRejected);
+        compactLogIfNeeded();
+        return borrowed;
+    }
+
+    bool returnBook(const std::string& isbn, const std::string& borrowerId) {
+        LIBRARY_TIMED(Return);
+        bool returned;
+        {
+            ReadLock lock(catalogMutex);
+            returned = returnBookLocked(isbn, borrowerId, currentTime());
+        }
+        if (!returned) LIBRARY_COUNT(ReturnRejected);
+        compactLogIfNeeded();
+        return returned;
+    }
+
+    // Holds. A hold can only be placed on a book that is currently out; when
+    // it comes back, returnBook checks it out to the next patron in line.
+    bool placeHold(const std::string& isbn, const std::string& borrowerId,
+                   HoldTier tier = HoldTier::Regular) {
+        bool placed;
+        {
+            ReadLock lock(catalogMutex);
+            placed = placeHoldLocked(isbn, borrowerId, tier, currentTime() + HOLD_DAYS * 24 * 3600);
+        }
+        compactLogIfNeeded();
+        return placed;
+    }
+
+    bool cancelHold(const std::string& isbn, const std::string& borrowerId) {
+        bool cancelled;
+        {
+            ReadLock lock(catalogMutex);
+            cancelled = cancelHoldLocked(isbn, borrowerId);
+        }
+        compactLogIfNeeded();
+        return cancelled;
+    }
+
+    size_t holdsWaiting(const std::string& isbn) {
+        std::lock_guard<std::mutex> lock(holdsMutex);
+        holds.advanceTo(currentTime());
+        return holds.pendingFor(isbn);
+    }
+
+    // Circulation history, newest first. An empty key lists all recent events.
+    std::vector<TransactionHistory::Entry> historyForBook(const std::string& isbn, size_t limit = 20) {
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        return isbn.empty() ? history.recent(limit) : history.forBook(isbn, limit);
+    }
+
+    std::vector<TransactionHistory::Entry> historyForBorrower(const std::string& borrowerId, size_t limit = 20) {
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        return borrowerId.empty() ? history.recent(limit) : history.forBorrower(borrowerId, limit);
+    }
+
+    // Live circulation figures. Each read is O(1) (mostBorrowed is bounded by
+    // CirculationStats::TOP_CAPACITY) and none of them waits for the catalog lock.
+    CirculationStats::Usage categoryUsage(const std::string& category) {
+        const std::string* key = StringPool::find(category);
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        return key ? stats.category(key) : CirculationStats::Usage{};
+    }
+
+    CirculationStats::Usage libraryUsage() {
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        return stats.total();
+    }
+
+    std::vector<CirculationStats::Title> mostBorrowed(size_t count = 10) {
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        return stats.top(count);
+    }
+
+    // Checkouts by one borrower since startup
+    uint64_t loansBy(const std::string& borrowerId) {
+        ReadLock lock(catalogMutex);
+        auto it = borrowerIndex.find(borrowerId);
+        if (it == borrowerIndex.end()) return 0;
+        std::lock_guard<std::mutex> statsLock(bookkeepingMutex);
+        return stats.loansBy(static_cast<uint32_t>(it->second));
+    }
+
+    // Due dates and fines, answered from the due-date index rather than by
+    // walking the borrowers
+    std::optional<DueDates::Loan> loanOf(const std::string& isbn) {
+        const std::string* key = StringPool::find(isbn);
+        if (!key) return std::nullopt;
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        return dueDates.find(key);
+    }
+
+    std::vector<std::pair<std::string, int64_t>> fineBalances() {
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        return dueDates.allBalances();
+    }
+
+    std::vector<DueDates::Loan> outstandingLoans() {
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        return dueDates.all();
+    }
+
+    // Every hold, each book's queue in service order
+    std::vector<HoldQueues::HoldRecord> outstandingHolds() {
+        std::lock_guard<std::mutex> lock(holdsMutex);
+        return holds.all();
+    }
+
+    std::vector<DueDates::Loan> overdueLoans() {
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        return dueDates.overdue(currentTime());
+    }
+
+    std::vector<DueDates::Loan> loansDueWithin(int64_t seconds) {
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        return dueDates.dueWithin(currentTime(), seconds);
+    }
+
+    std::vector<DueDates::Fine> outstandingFines() {
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        return dueDates.fines(currentTime(), FINE_PER_DAY_CENTS, FINE_CAP_CENTS);
+    }
+
+    // Two-phase commit participant for checkouts and returns whose book and
+    // borrower are kept by different shards (see ShardRouter); each shard
+    // holds one side. prepare checks that side, reserves the book against
+    // local checkouts and logs the vote; commit applies it and logs it as an
+    // ordinary Borrow or Return record, and abort releases the reservation.
+    // Both end with an EndTransfer record, so after a crash replay restores
+    // exactly the votes still waiting for a decision, and the outcome is
+    // remembered until forgetTransfer.
+    bool prepareTransfer(const std::string& txid, bool borrowing, const std::string& isbn,
+                         const std::string& borrowerId) {
+        ReadLock lock(catalogMutex);
+        std::lock_guard<std::mutex> transferLock(transferMutex);
+        if (preparedTransfers.count(txid) || finishedTransfers.count(txid)) return false;
+        Book* book = findBook(isbn);
+        Borrower* borrower = findBorrower(borrowerId);
+        if (book && borrower) return false;  // both sides are here, so it is not a transfer
+        if (book) {
+            std::lock_guard<std::mutex> bookLock(bookLocks[positionOf(book) % LOCK_STRIPES]);
+            if (book->isReserved() || book->getAvailability() != borrowing) return false;
+            if (!borrowing) {
+                // The book's shard knows who has it from the loan's due-date record
+                std::lock_guard<std::mutex> loansLock(bookkeepingMutex);
+                std::optional<DueDates::Loan> loan = dueDates.find(book->getISBNKey());
+                if (loan && loan->borrowerId != borrowerId) return false;
+            }
+            book->setReserved(true);
+        } else if (!borrower) {
+            return false;
+        } else if (!borrowing) {
+            std::lock_guard<std::mutex> borrowerLock(borrowerLocks[positionOf(borrower) % LOCK_STRIPES]);
+            if (!borrower->hasBorrowed(isbn)) return false;
+        }
+        PreparedTransfer transfer{borrowing, isbn, borrowerId};
+        logPreparedTransfer(txid, transfer);
+        preparedTransfers.emplace(txid, std::move(transfer));
+        return true;
+    }
+
+    // Committed: applied now or already. Aborted: it was aborted first.
+    // Unknown: never prepared here, or already forgotten.
+    TransferState commitTransfer(const std::string& txid) {
+        std::optional<PreparedTransfer> transfer = takeTransfer(txid);
+        if (!transfer) return finishedState(txid);
+        {
+            // The change and its EndTransfer reach the disk together, so a
+            // replay never finds the change still waiting for its decision
+            ReadLock lock(catalogMutex);
+            transactionLog.beginBatch();
+            applyTransferSide(transfer->borrowing, transfer->isbn, transfer->borrowerId, currentTime());
+            endTransfer(txid, true);
+            transactionLog.endBatch();
+        }
+        compactLogIfNeeded();
+        return TransferState::Committed;
+    }
+
+    // Aborted: released now or already, or never prepared here (recorded,
+    // so a PREPARE arriving late is refused). Committed: too late to abort.
+    TransferState abortTransfer(const std::string& txid) {
+        std::optional<PreparedTransfer> transfer = takeTransfer(txid);
+        if (!transfer) {
+            TransferState state = finishedState(txid);
+            if (state == TransferState::Unknown) endTransfer(txid, false);
+            return state == TransferState::Committed ? state : TransferState::Aborted;
+        }
+        ReadLock lock(catalogMutex);
+        releaseTransfer(*transfer);
+        endTransfer(txid, false);
+        return TransferState::Aborted;
+    }
+
+    // Drops a finished transfer's outcome once the router no longer needs it
+    void forgetTransfer(const std::string& txid) {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        if (finishedTransfers.erase(txid) > 0) logChange(TransactionLog::Op::ForgetTransfer, {txid});
+    }
+
+    // Reverts the newest 'count' circulation events: a borrow is returned, a
+    // return is checked out again, and a hold hand-off is undone together
+    // with the return that made it, so the copy goes back to the patron who
+    // returned it rather than onto the shelf. A hold that a borrow or hand-off
+    // used up is put back at the head of its queue. An event that no longer
+    // matches the catalog (the copy has since gone to someone else or is
+    // reserved, or it was half of a cross-shard transfer) is dropped from the
+    // history without being reverted or counted. The reversals go to the
+    // transaction log like any other change but are not added to the history.
+    // Returns how many events were undone.
+    size_t undoLastTransactions(size_t count) {
+        size_t undone = 0;
+        int64_t now = currentTime();
+        {
+            WriteLock lock(catalogMutex);
+            while (undone < count) {
+                std::optional<TransactionHistory::Entry> entry, handedOffBy;
+                {
+                    std::lock_guard<std::mutex> historyLock(bookkeepingMutex);
+                    entry = history.popNewest();
+                    if (entry && entry->op == TransactionHistory::Op::HoldFilled) {
+                        std::optional<TransactionHistory::Entry> previous = history.newest();
+                        if (previous && previous->op == TransactionHistory::Op::Return &&
+                            previous->isbn == entry->isbn) {
+                            handedOffBy = history.popNewest();
+                        }
+                    }
+                }
+                if (!entry) break;
+                // A hand-off whose return is no longer next in the history
+                // (a server interleaved other events) is left standing
+                if (entry->op == TransactionHistory::Op::HoldFilled && !handedOffBy) continue;
+                if (!undoLocked(*entry, now)) continue;
+                if (handedOffBy) undoLocked(*handedOffBy, now);
+                ++undone;
+            }
+        }
+        compactLogIfNeeded();
+        return undone;
+    }
+
+    // Batch entry points for acquisition feeds and returns bins: one lock
+    // acquisition for the whole batch, capacity reserved up front and each
+    // distinct ISBN looked up once. Each returns one status per item, in
+    // input order.
+    std::vector<BatchStatus> addBooks(const std::vector<Book>& batch) {
+        std::vector<BatchStatus> status(batch.size(), BatchStatus::Ok);
+        {
+            WriteLock lock(catalogMutex);
+            // Past this size merging the new books into the views beats inserting them one by one
+            bool mergeViews = batch.size() > books.size() / 32;
+            size_t first = books.size();
+            books.reserve(books.size() + batch.size());
+            bookIndex.reserve(bookIndex.size() + batch.size());
+            transactionLog.beginBatch();
+            for (size_t i = 0; i < batch.size(); ++i) {
+                if (bookIndex.count(batch[i].getISBN()) > 0) {
+                    status[i] = BatchStatus::Duplicate;
+                    continue;
+                }
+                addBookLocked(batch[i], !mergeViews);
+            }
+            transactionLog.endBatch();
+            if (mergeViews) {
+                std::vector<uint32_t> added(books.size() - first);
+                for (size_t i = 0; i < added.size(); ++i) added[i] = static_cast<uint32_t>(first + i);
+                byTitle.insertMany(added);
+                byAuthor.insertMany(added);
+                byCategory.insertMany(std::move(added));
+            }
+        }
+        compactLogIfNeeded();
+        return status;
+    }
+
+    // Adds the books in a CSV file laid out like books.csv (an acquisitions
+    // feed). Returns how many were added.
+    size_t importBooks(const std::string& path) {
+        MappedFile file(path);
+        if (!file.isOpen()) {
+            std::cout << "Error: Could not open " << path << "\n";
+            return 0;
+        }
+        CsvReader reader(file.view());
+        std::vector<std::string_view> header;
+        reader.nextRecord(header);
+        std::string_view body = reader.remaining();
+        std::vector<Book> batch;
+        parseChunksInParallel(splitCsvChunks(body, loadChunkCount(body.size())), parseBookRecords, batch);
+
+        std::vector<BatchStatus> status = addBooks(batch);
+        size_t added = static_cast<size_t>(std::count(status.begin(), status.end(), BatchStatus::Ok));
+        std::cout << "Added " << added << " books from " << path;
+        if (added < batch.size()) std::cout << " (" << batch.size() - added << " already in the catalog)";
+        std::cout << "\n";
+        return added;
+    }
+
+    std::vector<BatchStatus> borrowBatch(const std::vector<std::pair<std::string, std::string>>& loans) {
+        std::vector<BatchStatus> status;
+        {
+            ReadLock lock(catalogMutex);
+            transactionLog.beginBatch();
+            int64_t now = currentTime();
+            status = resolveBatch(loans, [this, now](Book& book, Borrower& borrower) {
+                return checkOut(book, borrower, now) ? BatchStatus::Ok : BatchStatus::Unavailable;
+            });
+            transactionLog.endBatch();
+        }
+        compactLogIfNeeded();
+        return status;
+    }
+
+    std::vector<BatchStatus> returnBatch(const std::vector<std::pair<std::string, std::string>>& returns) {
+        std::vector<BatchStatus> status;
+        {
+            ReadLock lock(catalogMutex);
+            int64_t now = currentTime();
+            {
+                std::lock_guard<std::mutex> holdsLock(holdsMutex);
+                holds.advanceTo(now);
+            }
+            transactionLog.beginBatch();
+            status = resolveBatch(returns, [this, now](Book& book, Borrower& borrower) {
+                return checkIn(book, borrower, now) ? BatchStatus::Ok : BatchStatus::Unavailable;
+            });
+            transactionLog.endBatch();
+        }
+        compactLogIfNeeded();
+        return status;
+    }
+
+    // Display methods. Listings print a snapshot, so checkouts carry on while
+    // they are written out; the ordered and category listings take the book
+    // positions they need in the same exclusive section that publishes it.
+    void displayBooks() {
+        std::shared_ptr<const CatalogVersion> catalog = snapshot();
+        ReportWriter out(stdout);
+        out.text("\nLibrary Books:\n");
+        out.text("----------------------------------------\n");
+        for (size_t i = 0; i < catalog->bookCount(); ++i) {
+            out.book(catalog->book(i));
+        }
+        out.flush();
+    }
+
+    void displayBooksByCategory() {
+        std::shared_ptr<const CatalogVersion> catalog;
+        std::vector<CategoryShelf> shelves;
+        {
+            WriteLock lock(catalogMutex);
+            catalog = publishVersionLocked();
+            for (uint32_t child : categoryTree.node(CategoryTree::ROOT).children) {
+                if (categoryTree.node(child).total > 0) collectShelves(shelves, child, 0);
+            }
+        }
+        ReportWriter out(stdout);
+        out.text("\nLibrary Books by Category:\n");
+        out.text("========================\n");
+        for (size_t i = 0; i < shelves.size(); ++i) {
+            const CategoryShelf& shelf = shelves[i];
+            std::string indent(shelf.level * 4, ' ');
+            out.text(indent);
+            out.text("Category: ");
+            out.text(shelf.name);
+            out.text("\n");
+            out.text(indent);
+            out.text("Books:\n");
+            for (uint32_t pos : shelf.books) {
+                const Book& book = catalog->book(pos);
+                out.text(indent);
+                out.text("    - ");
+                out.text(book.getTitle());
+                out.text(" by ");
+                out.text(book.getAuthor());
+                out.text(" (ISBN: ");
+                out.text(book.getISBN());
+                out.text(book.getAvailability() ? ") [Available]\n" : ") [Borrowed]\n");
+            }
+            // A rule closes each top-level category, after its subcategories
+            if (i + 1 == shelves.size() || shelves[i + 1].level == 0) {
+                out.text("------------------------\n");
+            }
+        }
+        out.flush();
+    }
+
+    // Subcategories of 'path' ("" for the top level) with their book counts,
+    // subcategories included, in name order
+    std::vector<std::pair<std::string, size_t>> browseCategory(const std::string& path) const {
+        ReadLock lock(catalogMutex);
+        std::vector<std::pair<std::string, size_t>> children;
+        std::optional<uint32_t> id = categoryTree.find(path);
+        if (!id) return children;
+        for (uint32_t child : categoryTree.node(*id).children) {
+            const CategoryTree::Node& node = categoryTree.node(child);
+            if (node.total > 0) children.emplace_back(*node.path, node.total);
+        }
+        return children;
+    }
+
+    // Refiles a book (every copy of its ISBN) under another category
+    bool changeCategory(const std::string& isbn, const std::string& category) {
+        bool changed;
+        {
+            WriteLock lock(catalogMutex);
+            changed = changeCategoryLocked(isbn, category);
+        }
+        compactLogIfNeeded();
+        return changed;
+    }
+
+    void searchByCategory() {
+        std::cout << "\nAvailable Categories:\n";
+        for (const auto& category : listCategories()) {
+            std::cout << "- " << category << "\n";
+        }
+        
+        std::string searchCategory;
+        std::cout << "\nEnter category to search: ";
+        std::getline(std::cin, searchCategory);
+        
+        std::shared_ptr<const CatalogVersion> catalog;
+        std::vector<uint32_t> shelf;
+        {
+            WriteLock lock(catalogMutex);
+            catalog = publishVersionLocked();
+            categoryIndex.forEachIn(StringPool::find(searchCategory), [&](uint32_t pos) {
+                shelf.push_back(pos);
+                return true;
+            });
+        }
+        
+        ReportWriter out(stdout, ReportFormat::Text, false);
+        out.text("\nBooks in category '");
+        out.text(searchCategory);
+        out.text("':\n");
+        out.text("----------------------------------------\n");
+        for (uint32_t pos : shelf) {
+            out.book(catalog->book(pos));
+        }
+        
+        if (shelf.empty()) {
+            out.text("No books found in category '");
+            out.text(searchCategory);
+            out.text("'\n");
+        }
+        out.flush();
+    }
+
+    // Copies of up to 'limit' books in a category, in catalog order
+    std::vector<Book> booksInCategory(const std::string& category, size_t limit) const {
+        LIBRARY_TIMED(BooksInCategory);
+        ReadLock lock(catalogMutex);
+        std::vector<Book> found;
+        categoryIndex.forEachIn(StringPool::find(category), [&](uint32_t pos) {
+            if (found.size() >= limit) return false;
+            std::lock_guard<std::mutex> bookLock(bookLocks[pos % LOCK_STRIPES]);
+            found.push_back(books[pos]);
+            return true;
+        });
+        return found;
+    }
+
+    // Alphabetical list of categories that have at least one book
+    std::vector<std::string> listCategories() const {
+        ReadLock lock(catalogMutex);
+        return categoryIndex.categories();
+    }
+
+    // Ranked title/author search with prefix and typo-tolerant matching.
+    // Runs under the shared lock, alongside circulation; returns copies.
+    // 'scores', if given, receives each result's relevance score
+    std::vector<Book> searchBooks(const std::string& query, size_t limit = 10,
+                                  std::vector<double>* scores = nullptr) const {
+        LIBRARY_TIMED(Search);
+        ReadLock lock(catalogMutex);
+        std::vector<Book> results;
+        for (const auto& hit : searchIndex.search(query, limit)) {
+            auto it = bookIndex.find(hit.isbn);
+            if (it == bookIndex.end()) continue;
+            std::lock_guard<std::mutex> bookLock(bookLocks[it->second % LOCK_STRIPES]);
+            results.push_back(books[it->second]);
+            if (scores) scores->push_back(hit.score);
+        }
+        return results;
+    }
+
+    void searchByTitleOrAuthor() {
+        std::string query;
+        std::cout << "\nEnter title or author (partial words are fine): ";
+        std::getline(std::cin, query);
+        
+        std::vector<Book> results = searchBooks(query);
+        ReportWriter out(stdout, ReportFormat::Text, false);
+        out.text("\nBest matches for '");
+        out.text(query);
+        out.text("':\n");
+        out.text("----------------------------------------\n");
+        for (const Book& book : results) {
+            out.book(book);
+        }
+        
+        if (results.empty()) {
+            out.text("No books found matching '");
+            out.text(query);
+            out.text("'\n");
+        }
+        out.flush();
+    }
+
+    // Sorting methods
+    // The whole catalog in the given order
+    void displayBooksInOrder(BookOrder order) {
+        ReportWriter out(stdout);
+        out.text("\nLibrary Books:\n");
+        out.text("----------------------------------------\n");
+        writeBooks(out, order);
+        out.flush();
+    }
+
+    // Writes the books ranked [offset, offset + limit) in the given order
+    // (limit 0 = to the end) and returns how many were written. Only the
+    // positions are taken under the lock; the books come from a snapshot.
+    size_t writeBooks(ReportWriter& out, BookOrder order, size_t offset = 0, size_t limit = 0) {
+        std::shared_ptr<const CatalogVersion> catalog;
+        std::vector<uint32_t> ranked;
+        {
+            WriteLock lock(catalogMutex);
+            catalog = publishVersionLocked();
+            if (offset < books.size()) {
+                ranked.reserve(limit == 0 ? books.size() - offset : std::min(limit, books.size() - offset));
+            }
+            forEachInOrder(order, offset, [&](uint32_t pos) {
+                ranked.push_back(pos);
+                return limit == 0 || ranked.size() < limit;
+            });
+        }
+        for (uint32_t pos : ranked) {
+            out.book(catalog->book(pos));
+        }
+        return ranked.size();
+    }
+
+    // One page of the catalog in the given order, pages counted from 0.
+    // Runs under the shared lock; returns copies.
+    std::vector<Book> booksPage(BookOrder order, size_t page, size_t pageSize) const {
+        LIBRARY_TIMED(ListPage);
+        ReadLock lock(catalogMutex);
+        std::vector<Book> found;
+        if (pageSize == 0 || page > books.size() / pageSize) return found;
+        forEachInOrder(order, page * pageSize, [&](uint32_t pos) {
+            std::lock_guard<std::mutex> bookLock(bookLocks[pos % LOCK_STRIPES]);
+            found.push_back(books[pos]);
+            return found.size() < pageSize;
+        });
+        return found;
+    }
+
+    // Every figure comes from an index kept current under bookkeepingMutex, so
+    // a shared lock is enough and checkouts carry on during the report
+    void analyzeCategories() {
+        ReadLock lock(catalogMutex);
+        std::cout << "\nAnalyzing Library Categories...\n\n";
+        
+        // First, display category statistics
+        std::map<std::string, int> categoryCount;
+        for (const auto& category : categoryIndex.categories()) {
+            categoryCount[category] = static_cast<int>(categoryIndex.countIn(StringPool::find(category)));
+        }
+        
+        std::cout << "Category Statistics:\n";
+        std::cout << "===================\n";
+        for (const auto& [category, count] : categoryCount) {
+            std::cout << category << ": " << count << " books\n";
+        }
+        std::cout << "\n";
+
+        // Copy the circulation figures out, so checkouts are not held up
+        // while they are printed
+        std::vector<CirculationStats::Usage> usages;
+        std::vector<CirculationStats::Title> top;
+        std::vector<CoBorrowGraph::Link> links;
+        {
+            std::lock_guard<std::mutex> statsLock(bookkeepingMutex);
+            usages.reserve(categoryCount.size());
+            for (const auto& entry : categoryCount) {
+                usages.push_back(stats.category(StringPool::find(entry.first)));
+            }
+            top = stats.top(5);
+            links = categoryAffinity.links();
+        }
+
+        // Then how hard each category is working
+        std::cout << "Circulation:\n";
+        std::cout << "============\n";
+        auto usage = usages.begin();
+        for (const auto& entry : categoryCount) {
+            std::cout << entry.first << ": " << usage->onLoan << " of " << usage->books << " on loan ("
+                      << static_cast<int>(std::lround(usage->utilization() * 100)) << "% utilization), "
+                      << usage->loans << " checkouts this session\n";
+            ++usage;
+        }
+        if (!top.empty()) {
+            std::cout << "\nMost Borrowed Titles:\n";
+            for (const auto& title : top) {
+                const Book* book = findBook(title.isbn);
+                std::cout << "  - " << (book ? book->getTitle() : title.isbn) << " (" << title.count
+                          << (title.count == 1 ? " checkout" : " checkouts") << ")\n";
+            }
+        }
+        std::cout << "\n";
+
+        // Build the category graph from co-borrowing
+        CategoryGraph graph;
+        uint32_t strongest = 0;
+        for (const auto& link : links) {
+            // Only add edge if both categories exist in our library
+            if (categoryCount.count(*link.from) > 0 && categoryCount.count(*link.to) > 0) {
+                graph.addEdge(*link.from, *link.to, static_cast<int>(link.weight));
+                strongest = std::max(strongest, link.weight);
+            }
+        }
+
+        // Display category relationships, graded against the strongest link
+        std::cout << "Category Relationships:\n";
+        std::cout << "=====================\n";
+        if (graph.adjacencyList.empty()) {
+            std::cout << "No co-borrowing data yet.\n\n";
+        }
+        for (const auto& [category, edges] : graph.adjacencyList) {
+            std::cout << category << " is connected to:\n";
+            for (const auto& edge : edges) {
+                std::cout << "  - " << edge.to;
+                if (3 * edge.weight >= 2 * static_cast<int>(strongest)) {
+                    std::cout << " (Strong relationship)";
+                } else if (3 * edge.weight >= static_cast<int>(strongest)) {
+                    std::cout << " (Moderate relationship)";
+                } else {
+                    std::cout << " (Weak relationship)";
+                }
+                std::cout << ", " << edge.weight << " shared borrower" << (edge.weight == 1 ? "" : "s") << "\n";
+            }
+            std::cout << "\n";
+        }
+
+        // Display book recommendations based on relationships
+        std::cout << "Sample Cross-Category Recommendations:\n";
+        std::cout << "===================================\n";
+        for (const auto& entry : graph.adjacencyList) {
+            const std::string& category = entry.first;
+            std::cout << "If you like " << category << ", you might also enjoy:\n";
+            std::vector<std::string> titles = recommendBooksLocked(category, 2, false);
+            if (titles.empty()) std::cout << "  (nothing on the shelf right now)\n";
+            for (const auto& title : titles) {
+                std::cout << "  - " << title << "\n";
+            }
+            std::cout << "\n";
+        }
+    }
+    
+    // Available titles for someone who likes 'category': its own shelf first,
+    // then the categories its borrowers also read, most related first.
+    // 'scores', if given, receives each title's score: 1 for the category's
+    // own shelf, else the related category's PageRank score (always below 1).
+    std::vector<std::string> recommendBooks(const std::string& category, size_t limit = 20,
+                                            std::vector<double>* scores = nullptr) {
+        LIBRARY_TIMED(Recommend);
+        ReadLock lock(catalogMutex);
+        return recommendBooksLocked(category, limit, true, scores);
+    }
+    
+    // Books most often borrowed by the same patrons as 'isbn', best first.
+    // A stale model is still served while its replacement is built; only the
+    // very first request waits for a model to exist.
+    std::vector<Book> alsoBorrowedWith(const std::string& isbn, size_t limit = 10) {
+        std::shared_ptr<const ItemSimilarity> model;
+        {
+            std::unique_lock<std::mutex> lock(bookkeepingMutex);
+            if (!alsoBorrowed || loansSinceSimilarity >= SIMILARITY_REFRESH) startSimilarityRebuildLocked();
+            similarityPublished.wait(lock, [this] { return alsoBorrowed != nullptr; });
+            model = alsoBorrowed;
+        }
+        std::vector<std::string> isbns = model->similarTo(isbn, limit);
+
+        ReadLock lock(catalogMutex);
+        std::vector<Book> results;
+        for (const auto& similar : isbns) {
+            if (const Book* book = findBook(similar)) results.push_back(*book);
+        }
+        return results;
+    }
+
+    // Caller holds bookkeepingMutex. Starts a background rebuild unless one
+    // is already running.
+    void startSimilarityRebuildLocked() {
+        if (similarityRebuilding) return;
+        similarityRebuilding = true;
+        if (similarityWorker.joinable()) similarityWorker.join();  // finished: it cleared the flag
+        similarityWorker = std::thread([this] { rebuildSimilarities(); });
+    }
+
+    // Works from a catalog snapshot and the history's handles, so circulation
+    // only waits while those are copied; the model is built with no lock held
+    // and swapped in when done
+    void rebuildSimilarities() {
+        std::shared_ptr<const CatalogVersion> catalog = snapshot();
+        std::vector<std::pair<uint32_t, uint32_t>> loans;
+        {
+            std::lock_guard<std::mutex> historyLock(bookkeepingMutex);
+            loans = history.loanHandles();
+            history.namesSince(historyIsbns, historyBorrowers);
+            loansSinceSimilarity = 0;
+        }
+
+        std::vector<std::string> isbns;
+        std::unordered_map<std::string_view, uint32_t> bookAt, borrowerAt;  // first copy wins, as in bookIndex
+        isbns.reserve(catalog->bookCount());
+        bookAt.reserve(catalog->bookCount());
+        for (size_t i = 0; i < catalog->bookCount(); ++i) {
+            const std::string& isbn = catalog->book(i).getISBN();
+            isbns.push_back(isbn);
+            bookAt.emplace(isbn, static_cast<uint32_t>(i));
+        }
+        borrowerAt.reserve(catalog->borrowerCount());
+        for (size_t i = 0; i < catalog->borrowerCount(); ++i) {
+            borrowerAt.emplace(catalog->borrower(i).getID(), static_cast<uint32_t>(i));
+        }
+
+        std::vector<std::vector<uint32_t>> baskets(catalog->borrowerCount());
+        for (size_t i = 0; i < catalog->borrowerCount(); ++i) {
+            for (const auto& isbn : catalog->borrower(i).getBorrowedBooks()) {
+                auto it = bookAt.find(isbn);
+                if (it != bookAt.end()) baskets[i].push_back(it->second);
+            }
+        }
+        // Resolve each history handle once rather than once per record
+        static constexpr uint32_t MISSING = ~uint32_t(0);
+        auto resolve = [](const std::vector<std::string>& names,
+                          const std::unordered_map<std::string_view, uint32_t>& at) {
+            std::vector<uint32_t> positions(names.size(), MISSING);
+            for (size_t h = 0; h < names.size(); ++h) {
+                auto it = at.find(names[h]);
+                if (it != at.end()) positions[h] = it->second;
+            }
+            return positions;
+        };
+        const std::vector<uint32_t> bookOf = resolve(historyIsbns, bookAt);
+        const std::vector<uint32_t> borrowerOf = resolve(historyBorrowers, borrowerAt);
+        for (const auto& [book, borrower] : loans) {
+            if (bookOf[book] != MISSING && borrowerOf[borrower] != MISSING) {
+                baskets[borrowerOf[borrower]].push_back(bookOf[book]);
+            }
+        }
+        for (auto& basket : baskets) {
+            std::sort(basket.begin(), basket.end());
+            basket.erase(std::unique(basket.begin(), basket.end()), basket.end());
+        }
+
+        auto model = std::make_shared<ItemSimilarity>();
+        model->build(std::move(isbns), baskets, parserThreads);
+        {
+            std::lock_guard<std::mutex> lock(bookkeepingMutex);
+            alsoBorrowed = std::move(model);
+            similarityRebuilding = false;
+        }
+        similarityPublished.notify_all();
+    }
+
+    void getBookRecommendations() {
+        std::cout << "\nAvailable Categories:\n";
+        const std::vector<std::string> categories = listCategories();
+        
+        for (const auto& category : categories) {
+            std::cout << "- " << category << "\n";
+        }
+        
+        std::string startCategory;
+        std::cout << "\nEnter starting category (or an ISBN) for recommendations: ";
+        std::getline(std::cin, startCategory);
+        
+        // Check if category exists
+        if (!std::binary_search(categories.begin(), categories.end(), startCategory)) {
+            bool known;
+            {
+                ReadLock lock(catalogMutex);
+                known = findBook(startCategory) != nullptr;
+            }
+            if (!known) {
+                std::cout << "Category not found!\n";
+                return;
+            }
+            const std::vector<Book> similar = alsoBorrowedWith(startCategory);
+            std::cout << "\nPatrons who borrowed " << startCategory << " also borrowed:\n";
+            std::cout << "=================================================\n";
+            if (similar.empty()) {
+                std::cout << "No recommendations found.\n";
+            }
+            for (size_t i = 0; i < similar.size(); ++i) {
+                std::cout << (i + 1) << ". " << similar[i].getTitle() << " by " << similar[i].getAuthor() << "\n";
+            }
+            return;
+        }
+        
+        std::vector<std::string> recommendations = recommendBooks(startCategory);
+        
+        std::cout << "\nRecommended Books (based on category '" << startCategory << "'):\n";
+        std::cout << "=================================================\n";
+        if (recommendations.empty()) {
+            std::cout << "No recommendations found.\n";
+        } else {
+            for (size_t i = 0; i < recommendations.size(); ++i) {
+                std::cout << (i + 1) << ". " << recommendations[i] << "\n";
+            }
+        }
+    }
+
+private:
+    // Index lookups
+    Book* findBook(const std::string& isbn) {
+        auto it = bookIndex.find(isbn);
+        return it != bookIndex.end() ? &books[it->second] : nullptr;
+    }
+
+    Borrower* findBorrower(const std::string& id) {
+        auto it = borrowerIndex.find(id);
+        return it != borrowerIndex.end() ? &borrowers[it->second] : nullptr;
+    }
+
+    // Position-based indexes must be rebuilt whenever books is reordered or erased from
+    // 'saved' supplies the listing orders when it holds exactly these books
+    void rebuildBookIndexes(const snapshot::View* saved = nullptr) {
+        bookIndex.clear();
+        bookIndex.reserve(books.size());
+        categoryIndex.clear();
+        categoryTree.clear();
+        std::lock_guard<std::mutex> statsLock(bookkeepingMutex);
+        stats.clear();
+        for (size_t i = 0; i < books.size(); ++i) {
+            bookIndex.emplace(books[i].getISBN(), i);
+            categoryIndex.add(static_cast<uint32_t>(i), books[i].getCategoryKey(), books[i].getAvailability());
+            categoryTree.add(books[i].getCategoryKey());
+            stats.bookAdded(books[i].getCategoryKey(), books[i].getAvailability());
+        }
+        if (!saved || !loadViews(*saved)) rebuildViews();
+    }
+
+    void rebuildViews() {
+        std::vector<uint32_t> positions(books.size());
+        for (size_t i = 0; i < books.size(); ++i) positions[i] = static_cast<uint32_t>(i);
+        byTitle.assign(positions);
+        byAuthor.assign(positions);
+        byCategory.assign(std::move(positions));
+    }
+
+    // Takes the listing orders saved in a snapshot of exactly these books;
+    // false (views untouched) if any is not a permutation of the positions
+    bool loadViews(const snapshot::View& view) {
+        auto order = [&](const uint32_t* saved, std::vector<uint32_t>& out) {
+            std::vector<bool> seen(books.size());
+            out.assign(saved, saved + books.size());
+            for (uint32_t pos : out) {
+                if (pos >= books.size() || seen[pos]) return false;
+                seen[pos] = true;
+            }
+            return true;
+        };
+        std::vector<uint32_t> title, author, category;
+        if (view.bookCount() != books.size() || !order(view.titleOrder(), title) ||
+            !order(view.authorOrder(), author) || !order(view.categoryOrder(), category)) {
+            return false;
+        }
+        byTitle.assign(std::move(title), true);
+        byAuthor.assign(std::move(author), true);
+        byCategory.assign(std::move(category), true);
+        return true;
+    }
+
+    // Caller holds catalogMutex
+    snapshot::Orders viewOrders() const {
+        snapshot::Orders orders;
+        auto collect = [](std::vector<uint32_t>& out) {
+            return [&out](uint32_t pos) {
+                out.push_back(pos);
+                return true;
+            };
+        };
+        orders.title.reserve(books.size());
+        orders.author.reserve(books.size());
+        orders.category.reserve(books.size());
+        byTitle.forEachFrom(0, collect(orders.title));
+        byAuthor.forEachFrom(0, collect(orders.author));
+        byCategory.forEachFrom(0, collect(orders.category));
+        return orders;
+    }
+
+    // Applies fn(book, borrower) -> status to each (isbn, borrower id) item
+    // that resolves. Items are visited grouped by ISBN, so each book is looked
+    // up once; the sort is stable, so requests for one book keep their order.
+    template <typename Fn>
+    std::vector<BatchStatus> resolveBatch(const std::vector<std::pair<std::string, std::string>>& items, Fn&& fn) {
+        std::vector<uint32_t> order(items.size());
+        for (size_t i = 0; i < items.size(); ++i) order[i] = static_cast<uint32_t>(i);
+        std::stable_sort(order.begin(), order.end(),
+            [&items](uint32_t a, uint32_t b) { return items[a].first < items[b].first; });
+
+        std::vector<BatchStatus> status(items.size());
+        const std::string* current = nullptr;
+        Book* book = nullptr;
+        for (uint32_t i : order) {
+            const auto& [isbn, borrowerId] = items[i];
+            if (!current || *current != isbn) {
+                current = &isbn;
+                book = findBook(isbn);
+            }
+            Borrower* borrower = findBorrower(borrowerId);
+            if (!book) status[i] = BatchStatus::UnknownBook;
+            else if (!borrower) status[i] = BatchStatus::UnknownBorrower;
+            else status[i] = fn(*book, *borrower);
+        }
+        return status;
+    }
+
+    // fn(pos) for each book from rank 'first' in the given order; return false to stop
+    template <typename Fn>
+    void forEachInOrder(BookOrder order, size_t first, Fn&& fn) const {
+        switch (order) {
+            case BookOrder::Title: byTitle.forEachFrom(first, fn); break;
+            case BookOrder::Author: byAuthor.forEachFrom(first, fn); break;
+            case BookOrder::Category: byCategory.forEachFrom(first, fn); break;
+        }
+    }
+
+    void addToViews(uint32_t pos) {
+        byTitle.insert(pos);
+        byAuthor.insert(pos);
+        byCategory.insert(pos);
+    }
+
+    void eraseFromViews(uint32_t pos) {
+        byTitle.erase(pos);
+        byAuthor.erase(pos);
+        byCategory.erase(pos);
+    }
+
+    // One category of the by-category listing, at its depth in the tree
+    struct CategoryShelf {
+        int level;
+        std::string name;
+        std::vector<uint32_t> books;
+    };
+
+    // Caller holds catalogMutex. Appends the category and its non-empty
+    // subcategories in listing order.
+    void collectShelves(std::vector<CategoryShelf>& shelves, uint32_t id, int level) const {
+        const CategoryTree::Node& node = categoryTree.node(id);
+        CategoryShelf shelf{level, node.name, {}};
+        categoryIndex.forEachIn(node.path, [&](uint32_t pos) {
+            shelf.books.push_back(pos);
+            return true;
+        });
+        shelves.push_back(std::move(shelf));
+        for (uint32_t child : node.children) {
+            if (categoryTree.node(child).total > 0) collectShelves(shelves, child, level + 1);
+        }
+    }
+
+    uint32_t positionOf(const Book* book) const {
+        return static_cast<uint32_t>(book - books.data());
+    }
+
+    uint32_t positionOf(const Borrower* borrower) const {
+        return static_cast<uint32_t>(borrower - borrowers.data());
+    }
+
+    void rebuildSearchIndex() {
+        searchIndex.clear();
+        for (const auto& book : books) {
+            searchIndex.add(book.getISBN(), book.getTitle(), book.getAuthor());
+        }
+    }
+
+    void rebuildBorrowerIndex() {
+        borrowerIndex.clear();
+        borrowerIndex.reserve(borrowers.size());
+        for (size_t i = 0; i < borrowers.size(); ++i) {
+            borrowerIndex.emplace(borrowers[i].getID(), i);
+        }
+    }
+
+    size_t loadChunkCount(size_t bytes) const {
+        if (bytes < PARALLEL_LOAD_THRESHOLD) return 1;
+        return std::min<size_t>(parserThreads, bytes / (PARALLEL_LOAD_THRESHOLD / 4));
+    }
+
+    static void parseBookRecords(std::string_view text, std::vector<Book>& out) {
+        CsvReader reader(text);
+        std::vector<std::string_view> fields;
+        while (reader.nextRecord(fields)) {
+            if (fields.size() >= 5) {
+                Book book{std::string(fields[0]), std::string(fields[1]),
+                          std::string(fields[2]), std::string(fields[4])};
+                book.setAvailability(fields[3] == "1");
+                out.push_back(std::move(book));
+            }
+        }
+    }
+
+    static void parseBorrowerRecords(std::string_view text, std::vector<Borrower>& out) {
+        CsvReader reader(text);
+        std::vector<std::string_view> fields;
+        while (reader.nextRecord(fields)) {
+            if (fields.size() >= 2) {
+                Borrower borrower{std::string(fields[0]), std::string(fields[1])};
+                // If there are borrowed books (fields[2]), parse the ';'-separated ISBNs
+                if (fields.size() > 2) {
+                    std::string_view list = fields[2];
+                    while (!list.empty()) {
+                        size_t pos = list.find(';');
+                        std::string_view isbn = list.substr(0, pos);
+                        if (!isbn.empty()) {
+                            borrower.borrowBook(isbn);
+                        }
+                        if (pos == std::string_view::npos) break;
+                        list.remove_prefix(pos + 1);
+                    }
+                }
+                out.push_back(std::move(borrower));
+            }
+        }
+    }
+
+    void loadBooks() {
+        LIBRARY_TIMED(LoadBooks);
+        MappedFile file(BOOKS_FILE);
+        if (!file.isOpen()) {
+            std::cout << "Warning: Could not open " << BOOKS_FILE << ". Starting with empty book list.\n";
+            return;
+        }
+
+        CsvReader reader(file.view());
+        std::vector<std::string_view> header;
+        // Skip header line
+        reader.nextRecord(header);
+        std::string_view body = reader.remaining();
+
+        parseChunksInParallel(splitCsvChunks(body, loadChunkCount(body.size())),
+                              parseBookRecords, books);
+        rebuildBookIndexes();
+        std::cout << "Loaded " << books.size() << " books from " << BOOKS_FILE << "\n";
+    }
+
+    void loadBorrowers() {
+        LIBRARY_TIMED(LoadBorrowers);
+        MappedFile file(BORROWERS_FILE);
+        if (!file.isOpen()) {
+            std::cout << "Warning: Could not open " << BORROWERS_FILE << ". Starting with empty borrower list.\n";
+            return;
+        }
+
+        CsvReader reader(file.view());
+        std::vector<std::string_view> header;
+        // Skip header line
+        reader.nextRecord(header);
+        std::string_view body = reader.remaining();
+
+        parseChunksInParallel(splitCsvChunks(body, loadChunkCount(body.size())),
+                              parseBorrowerRecords, borrowers);
+        rebuildBorrowerIndex();
+        std::cout << "Loaded " << borrowers.size() << " borrowers from " << BORROWERS_FILE << "\n";
+    }
+
+    // Caller holds catalogMutex (shared or exclusive)
+    std::vector<std::string> recommendBooksLocked(const std::string& category, size_t limit,
+                                                  bool includeOwn, std::vector<double>* scores = nullptr) {
+        std::vector<std::string> titles;
+        const std::string* key = StringPool::find(category);
+        if (!key || limit == 0) return titles;
+        auto collect = [&](const std::string* from, bool tagged, double score) {
+            categoryIndex.forEachAvailableIn(from, [&](uint32_t pos) {
+                titles.push_back(tagged ? books[pos].getTitle() + " (" + *from + ")" : books[pos].getTitle());
+                if (scores) scores->push_back(score);
+                return titles.size() < limit;
+            });
+        };
+
+        std::vector<CoBorrowGraph::Related> ranked = relatedCategories(key);
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);  // availability bits
+        if (includeOwn) collect(key, false, 1.0);
+        for (const auto& related : ranked) {
+            if (titles.size() >= limit) break;
+            collect(related.category, !includeOwn, related.score);
+        }
+        return titles;
+    }
+
+    // Categories related to 'category', best first. Only the cache lookup and
+    // the publish take bookkeepingMutex; a stale ranking is recomputed (and the
+    // CSR model rebuilt if links were added) without holding it.
+    std::vector<CoBorrowGraph::Related> relatedCategories(const std::string* category) {
+        std::vector<CoBorrowGraph::Related> related;
+        CoBorrowGraph::RankJob job;
+        {
+            std::lock_guard<std::mutex> lock(bookkeepingMutex);
+            if (categoryAffinity.lookup(category, related, job)) return related;
+        }
+        related = CoBorrowGraph::rank(job);
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        categoryAffinity.publish(job, related);
+        return related;
+    }
+
+    // Caller holds bookkeepingMutex. The first time a borrower takes a book
+    // from a category, that category gains a link to each one they had
+    // already borrowed from.
+    void noteBorrowedCategory(uint32_t borrowerPos, const std::string* category) {
+        if (borrowerPos >= borrowerCategories.size()) borrowerCategories.resize(borrowerPos + 1);
+        auto& seen = borrowerCategories[borrowerPos];
+        if (std::find(seen.begin(), seen.end(), category) != seen.end()) return;
+        for (const std::string* other : seen) categoryAffinity.addCoBorrow(other, category);
+        seen.push_back(category);
+    }
+
+    // Seeds the category graph from the loans on file
+    void rebuildCategoryAffinity() {
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        categoryAffinity.clear();
+        borrowerCategories.assign(borrowers.size(), {});
+        for (size_t i = 0; i < borrowers.size(); ++i) {
+            for (const auto& isbn : borrowers[i].getBorrowedBooks()) {
+                if (const Book* book = findBook(isbn)) {
+                    noteBorrowedCategory(static_cast<uint32_t>(i), book->getCategoryKey());
+                }
+            }
+        }
+    }
+
+    // The *Locked methods expect the caller to hold catalogMutex: exclusively for
+    // the catalog changes, at least shared for borrow/return.
+
+    // The CSV files stay the human-readable copy; the snapshot is written last
+    // so its timestamp marks it as current for the next start. The log is
+    // rotated at the same instant the catalog version is taken, so the rotated
+    // part covers exactly what the files hold and is dropped once they are on
+    // disk. Caller holds saveMutex and no catalog lock.
+    void writeDataFiles() {
+        LIBRARY_TIMED(SaveData);
+        std::shared_ptr<const CatalogVersion> catalog;
+        snapshot::Orders orders;
+        std::vector<HoldQueues::HoldRecord> holdRecords;
+        std::vector<DueDates::Loan> loanRecords;
+        std::vector<std::pair<std::string, int64_t>> balances;
+        bool rotated;
+        {
+            WriteLock lock(catalogMutex);
+            catalog = publishVersionLocked();
+            orders = viewOrders();
+            {
+                std::lock_guard<std::mutex> holdsLock(holdsMutex);
+                holdRecords = holds.all();
+            }
+            {
+                std::lock_guard<std::mutex> loansLock(bookkeepingMutex);
+                loanRecords = dueDates.all();
+                balances = dueDates.allBalances();
+            }
+            rotated = transactionLog.rotate();
+            // Votes still waiting for a decision, and outcomes the router may
+            // still ask about, are not in the data files, so they move to the
+            // fresh log before the rotated one can be dropped
+            std::lock_guard<std::mutex> transferLock(transferMutex);
+            for (const auto& [txid, transfer] : preparedTransfers) logPreparedTransfer(txid, transfer);
+            for (const auto& [txid, committed] : finishedTransfers) {
+                logChange(TransactionLog::Op::EndTransfer, {txid, committed ? "1" : "0"});
+            }
+        }
+        // The rotated log may only go once the records moved above are on disk
+        bool saved = transactionLog.commit();
+        saved = saveBooks(*catalog) && saved;
+        saved = saveBorrowers(*catalog) && saved;
+        saved = saveHolds(holdRecords) && saved;
+        saved = saveLoans(loanRecords) && saved;
+        saved = saveFines(balances) && saved;
+        saved = saveSnapshot(*catalog, orders) && saved;
+        if (saved && rotated) {
+            transactionLog.dropRotated();
+        }
+    }
+
+    // Caller holds catalogMutex exclusively, so no change is half-applied
+    std::shared_ptr<const CatalogVersion> publishVersionLocked() {
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        if (catalogVersion && !catalogChanged) return catalogVersion;
+        auto next = std::make_shared<CatalogVersion>();
+        next->epoch = ++versionEpoch;
+        next->bookTotal = books.size();
+        next->borrowerTotal = borrowers.size();
+        CatalogVersion::copyChunks(books, catalogVersion ? &catalogVersion->bookChunks : nullptr,
+                                   changedBookChunks, next->bookChunks);
+        CatalogVersion::copyChunks(borrowers, catalogVersion ? &catalogVersion->borrowerChunks : nullptr,
+                                   changedBorrowerChunks, next->borrowerChunks);
+        changedBookChunks.assign(changedBookChunks.size(), false);
+        changedBorrowerChunks.assign(changedBorrowerChunks.size(), false);
+        catalogChanged = false;
+        catalogVersion = std::move(next);
+        return catalogVersion;
+    }
+
+    // Caller holds bookkeepingMutex. Flags the chunk holding a changed record
+    // so the next CatalogVersion copies it.
+    void bookChanged(size_t pos) {
+        flagChunk(changedBookChunks, pos);
+    }
+
+    void borrowerChanged(size_t pos) {
+        flagChunk(changedBorrowerChunks, pos);
+    }
+
+    void flagChunk(std::vector<bool>& chunks, size_t pos) {
+        size_t chunk = pos / CatalogVersion::CHUNK;
+        if (chunk >= chunks.size()) chunks.resize(chunk + 1, false);
+        chunks[chunk] = true;
+        catalogChanged = true;
+    }
+
+    // updateViews = false leaves the sorted views to the caller
+    void addBookLocked(const Book& book, bool updateViews = true) {
+        books.push_back(book);
+        bookIndex.emplace(book.getISBN(), books.size() - 1);  // first copy of an ISBN wins
+        categoryIndex.add(static_cast<uint32_t>(books.size() - 1), book.getCategoryKey(),
+                          book.getAvailability());
+        categoryTree.add(book.getCategoryKey());
+        if (updateViews) addToViews(static_cast<uint32_t>(books.size() - 1));
+        {
+            std::lock_guard<std::mutex> lock(bookkeepingMutex);
+            stats.bookAdded(book.getCategoryKey(), book.getAvailability());
+            bookChanged(books.size() - 1);
+        }
+        searchIndex.add(book.getISBN(), book.getTitle(), book.getAuthor());
+        logChange(TransactionLog::Op::AddBook, {book.getTitle(), book.getAuthor(), book.getISBN(),
+                                                book.getCategory(), book.getAvailability() ? "1" : "0"});
+    }
+
+    void removeBookLocked(const std::string& isbn) {
+        const Book* indexed = findBook(isbn);
+        if (!indexed) return;
+        searchIndex.remove(isbn, indexed->getTitle(), indexed->getAuthor());
+        uint32_t pos = positionOf(indexed);
+        bookIndex.erase(isbn);
+        removeBookAt(pos);
+        // Unindexed duplicate copies can only exist if the index is smaller than the catalog
+        if (bookIndex.size() != books.size()) {
+            for (size_t i = books.size(); i-- > 0;) {
+                if (books[i].getISBN() == isbn) removeBookAt(static_cast<uint32_t>(i));
+            }
+        }
+        logChange(TransactionLog::Op::RemoveBook, {isbn});
+    }
+
+    bool changeCategoryLocked(const std::string& isbn, const std::string& category) {
+        Book* indexed = findBook(isbn);
+        if (!indexed) return false;
+        const std::string* key = StringPool::intern(category);
+        auto refile = [&](uint32_t pos) {
+            Book& book = books[pos];
+            if (book.getCategoryKey() == key) return;
+            const std::string* previous = book.getCategoryKey();
+            byCategory.erase(pos);  // while the old key still orders it
+            categoryIndex.remove(pos, book.getCategoryKey());
+            categoryTree.remove(book.getCategoryKey());
+            book.setCategory(category);
+            categoryIndex.add(pos, key, book.getAvailability());
+            categoryTree.add(key);
+            byCategory.insert(pos);
+            std::lock_guard<std::mutex> lock(bookkeepingMutex);
+            stats.bookRemoved(previous, book.getAvailability());
+            stats.bookAdded(key, book.getAvailability());
+            bookChanged(pos);
+        };
+        refile(positionOf(indexed));
+        if (bookIndex.size() != books.size()) {
+            for (size_t i = 0; i < books.size(); ++i) {
+                if (books[i].getISBN() == isbn) refile(static_cast<uint32_t>(i));
+            }
+        }
+        logChange(TransactionLog::Op::SetCategory, {isbn, category});
+        return true;
+    }
+
+    // The last book moves into the gap, so only its position changes and the
+    // indexes are patched rather than rebuilt
+    void removeBookAt(uint32_t pos) {
+        uint32_t last = static_cast<uint32_t>(books.size() - 1);
+        eraseFromViews(pos);
+        categoryIndex.remove(pos, books[pos].getCategoryKey());
+        categoryTree.remove(books[pos].getCategoryKey());
+        {
+            std::lock_guard<std::mutex> lock(bookkeepingMutex);
+            stats.bookRemoved(books[pos].getCategoryKey(), books[pos].getAvailability());
+            if (!books[pos].getAvailability()) dueDates.release(books[pos].getISBNKey());
+            bookChanged(pos);
+            bookChanged(last);
+        }
+        if (pos != last) {
+            eraseFromViews(last);
+            categoryIndex.remove(last, books[last].getCategoryKey());
+            books[pos] = std::move(books[last]);
+        }
+        books.pop_back();
+        if (pos != last) {
+            auto it = bookIndex.find(books[pos].getISBN());
+            if (it != bookIndex.end() && it->second == last) it->second = pos;
+            categoryIndex.add(pos, books[pos].getCategoryKey(), books[pos].getAvailability());
+            addToViews(pos);
+        }
+    }
+
+    void addBorrowerLocked(const Borrower& borrower) {
+        borrowers.push_back(borrower);
+        borrowerIndex.emplace(borrower.getID(), borrowers.size() - 1);
+        {
+            std::lock_guard<std::mutex> lock(bookkeepingMutex);
+            borrowerChanged(borrowers.size() - 1);
+        }
+        logChange(TransactionLog::Op::AddBorrower, {borrower.getID(), borrower.getName()});
+    }
+
+    bool borrowBookLocked(const std::string& isbn, const std::string& borrowerId, int64_t checkedOut) {
+        Book* book = findBook(isbn);
+        Borrower* borrower = findBorrower(borrowerId);
+        return book && borrower && checkOut(*book, *borrower, checkedOut);
+    }
+
+    // The records are already resolved; caller holds catalogMutex (shared is enough)
+    bool checkOut(Book& book, Borrower& borrower, int64_t checkedOut) {
+        const std::string& isbn = book.getISBN();
+        const std::string& borrowerId = borrower.getID();
+
+        uint32_t pos = positionOf(&book);
+        std::lock_guard<std::mutex> bookLock(bookLocks[pos % LOCK_STRIPES]);
+        if (!book.getAvailability() || book.isReserved()) return false;
+        std::lock_guard<std::mutex> borrowerLock(borrowerLocks[positionOf(&borrower) % LOCK_STRIPES]);
+
+        book.setAvailability(false);
+        borrower.borrowBook(book.getISBNKey());
+        std::optional<HoldQueues::HoldRecord> hold;
+        {
+            std::lock_guard<std::mutex> lock(holdsMutex);
+            hold = holds.cancel(isbn, borrowerId);  // a hold is satisfied once the patron has the book
+        }
+        {
+            std::lock_guard<std::mutex> lock(bookkeepingMutex);
+            categoryIndex.setAvailability(pos, false);
+            recordHistory(TransactionHistory::Op::Borrow, isbn, borrowerId, {},
+                          hold ? TransactionHistory::FilledHold{static_cast<uint8_t>(hold->tier), hold->expiresAt}
+                               : TransactionHistory::FilledHold{});
+            noteBorrowedCategory(positionOf(&borrower), book.getCategoryKey());
+            ++loansSinceSimilarity;
+            stats.loaned(book.getCategoryKey(), isbn, positionOf(&borrower), !replaying);
+            dueDates.lend(book.getISBNKey(), borrowerId, checkedOut, checkedOut + LOAN_DAYS * DueDates::DAY_SECONDS);
+            bookChanged(pos);
+            borrowerChanged(positionOf(&borrower));
+        }
+        // Logged under the book lock so the log orders changes to one copy correctly
+        logChange(TransactionLog::Op::Borrow, {isbn, borrowerId, std::to_string(checkedOut)});
+        return true;
+    }
+
+    bool returnBookLocked(const std::string& isbn, const std::string& borrowerId, int64_t returnedAt) {
+        Book* book = findBook(isbn);
+        Borrower* borrower = findBorrower(borrowerId);
+        return book && borrower && checkIn(*book, *borrower, returnedAt);
+    }
+
+    // The records are already resolved; caller holds catalogMutex (shared is enough)
+    bool checkIn(Book& book, Borrower& borrower, int64_t returnedAt) {
+        const std::string& isbn = book.getISBN();
+        const std::string& borrowerId = borrower.getID();
+
+        uint32_t pos = positionOf(&book);
+        std::lock_guard<std::mutex> bookLock(bookLocks[pos % LOCK_STRIPES]);
+        if (book.isReserved() || book.getAvailability()) return false;
+        {
+            std::lock_guard<std::mutex> borrowerLock(borrowerLocks[positionOf(&borrower) % LOCK_STRIPES]);
+            // Only the patron the copy is on loan to can return it
+            if (!borrower.hasBorrowed(book.getISBNKey())) return false;
+            book.setAvailability(true);
+            borrower.returnBook(book.getISBNKey());
+            {
+                std::lock_guard<std::mutex> lock(bookkeepingMutex);
+                categoryIndex.setAvailability(pos, true);
+                recordHistory(TransactionHistory::Op::Return, isbn, borrowerId,
+                              closeLoan(book.getISBNKey(), borrowerId, returnedAt));
+                stats.returned(book.getCategoryKey());
+                bookChanged(pos);
+                borrowerChanged(positionOf(&borrower));
+            }
+            logChange(TransactionLog::Op::Return, {isbn, borrowerId, std::to_string(returnedAt)});
+        }
+        // Replay skips this: the hand-off was logged as its own Borrow
+        if (!replaying) fulfilHold(book, pos);
+        return true;
+    }
+
+    // Checks a just-returned book out to the next eligible patron waiting for
+    // it. Caller holds the book's stripe but no borrower stripe.
+    void fulfilHold(Book& book, uint32_t pos) {
+        const std::string& isbn = book.getISBN();
+        int64_t now = currentTime();
+        while (true) {
+            std::optional<HoldQueues::HoldRecord> next;
+            {
+                std::lock_guard<std::mutex> lock(holdsMutex);
+                next = holds.popNext(isbn, now);
+            }
+            if (!next) return;
+            Borrower* patron = findBorrower(next->borrowerId);
+            if (!patron) continue;  // borrower no longer exists
+
+            std::lock_guard<std::mutex> borrowerLock(borrowerLocks[positionOf(patron) % LOCK_STRIPES]);
+            book.setAvailability(false);
+            patron->borrowBook(book.getISBNKey());
+            {
+                std::lock_guard<std::mutex> lock(bookkeepingMutex);
+                categoryIndex.setAvailability(pos, false);
+                recordHistory(TransactionHistory::Op::HoldFilled, isbn, next->borrowerId, {},
+                              {static_cast<uint8_t>(next->tier), next->expiresAt});
+                noteBorrowedCategory(positionOf(patron), book.getCategoryKey());
+                ++loansSinceSimilarity;
+                stats.loaned(book.getCategoryKey(), isbn, positionOf(patron), true);
+                dueDates.lend(book.getISBNKey(), next->borrowerId, now, now + LOAN_DAYS * DueDates::DAY_SECONDS);
+                bookChanged(pos);
+                borrowerChanged(positionOf(patron));
+            }
+            logChange(TransactionLog::Op::Borrow, {isbn, next->borrowerId, std::to_string(now)});
+            LIBRARY_COUNT(HoldFilled);
+            return;
+        }
+    }
+
+    std::optional<PreparedTransfer> takeTransfer(const std::string& txid) {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        auto it = preparedTransfers.find(txid);
+        if (it == preparedTransfers.end()) return std::nullopt;
+        PreparedTransfer transfer = std::move(it->second);
+        preparedTransfers.erase(it);
+        return transfer;
+    }
+
+    // Caller holds transferMutex (or is replaying)
+    void logPreparedTransfer(const std::string& txid, const PreparedTransfer& transfer) {
+        logChange(TransactionLog::Op::PrepareTransfer, {txid, transfer.borrowing ? "BORROW" : "RETURN",
+                                                        transfer.isbn, transfer.borrowerId});
+    }
+
+    // Drops the reservation an aborted transfer held on a book kept here.
+    // Caller holds catalogMutex (shared is enough).
+    void releaseTransfer(const PreparedTransfer& transfer) {
+        if (Book* book = findBook(transfer.isbn)) {
+            std::lock_guard<std::mutex> bookLock(bookLocks[positionOf(book) % LOCK_STRIPES]);
+            book->setReserved(false);
+        }
+    }
+
+    // Logs and remembers how a transfer ended
+    void endTransfer(const std::string& txid, bool committed) {
+        logChange(TransactionLog::Op::EndTransfer, {txid, committed ? "1" : "0"});
+        std::lock_guard<std::mutex> lock(transferMutex);
+        finishedTransfers.emplace(txid, committed);
+    }
+
+    TransferState finishedState(const std::string& txid) {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        auto it = finishedTransfers.find(txid);
+        if (it == finishedTransfers.end()) return TransferState::Unknown;
+        return it->second ? TransferState::Committed : TransferState::Aborted;
+    }
+
+    // Applies whichever side of a cross-shard checkout or return is kept here:
+    // the book's availability or the borrower's loan list. Caller holds
+    // catalogMutex (shared is enough). The book's shard keeps the due date
+    // and charges any late fine. 'when' is the checkout or return time.
+    void applyTransferSide(bool borrowing, const std::string& isbn, const std::string& borrowerId,
+                           int64_t when) {
+        auto logSide = [&] {
+            logChange(borrowing ? TransactionLog::Op::Borrow : TransactionLog::Op::Return,
+                      {isbn, borrowerId, std::to_string(when)});
+        };
+        if (Book* book = findBook(isbn)) {
+            uint32_t pos = positionOf(book);
+            std::lock_guard<std::mutex> bookLock(bookLocks[pos % LOCK_STRIPES]);
+            book->setReserved(false);
+            bool changed = book->getAvailability() == borrowing;
+            book->setAvailability(!borrowing);
+            {
+                std::lock_guard<std::mutex> lock(bookkeepingMutex);
+                categoryIndex.setAvailability(pos, !borrowing);
+                if (changed && borrowing) {
+                    stats.loaned(book->getCategoryKey(), isbn, CirculationStats::REMOTE_BORROWER, !replaying);
+                } else if (changed) {
+                    stats.returned(book->getCategoryKey());
+                }
+                if (borrowing) {
+                    recordHistory(TransactionHistory::Op::Borrow, isbn, borrowerId);
+                    dueDates.lend(book->getISBNKey(), borrowerId, when, when + LOAN_DAYS * DueDates::DAY_SECONDS);
+                } else {
+                    recordHistory(TransactionHistory::Op::Return, isbn, borrowerId,
+                                  closeLoan(book->getISBNKey(), borrowerId, when));
+                }
+                bookChanged(pos);
+            }
+            logSide();
+            // Holds are served to patrons of this shard; others are skipped as unknown
+            if (!borrowing && !replaying) fulfilHold(*book, pos);
+        } else if (Borrower* borrower = findBorrower(borrowerId)) {
+            uint32_t pos = positionOf(borrower);
+            std::lock_guard<std::mutex> borrowerLock(borrowerLocks[pos % LOCK_STRIPES]);
+            if (borrowing) {
+                borrower->borrowBook(isbn);
+            } else {
+                borrower->returnBook(isbn);
+            }
+            {
+                std::lock_guard<std::mutex> lock(bookkeepingMutex);
+                if (borrowing && !replaying) stats.borrowerLoaned(pos);
+                borrowerChanged(pos);
+            }
+            logSide();
+        }
+    }
+
+    bool placeHoldLocked(const std::string& isbn, const std::string& borrowerId, HoldTier tier,
+                         int64_t expiresAt, bool first = false) {
+        Book* book = findBook(isbn);
+        if (!book || !findBorrower(borrowerId)) return false;
+        std::lock_guard<std::mutex> bookLock(bookLocks[positionOf(book) % LOCK_STRIPES]);
+        if (book->getAvailability() && !replaying) return false;  // on the shelf: just borrow it
+        {
+            std::lock_guard<std::mutex> lock(holdsMutex);
+            if (!replaying) holds.advanceTo(currentTime());
+            if (!holds.place(isbn, borrowerId, tier, expiresAt, first)) return false;
+        }
+        if (first) {
+            logChange(TransactionLog::Op::PlaceHold, {isbn, borrowerId, std::to_string(static_cast<int>(tier)),
+                                                      std::to_string(expiresAt), "1"});
+        } else {
+            logChange(TransactionLog::Op::PlaceHold, {isbn, borrowerId,
+                      std::to_string(static_cast<int>(tier)), std::to_string(expiresAt)});
+        }
+        return true;
+    }
+
+    bool cancelHoldLocked(const std::string& isbn, const std::string& borrowerId) {
+        {
+            std::lock_guard<std::mutex> lock(holdsMutex);
+            if (!holds.cancel(isbn, borrowerId)) return false;
+        }
+        logChange(TransactionLog::Op::CancelHold, {isbn, borrowerId});
+        return true;
+    }
+
+    // Caller holds bookkeepingMutex. Replayed changes are not re-recorded:
+    // their original timestamps are unknown.
+    // Reverts one history entry; see undoLastTransactions. Caller holds
+    // catalogMutex exclusively. False if it no longer matches the catalog.
+    bool undoLocked(const TransactionHistory::Entry& entry, int64_t now) {
+        Book* book = findBook(entry.isbn);
+        Borrower* borrower = findBorrower(entry.borrowerId);
+        if (!book || !borrower) return false;  // removed since, or kept by another shard
+        bool onLoanToBorrower = borrower->hasBorrowed(book->getISBNKey());
+        bool borrowed = entry.op == TransactionHistory::Op::Return;
+        if (borrowed ? !book->getAvailability() || book->isReserved() || onLoanToBorrower : !onLoanToBorrower) {
+            return false;
+        }
+        if (!borrowed && entry.hold.expiresAt > now) {
+            // Placed while the copy is still out, so it is not refused as on the shelf
+            placeHoldLocked(entry.isbn, entry.borrowerId, static_cast<HoldTier>(entry.hold.tier),
+                            entry.hold.expiresAt, true);
+        }
+
+        bool dated = entry.closed.due != 0;
+        int64_t checkedOut = dated ? entry.closed.checkedOut : now;
+        int64_t due = dated ? entry.closed.due : now + LOAN_DAYS * DueDates::DAY_SECONDS;
+        bool changed = book->getAvailability() == borrowed;
+        book->setAvailability(!borrowed);
+        if (borrowed) {
+            borrower->borrowBook(book->getISBNKey());
+        } else {
+            borrower->returnBook(book->getISBNKey());
+        }
+        categoryIndex.setAvailability(positionOf(book), !borrowed);
+        int64_t balance = 0;
+        {
+            std::lock_guard<std::mutex> statsLock(bookkeepingMutex);
+            if (changed && borrowed) {
+                stats.loaned(book->getCategoryKey(), entry.isbn, positionOf(borrower), false);
+            } else if (changed) {
+                stats.returned(book->getCategoryKey());
+            }
+            if (borrowed) {
+                // The loan is reopened with its original dates and the late fine refunded
+                dueDates.lend(book->getISBNKey(), entry.borrowerId, checkedOut, due);
+                dueDates.charge(entry.borrowerId, -entry.closed.fine);
+                balance = dueDates.balanceOf(entry.borrowerId);
+            } else {
+                dueDates.release(book->getISBNKey());
+            }
+            bookChanged(positionOf(book));
+            borrowerChanged(positionOf(borrower));
+        }
+        if (borrowed) {
+            if (entry.closed.fine != 0) {
+                logChange(TransactionLog::Op::AdjustFine, {entry.borrowerId,
+                          std::to_string(-entry.closed.fine), std::to_string(balance)});
+            }
+            logChange(TransactionLog::Op::Borrow, {entry.isbn, entry.borrowerId, std::to_string(checkedOut)});
+        } else {
+            logChange(TransactionLog::Op::Return, {entry.isbn, entry.borrowerId});
+        }
+        return true;
+    }
+
+    void recordHistory(TransactionHistory::Op op, const std::string& isbn, const std::string& borrowerId,
+                       const TransactionHistory::ClosedLoan& closed = {},
+                       const TransactionHistory::FilledHold& hold = {}) {
+        if (!replaying) history.record(op, isbn, borrowerId, currentTime(), closed, hold);
+    }
+
+    // Ends a book's loan at 'returnedAt', charging the borrower if it came
+    // back late. An undated return (returnedAt 0, from an older log) is never
+    // late. Caller holds bookkeepingMutex.
+    TransactionHistory::ClosedLoan closeLoan(const std::string* isbnKey, const std::string& borrowerId,
+                                             int64_t returnedAt) {
+        TransactionHistory::ClosedLoan closed{};
+        if (std::optional<DueDates::Loan> loan = dueDates.find(isbnKey)) {
+            closed.checkedOut = loan->checkedOut;
+            closed.due = loan->due;
+            closed.fine = DueDates::fineFor(loan->due, returnedAt, FINE_PER_DAY_CENTS, FINE_CAP_CENTS);
+            dueDates.charge(borrowerId, closed.fine);
+            dueDates.release(isbnKey);
+        }
+        return closed;
+    }
+
+    static int64_t currentTime() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void logChange(TransactionLog::Op op, std::initializer_list<std::string_view> fields) {
+        if (replaying) return;
+        transactionLog.append(op, fields);
+    }
+
+    // Folds an oversized log into the data files. Called with no locks held.
+    void compactLogIfNeeded() {
+        if (transactionLog.size() <= LOG_COMPACT_THRESHOLD) return;
+        std::unique_lock<std::mutex> saving(saveMutex, std::try_to_lock);
+        if (!saving.owns_lock()) return;  // a save is under way and will fold the log
+        if (transactionLog.size() <= LOG_COMPACT_THRESHOLD) return;  // another thread got here first
+        std::cout << "Compacting " << LOG_FILE << " into the data files...\n";
+        LIBRARY_COUNT(LogCompaction);
+        writeDataFiles();
+    }
+
+    // Re-applies changes logged since the last save. Replay is idempotent for
+    // everything but duplicate-ISBN adds, so a crash between saving the base
+    // files and truncating the log does not corrupt state: a borrow or return
+    // (and the fine it charges) only applies to a book in the opposite state,
+    // and a fine adjustment sets the balance it left rather than adding to it.
+    void replayLog() {
+        LIBRARY_TIMED(ReplayLog);
+        replaying = true;
+        size_t applied = transactionLog.replay(
+            [this](TransactionLog::Op op, const std::vector<std::string_view>& f) {
+                switch (op) {
+                    case TransactionLog::Op::AddBook:
+                        if (f.size() >= 5 && bookIndex.find(std::string(f[2])) == bookIndex.end()) {
+                            Book book{std::string(f[0]), std::string(f[1]), std::string(f[2]), std::string(f[3])};
+                            book.setAvailability(f[4] == "1");
+                            addBookLocked(book);
+                        }
+                        break;
+                    case TransactionLog::Op::RemoveBook:
+                        if (f.size() >= 1) removeBookLocked(std::string(f[0]));
+                        break;
+                    case TransactionLog::Op::AddBorrower:
+                        if (f.size() >= 2 && borrowerIndex.find(std::string(f[0])) == borrowerIndex.end()) {
+                            addBorrowerLocked(Borrower{std::string(f[0]), std::string(f[1])});
+                        }
+                        break;
+                    case TransactionLog::Op::Borrow:
+                    case TransactionLog::Op::Return:
+                        if (f.size() >= 2) {
+                            bool borrowing = op == TransactionLog::Op::Borrow;
+                            std::string isbn(f[0]), borrowerId(f[1]);
+                            // Borrows logged before loans were dated start the loan
+                            // now; returns logged then are never charged as late
+                            int64_t when = f.size() >= 3 ? std::stoll(std::string(f[2])) : borrowing ? currentTime() : 0;
+                            if (findBook(isbn) && findBorrower(borrowerId) && borrowing) {
+                                borrowBookLocked(isbn, borrowerId, when);
+                            } else if (findBook(isbn) && findBorrower(borrowerId)) {
+                                returnBookLocked(isbn, borrowerId, when);
+                            } else {
+                                // logged by one shard of a pair
+                                applyTransferSide(borrowing, isbn, borrowerId, when);
+                            }
+                        }
+                        break;
+                    case TransactionLog::Op::PlaceHold:
+                        if (f.size() >= 4) {
+                            int tier = std::clamp(std::atoi(std::string(f[2]).c_str()), 0,
+                                                  static_cast<int>(HoldQueues::TIER_COUNT) - 1);
+                            placeHoldLocked(std::string(f[0]), std::string(f[1]), static_cast<HoldTier>(tier),
+                                            std::stoll(std::string(f[3])), f.size() >= 5 && f[4] == "1");
+                        }
+                        break;
+                    case TransactionLog::Op::CancelHold:
+                        if (f.size() >= 2) cancelHoldLocked(std::string(f[0]), std::string(f[1]));
+                        break;
+                    case TransactionLog::Op::SetCategory:
+                        if (f.size() >= 2) changeCategoryLocked(std::string(f[0]), std::string(f[1]));
+                        break;
+                    case TransactionLog::Op::AdjustFine:
+                        if (f.size() >= 3) {
+                            std::lock_guard<std::mutex> lock(bookkeepingMutex);
+                            dueDates.setBalance(std::string(f[0]), std::stoll(std::string(f[2])));
+                        } else if (f.size() >= 2) {
+                            std::lock_guard<std::mutex> lock(bookkeepingMutex);
+                            dueDates.charge(std::string(f[0]), std::stoll(std::string(f[1])));
+                        }
+                        break;
+                    case TransactionLog::Op::PrepareTransfer:
+                        // Still waiting for a decision unless an EndTransfer follows
+                        if (f.size() >= 4 && !preparedTransfers.count(std::string(f[0]))) {
+                            PreparedTransfer transfer{f[1] == "BORROW", std::string(f[2]), std::string(f[3])};
+                            if (Book* book = findBook(transfer.isbn)) book->setReserved(true);
+                            preparedTransfers.emplace(std::string(f[0]), std::move(transfer));
+                        }
+                        break;
+                    case TransactionLog::Op::EndTransfer:
+                        if (f.size() >= 2) {
+                            std::string txid(f[0]);
+                            std::optional<PreparedTransfer> transfer = takeTransfer(txid);
+                            if (transfer && f[1] != "1") releaseTransfer(*transfer);
+                            endTransfer(txid, f[1] == "1");
+                        }
+                        break;
+                    case TransactionLog::Op::ForgetTransfer:
+                        if (f.size() >= 1) forgetTransfer(std::string(f[0]));
+                        break;
+                    case TransactionLog::Op::CommitDecision:
+                    case TransactionLog::Op::DecisionDelivered:
+                    case TransactionLog::Op::TransferBegun:
+                    case TransactionLog::Op::AbortDecision:
+                        break;  // router.wal only
+                }
+            });
+        replaying = false;
+        if (applied > 0) {
+            std::cout << "Replayed " << applied << " logged changes from " << LOG_FILE << "\n";
+        }
+    }
+
+    bool saveSnapshot(const CatalogVersion& catalog, const snapshot::Orders& orders) {
+        if (!snapshot::write(SNAPSHOT_FILE, catalog, orders)) {
+            std::cout << "Error: Could not save snapshot to " << SNAPSHOT_FILE << "\n";
+            return false;
+        }
+        std::cout << "Saved snapshot to " << SNAPSHOT_FILE << "\n";
+        return true;
+    }
+
+    bool snapshotIsCurrent() const {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        auto snapTime = fs::last_write_time(SNAPSHOT_FILE, ec);
+        if (ec) return false;
+        for (const auto& csv : {BOOKS_FILE, BORROWERS_FILE}) {
+            auto csvTime = fs::last_write_time(csv, ec);
+            if (!ec && csvTime > snapTime) return false;
+        }
+        return true;
+    }
+
+    bool loadSnapshot() {
+        LIBRARY_TIMED(LoadSnapshot);
+        snapshot::View view(SNAPSHOT_FILE);
+        if (!view.isValid()) return false;
+
+        books.clear();
+        books.reserve(view.bookCount());
+        for (uint32_t i = 0; i < view.bookCount(); ++i) {
+            const auto& rec = view.book(i);
+            Book book{std::string(view.str(rec.title)), std::string(view.str(rec.author)),
+                      std::string(view.str(rec.isbn)), std::string(view.str(rec.category))};
+            book.setAvailability((rec.flags & snapshot::BOOK_AVAILABLE) != 0);
+            books.push_back(std::move(book));
+        }
+
+        borrowers.clear();
+        borrowers.reserve(view.borrowerCount());
+        for (uint32_t i = 0; i < view.borrowerCount(); ++i) {
+            const auto& rec = view.borrower(i);
+            Borrower borrower{std::string(view.str(rec.id)), std::string(view.str(rec.name))};
+            for (uint32_t k = 0; k < rec.loanCount; ++k) {
+                borrower.borrowBook(view.loan(rec, k));
+            }
+            borrowers.push_back(std::move(borrower));
+        }
+
+        rebuildBookIndexes(&view);
+        rebuildBorrowerIndex();
+        std::cout << "Loaded " << books.size() << " books and " << borrowers.size()
+                  << " borrowers from " << SNAPSHOT_FILE << "\n";
+        return true;
+    }
+
+    void loadHolds() {
+        std::lock_guard<std::mutex> lock(holdsMutex);
+        holds.clear();
+        MappedFile file(HOLDS_FILE);
+        if (!file.isOpen()) return;  // no holds saved yet
+
+        CsvReader reader(file.view());
+        std::vector<std::string_view> fields;
+        // Skip header line
+        reader.nextRecord(fields);
+        while (reader.nextRecord(fields)) {
+            if (fields.size() >= 4) {
+                int tier = std::clamp(std::atoi(std::string(fields[2]).c_str()), 0,
+                                      static_cast<int>(HoldQueues::TIER_COUNT) - 1);
+                holds.place(std::string(fields[0]), std::string(fields[1]), static_cast<HoldTier>(tier),
+                            std::stoll(std::string(fields[3])));
+            }
+        }
+        holds.advanceTo(currentTime());
+    }
+
+    // Dates the loans on file and loads the fine balances. A book out on loan
+    // without a saved record (data from before loans were dated, or edited by
+    // hand) is treated as checked out now; saved records for books no longer
+    // out are dropped. Caller holds catalogMutex exclusively.
+    void loadLoans() {
+        std::lock_guard<std::mutex> lock(bookkeepingMutex);
+        dueDates.clear();
+        MappedFile file(LOANS_FILE);
+        if (file.isOpen()) {
+            CsvReader reader(file.view());
+            std::vector<std::string_view> fields;
+            // Skip header line
+            reader.nextRecord(fields);
+            while (reader.nextRecord(fields)) {
+                if (fields.size() < 4) continue;
+                const Book* book = findBook(std::string(fields[0]));
+                if (!book || book->getAvailability()) continue;
+                dueDates.lend(book->getISBNKey(), std::string(fields[1]), std::stoll(std::string(fields[2])),
+                              std::stoll(std::string(fields[3])));
+            }
+        }
+
+        int64_t now = currentTime();
+        for (const auto& borrower : borrowers) {
+            for (const auto& isbn : borrower.getBorrowedBooks()) {
+                const Book* book = findBook(isbn);
+                if (!book || book->getAvailability() || dueDates.find(book->getISBNKey())) continue;
+                dueDates.lend(book->getISBNKey(), borrower.getID(), now, now + LOAN_DAYS * DueDates::DAY_SECONDS);
+            }
+        }
+
+        MappedFile fines(FINES_FILE);
+        if (!fines.isOpen()) return;  // no fines charged yet
+        CsvReader reader(fines.view());
+        std::vector<std::string_view> fields;
+        // Skip header line
+        reader.nextRecord(fields);
+        while (reader.nextRecord(fields)) {
+            if (fields.size() >= 2) dueDates.charge(std::string(fields[0]), std::stoll(std::string(fields[1])));
+        }
+    }
+
+    bool saveFines(const std::vector<std::pair<std::string, int64_t>>& balances) {
+        std::string tmpPath = FINES_FILE + ".tmp";
+        std::ofstream file(tmpPath);
+        if (!file.is_open()) {
+            std::cout << "Error: Could not save fines to " << FINES_FILE << "\n";
+            return false;
+        }
+
+        // Write header
+        file << "BorrowerID,Cents\n";
+
+        for (const auto& [borrowerId, cents] : balances) {
+            file << csvEscape(borrowerId) << "," << cents << "\n";
+        }
+        file.close();
+        if (!file || !replaceFile(tmpPath, FINES_FILE)) {
+            std::cout << "Error: Could not save fines to " << FINES_FILE << "\n";
+            return false;
+        }
+        std::cout << "Saved " << balances.size() << " fine balances to " << FINES_FILE << "\n";
+        return true;
+    }
+
+    bool saveLoans(const std::vector<DueDates::Loan>& loans) {
+        std::string tmpPath = LOANS_FILE + ".tmp";
+        std::ofstream file(tmpPath);
+        if (!file.is_open()) {
+            std::cout << "Error: Could not save loans to " << LOANS_FILE << "\n";
+            return false;
+        }
+
+        // Write header
+        file << "ISBN,BorrowerID,CheckedOut,Due\n";
+
+        for (const auto& loan : loans) {
+            file << csvEscape(loan.isbn) << "," << csvEscape(loan.borrowerId) << ","
+                 << loan.checkedOut << "," << loan.due << "\n";
+        }
+        file.close();
+        if (!file || !replaceFile(tmpPath, LOANS_FILE)) {
+            std::cout << "Error: Could not save loans to " << LOANS_FILE << "\n";
+            return false;
+        }
+        std::cout << "Saved " << loans.size() << " loans to " << LOANS_FILE << "\n";
+        return true;
+    }
+
+    bool saveHolds(const std::vector<HoldQueues::HoldRecord>& records) {
+        std::string tmpPath = HOLDS_FILE + ".tmp";
+        std::ofstream file(tmpPath);
+        if (!file.is_open()) {
+            std::cout << "Error: Could not save holds to " << HOLDS_FILE << "\n";
+            return false;
+        }
+
+        // Write header
+        file << "ISBN,BorrowerID,Tier,ExpiresAt\n";
+        
+        // Queue order is preserved: each ISBN's holds are written in service order
+        for (const auto& hold : records) {
+            file << csvEscape(hold.isbn) << "," << csvEscape(hold.borrowerId) << ","
+                 << static_cast<int>(hold.tier) << "," << hold.expiresAt << "\n";
+        }
+        file.close();
+        if (!file || !replaceFile(tmpPath, HOLDS_FILE)) {
+            std::cout << "Error: Could not save holds to " << HOLDS_FILE << "\n";
+            return false;
+        }
+        std::cout << "Saved " << records.size() << " holds to " << HOLDS_FILE << "\n";
+        return true;
+    }
+
+    bool saveBooks(const CatalogVersion& catalog) {
+        std::string tmpPath = BOOKS_FILE + ".tmp";
+        std::ofstream file(tmpPath);
+        if (!file.is_open()) {
+            std::cout << "Error: Could not save books to " << BOOKS_FILE << "\n";
+            return false;
+        }
 
-    // Getters
-    std::string getTitle() const { return title; }
-    std::string getAuthor() const { return author; }
-    std::string getISBN() const { return isbn; }
-    bool getAvailability() const { return isAvailable; }
-    std::string getCategory() const { return category; }
+        // Write header
+        file << "Title,Author,ISBN,Available,Category\n";
+        
+        // Write book data
+        for (size_t i = 0; i < catalog.bookCount(); ++i) {
+            file << catalog.book(i).toCSV() << "\n";
+        }
+        file.close();
+        if (!file || !replaceFile(tmpPath, BOOKS_FILE)) {
+            std::cout << "Error: Could not save books to " << BOOKS_FILE << "\n";
+            return false;
+        }
+        std::cout << "Saved " << catalog.bookCount() << " books to " << BOOKS_FILE << "\n";
+        return true;
+    }
 
-    // Setters
-    void setTitle(const std::string& t) { title = t; }
-    void setAuthor(const std::string& a) { author = a; }
-    void setISBN(const std::string& i) { isbn = i; }
-    void setAvailability(bool status) { isAvailable = status; }
-    void setCategory(const std::string& cat) { category = cat; }
+    bool saveBorrowers(const CatalogVersion& catalog) {
+        std::string tmpPath = BORROWERS_FILE + ".tmp";
+        std::ofstream file(tmpPath);
+        if (!file.is_open()) {
+            std::cout << "Error: Could not save borrowers to " << BORROWERS_FILE << "\n";
+            return false;
+        }
 
-    // CSV format conversion
-    std::string toCSV() const {
-        return title + "," + author + "," + isbn + "," + 
-               std::to_string(isAvailable) + "," + category;
+        // Write header
+        file << "ID,Name,BorrowedBooks\n";
+        
+        // Write borrower data
+        for (size_t i = 0; i < catalog.borrowerCount(); ++i) {
+            file << catalog.borrower(i).toCSV() << "\n";
+        }
+        file.close();
+        if (!file || !replaceFile(tmpPath, BORROWERS_FILE)) {
+            std::cout << "Error: Could not save borrowers to " << BORROWERS_FILE << "\n";
+            return false;
+        }
+        std::cout << "Saved " << catalog.borrowerCount() << " borrowers to " << BORROWERS_FILE << "\n";
+        return true;
     }
 };
 
-// Tree structure for category-based organization
-struct CategoryNode {
-    std::string category;
-    std::vector<Book> books;
-    std::vector<CategoryNode*> subcategories;
-    
-    CategoryNode(const std::string& cat) : category(cat) {}
-    
-    ~CategoryNode() {
-        for (auto subcat : subcategories) {
-            delete subcat;
+// Request/response protocol used by server mode. One request per line, fields
+// separated by tabs; responses come back in request order, so clients may
+// pipeline any number of requests (or send a whole batch in one write).
+//   PING                              -> OK
+//   BORROW <isbn> <borrower id>       -> OK | ERR unavailable
+//   RETURN <isbn> <borrower id>       -> OK | ERR not on loan
+//   BORROWBATCH <isbn> <borrower id> [<isbn> <borrower id>]...
+//   RETURNBATCH <isbn> <borrower id> [<isbn> <borrower id>]...
+//                                     -> OK <n>, then one status line per item, in order, as BORROW
+//                                        or RETURN would answer, or ERR unknown book / ERR unknown
+//                                        borrower (not offered by the router)
+//   ADD <title> <author> <isbn> <category>            -> OK
+//   ADDBORROWER <id> <name>           -> OK
+//   CATEGORIES                        -> OK <n>, then n category lines
+//   CATEGORY <name> [limit]           -> OK <n>, then n "isbn\ttitle\tauthor\tA|B" lines
+//   BROWSE [path]                     -> OK <n>, then n "subcategory path\tbook count" lines
+//   SETCATEGORY <isbn> <category>     -> OK | ERR unknown book
+//   RECOMMEND <category> [limit] [SCORED]
+//                                     -> OK <n>, then n title lines ("title\tscore" with SCORED)
+//   LIST <title|author|category> [page] [page size]
+//                                     -> OK <n>, then n "isbn\ttitle\tauthor\tA|B" lines
+//   STATS [category]                  -> OK <books>\t<on loan>\t<checkouts since startup>
+//   TOP [n]                           -> OK <n>, then n "isbn\tcheckouts" lines, most borrowed first
+//   LOANS <borrower id>               -> OK <checkouts since startup>
+//   OVERDUE [limit]                   -> OK <n>, then n "isbn\tborrower id\tcheckout\tdue" lines, most overdue first
+//   DUE <hours> [limit]               -> OK <n>, then n loan lines as for OVERDUE, due soonest first
+//   FINES [limit]                     -> OK <n>, then n "borrower id\tlate loans\tcents" lines, largest first
+//   ALSO <isbn> [limit]               -> OK <n>, then n "isbn\ttitle\tauthor\tA|B" lines
+//   SEARCH <query> [limit] [SCORED]   -> OK <n>, then n "isbn\ttitle\tauthor\tA|B" lines, best first
+//                                        (with SCORED each line ends in "\tscore")
+//   METRICS [json]                    -> OK <n>, then n lines of Prometheus text (or JSON)
+// Sent by ShardRouter to the shards of a cross-shard checkout or return:
+//   PREPARE <txid> <BORROW|RETURN> <isbn> <borrower id>  -> OK | ERR refused
+//   COMMIT <txid>                     -> OK | ERR aborted | ERR unknown transaction
+//                                        (OK again if it was already committed)
+//   ABORT <txid>                      -> OK | ERR committed
+//   FORGET <txid>                     -> OK   (both shards have the decision; drop its outcome)
+class RequestHandler {
+private:
+    LibraryManager& library;
+
+    static void appendBookLine(std::string& out, const Book& book) {
+        out += book.getISBN();
+        out += '\t';
+        out += book.getTitle();
+        out += '\t';
+        out += book.getAuthor();
+        out += book.getAvailability() ? "\tA\n" : "\tB\n";
+    }
+
+    static const char* batchReply(BatchStatus status, const char* refused) {
+        switch (status) {
+            case BatchStatus::Ok: return "OK\n";
+            case BatchStatus::UnknownBook: return "ERR unknown book\n";
+            case BatchStatus::UnknownBorrower: return "ERR unknown borrower\n";
+            default: return refused;
         }
     }
-    
-    void addBook(const Book& book) {
-        books.push_back(book);
+
+    // Round-trips through strtod, so a router can merge shards' results by score
+    static void appendScore(std::string& out, double score) {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "\t%.17g", score);
+        out += buffer;
     }
-    
-    void display(int level = 0) const {
-        std::string indent(level * 4, ' ');
-        std::cout << indent << "Category: " << category << "\n";
-        std::cout << indent << "Books:\n";
-        for (const auto& book : books) {
-            std::cout << indent << "    - " << book.getTitle() 
-                     << " by " << book.getAuthor() 
-                     << " (ISBN: " << book.getISBN() << ")"
-                     << " [" << (book.getAvailability() ? "Available" : "Borrowed") << "]\n";
-        }
-        for (const auto& subcat : subcategories) {
-            subcat->display(level + 1);
+
+public:
+    explicit RequestHandler(LibraryManager& lib) : library(lib) {}
+
+    // Splits a request line (without the newline) into its tab-separated fields
+    static std::vector<std::string_view> fields(std::string_view line) {
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        std::vector<std::string_view> f;
+        while (true) {
+            size_t tab = line.find('\t');
+            f.push_back(line.substr(0, tab));
+            if (tab == std::string_view::npos) break;
+            line.remove_prefix(tab + 1);
         }
+        return f;
     }
-};
 
-// Graph structure for category relationships
-struct CategoryGraph {
-    struct Edge {
-        std::string from;
-        std::string to;
-        int weight;  // Number of books that share these categories
-        
-        Edge(const std::string& f, const std::string& t, int w) 
-            : from(f), to(t), weight(w) {}
-    };
-    
-    std::map<std::string, std::vector<Edge>> adjacencyList;
-    
-    void addEdge(const std::string& from, const std::string& to, int weight) {
-        adjacencyList[from].push_back(Edge(from, to, weight));
-        adjacencyList[to].push_back(Edge(to, from, weight));  // Undirected graph
+    // Field 'index' as a count, or 'fallback' when it is missing or not a number
+    static size_t parseLimit(const std::vector<std::string_view>& f, size_t index, size_t fallback) {
+        if (f.size() <= index) return fallback;
+        size_t value = 0;
+        for (char c : f[index]) {
+            if (c < '0' || c > '9') return fallback;
+            value = value * 10 + static_cast<size_t>(c - '0');
+        }
+        return value;
     }
-    
-    void display() const {
-        std::cout << "\nCategory Relationships Graph:\n";
-        std::cout << "============================\n";
-        
-        // Display each category and its connections
-        for (const auto& [category, edges] : adjacencyList) {
-            if (!edges.empty()) {
-                std::cout << category << " is connected to:\n";
-                for (const auto& edge : edges) {
-                    std::cout << "  - " << edge.to 
-                             << " (Strength: " << edge.weight << " shared books)\n";
+
+    // Handles one request line (without the newline) and appends its response to 'out'
+    void handle(std::string_view line, std::string& out) {
+        std::vector<std::string_view> f = fields(line);
+        std::string_view op = f[0];
+        auto arg = [&f](size_t i) { return std::string(f[i]); };
+
+        if (op == "PING") {
+            out += "OK\n";
+        } else if (op == "BORROW" && f.size() >= 3) {
+            out += library.borrowBook(arg(1), arg(2)) ? "OK\n" : "ERR unavailable\n";
+        } else if (op == "RETURN" && f.size() >= 3) {
+            out += library.returnBook(arg(1), arg(2)) ? "OK\n" : "ERR not on loan\n";
+        } else if ((op == "BORROWBATCH" || op == "RETURNBATCH") && f.size() >= 3 && f.size() % 2 == 1) {
+            bool borrowing = op == "BORROWBATCH";
+            std::vector<std::pair<std::string, std::string>> items;
+            items.reserve(f.size() / 2);
+            for (size_t i = 1; i < f.size(); i += 2) items.emplace_back(arg(i), arg(i + 1));
+            std::vector<BatchStatus> status = borrowing ? library.borrowBatch(items) : library.returnBatch(items);
+            out += "OK " + std::to_string(status.size()) + "\n";
+            for (BatchStatus s : status) out += batchReply(s, borrowing ? "ERR unavailable\n" : "ERR not on loan\n");
+        } else if (op == "ADD" && f.size() >= 5) {
+            library.addBook(Book(arg(1), arg(2), arg(3), arg(4)));
+            out += "OK\n";
+        } else if (op == "ADDBORROWER" && f.size() >= 3) {
+            library.addBorrower(Borrower(arg(1), arg(2)));
+            out += "OK\n";
+        } else if (op == "CATEGORIES") {
+            std::vector<std::string> categories = library.listCategories();
+            out += "OK " + std::to_string(categories.size()) + "\n";
+            for (const auto& category : categories) {
+                out += category;
+                out += '\n';
+            }
+        } else if (op == "CATEGORY" && f.size() >= 2) {
+            std::vector<Book> found = library.booksInCategory(arg(1), parseLimit(f, 2, 100));
+            out += "OK " + std::to_string(found.size()) + "\n";
+            for (const auto& book : found) appendBookLine(out, book);
+        } else if (op == "RECOMMEND" && f.size() >= 2) {
+            std::vector<double> scores;
+            bool scored = f.size() >= 4 && f[3] == "SCORED";
+            std::vector<std::string> titles = library.recommendBooks(arg(1), parseLimit(f, 2, 20),
+                                                                     scored ? &scores : nullptr);
+            out += "OK " + std::to_string(titles.size()) + "\n";
+            for (size_t i = 0; i < titles.size(); ++i) {
+                out += titles[i];
+                if (scored) appendScore(out, scores[i]);
+                out += '\n';
+            }
+        } else if (op == "LIST" && f.size() >= 2 &&
+                   (f[1] == "title" || f[1] == "author" || f[1] == "category")) {
+            BookOrder order = f[1] == "title" ? BookOrder::Title
+                            : f[1] == "author" ? BookOrder::Author : BookOrder::Category;
+            std::vector<Book> found = library.booksPage(order, parseLimit(f, 2, 0), parseLimit(f, 3, 20));
+            out += "OK " + std::to_string(found.size()) + "\n";
+            for (const auto& book : found) appendBookLine(out, book);
+        } else if (op == "BROWSE") {
+            auto children = library.browseCategory(f.size() >= 2 ? arg(1) : std::string());
+            out += "OK " + std::to_string(children.size()) + "\n";
+            for (const auto& [path, count] : children) {
+                out += path;
+                out += '\t';
+                out += std::to_string(count);
+                out += '\n';
+            }
+        } else if (op == "SETCATEGORY" && f.size() >= 3) {
+            out += library.changeCategory(arg(1), arg(2)) ? "OK\n" : "ERR unknown book\n";
+        } else if (op == "STATS") {
+            CirculationStats::Usage usage = f.size() >= 2 ? library.categoryUsage(arg(1)) : library.libraryUsage();
+            out += "OK " + std::to_string(usage.books) + "\t" + std::to_string(usage.onLoan) + "\t" +
+                   std::to_string(usage.loans) + "\n";
+        } else if (op == "TOP") {
+            std::vector<CirculationStats::Title> top = library.mostBorrowed(parseLimit(f, 1, 10));
+            out += "OK " + std::to_string(top.size()) + "\n";
+            for (const auto& title : top) {
+                out += title.isbn;
+                out += '\t';
+                out += std::to_string(title.count);
+                out += '\n';
+            }
+        } else if (op == "LOANS" && f.size() >= 2) {
+            out += "OK " + std::to_string(library.loansBy(arg(1))) + "\n";
+        } else if (op == "OVERDUE" || (op == "DUE" && f.size() >= 2)) {
+            std::vector<DueDates::Loan> loans = op == "OVERDUE"
+                ? library.overdueLoans()
+                : library.loansDueWithin(static_cast<int64_t>(parseLimit(f, 1, 48)) * 3600);
+            loans.resize(std::min(loans.size(), parseLimit(f, op == "OVERDUE" ? 1 : 2, 100)));
+            out += "OK " + std::to_string(loans.size()) + "\n";
+            for (const auto& loan : loans) {
+                out += loan.isbn + "\t" + loan.borrowerId + "\t" + std::to_string(loan.checkedOut) + "\t" +
+                       std::to_string(loan.due) + "\n";
+            }
+        } else if (op == "FINES") {
+            std::vector<DueDates::Fine> fines = library.outstandingFines();
+            fines.resize(std::min(fines.size(), parseLimit(f, 1, 100)));
+            out += "OK " + std::to_string(fines.size()) + "\n";
+            for (const auto& fine : fines) {
+                out += fine.borrowerId + "\t" + std::to_string(fine.lateLoans) + "\t" +
+                       std::to_string(fine.cents) + "\n";
+            }
+        } else if (op == "ALSO" && f.size() >= 2) {
+            std::vector<Book> found = library.alsoBorrowedWith(arg(1), parseLimit(f, 2, 10));
+            out += "OK " + std::to_string(found.size()) + "\n";
+            for (const auto& book : found) appendBookLine(out, book);
+        } else if (op == "SEARCH" && f.size() >= 2) {
+            std::vector<double> scores;
+            bool scored = f.size() >= 4 && f[3] == "SCORED";
+            std::vector<Book> found = library.searchBooks(arg(1), parseLimit(f, 2, 10), scored ? &scores : nullptr);
+            out += "OK " + std::to_string(found.size()) + "\n";
+            for (size_t i = 0; i < found.size(); ++i) {
+                appendBookLine(out, found[i]);
+                if (scored) {
+                    out.pop_back();  // the newline
+                    appendScore(out, scores[i]);
+                    out += '\n';
                 }
-                std::cout << "\n";
             }
+        } else if (op == "METRICS") {
+#ifdef LIBRARY_HAVE_METRICS
+            std::string dump = f.size() >= 2 && f[1] == "json" ? metrics::json() : metrics::prometheus();
+            out += "OK " + std::to_string(std::count(dump.begin(), dump.end(), '\n')) + "\n";
+            out += dump;
+#else
+            out += "ERR metrics disabled\n";
+#endif
+        } else if (op == "PREPARE" && f.size() >= 5 && (f[2] == "BORROW" || f[2] == "RETURN")) {
+            out += library.prepareTransfer(arg(1), f[2] == "BORROW", arg(3), arg(4)) ? "OK\n" : "ERR refused\n";
+        } else if (op == "COMMIT" && f.size() >= 2) {
+            LibraryManager::TransferState state = library.commitTransfer(arg(1));
+            out += state == LibraryManager::TransferState::Committed ? "OK\n"
+                 : state == LibraryManager::TransferState::Aborted ? "ERR aborted\n"
+                                                                   : "ERR unknown transaction\n";
+        } else if (op == "ABORT" && f.size() >= 2) {
+            out += library.abortTransfer(arg(1)) == LibraryManager::TransferState::Aborted ? "OK\n"
+                                                                                            : "ERR committed\n";
+        } else if (op == "FORGET" && f.size() >= 2) {
+            library.forgetTransfer(arg(1));
+            out += "OK\n";
+        } else {
+            out += "ERR bad request\n";
         }
     }
 };
 
-// Borrower class definition
-class Borrower {
-private:
-    std::string id;
-    std::string name;
-    std::vector<std::string> borrowedBooks; // Stores ISBNs of borrowed books
+#ifdef LIBRARY_HAVE_EPOLL
+namespace net {
 
-public:
-    Borrower(const std::string& i = "", const std::string& n = "")
-        : id(i), name(n) {}
+volatile std::sig_atomic_t stopRequested = 0;
 
-    // Getters
-    std::string getID() const { return id; }
-    std::string getName() const { return name; }
-    const std::vector<std::string>& getBorrowedBooks() const { return borrowedBooks; }
+inline void onSignal(int) { stopRequested = 1; }
 
-    // Setters
-    void setID(const std::string& i) { id = i; }
-    void setName(const std::string& n) { name = n; }
+inline void setNonBlocking(int fd) {
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// "7070" or "127.0.0.1:7070" -> loopback TCP; anything containing '/' -> Unix socket path
+inline bool isUnixAddress(const std::string& address) {
+    return address.find('/') != std::string::npos;
+}
 
-    // Borrowing operations
-    void borrowBook(const std::string& isbn) {
-        borrowedBooks.push_back(isbn);
+inline int tcpPort(const std::string& address) {
+    size_t colon = address.rfind(':');
+    return std::stoi(colon == std::string::npos ? address : address.substr(colon + 1));
+}
+
+inline int listenOn(const std::string& address) {
+    int fd;
+    if (isUnixAddress(address)) {
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+        ::unlink(address.c_str());
+        if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return -1;
+    } else {
+        fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(tcpPort(address)));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return -1;
     }
+    if (::listen(fd, SOMAXCONN) != 0) return -1;
+    return fd;
+}
 
-    void returnBook(const std::string& isbn) {
-        auto it = std::find(borrowedBooks.begin(), borrowedBooks.end(), isbn);
-        if (it != borrowedBooks.end()) {
-            borrowedBooks.erase(it);
+inline int connectTo(const std::string& address) {
+    int fd;
+    if (isUnixAddress(address)) {
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+        if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            ::close(fd);
+            return -1;
+        }
+    } else {
+        fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(tcpPort(address)));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            ::close(fd);
+            return -1;
         }
     }
+    return fd;
+}
 
-    // CSV format conversion
-    std::string toCSV() const {
-        std::string books;
-        for (const auto& isbn : borrowedBooks) {
-            books += isbn + ";";
-        }
-        return id + "," + name + "," + books;
+inline bool writeAll(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += static_cast<size_t>(n);
     }
-};
+    return true;
+}
 
-// Library Manager class definition
-class LibraryManager {
+} // namespace net
+
+// Spreads the catalog over several shard processes, each an ordinary --serve
+// instance with its own data files, and answers the request protocol on their
+// behalf. Books are placed by a hash of the ISBN and borrowers by a hash of
+// the ID (shardFor). A request about one book or borrower goes to its shard;
+// catalog-wide queries go to every shard and the replies are merged. A
+// checkout or return whose book and borrower live on different shards runs as
+// a two-phase commit with the router as coordinator. The transfer is logged to
+// router.wal before any shard is asked to vote, and the decision before any
+// shard hears it; a decision is delivered again until both shards acknowledge
+// it, across restarts too. A transfer the log shows begun but not decided was
+// never committed anywhere, so a restarted router aborts it. Shards are called over
+// blocking connections, one request at a time; a fan-out sends to every shard
+// before reading any reply, so the shards work on it in parallel.
+class ShardRouter {
 private:
-    std::vector<Book> books;
-    std::vector<Borrower> borrowers;
-    std::queue<std::pair<std::string, std::string>> reservations; // pair of ISBN and borrower ID
-    std::stack<std::string> recentTransactions;
-    std::map<std::string, std::vector<std::string>> categoryGraph; // for book recommendations
+    // A shard that takes longer than this to accept or answer a request is
+    // treated as down, so one hung shard cannot stall the router
+    static constexpr int SHARD_TIMEOUT_SECONDS = 5;
 
-    // File paths
-    const std::string BOOKS_FILE = "books.csv";
-    const std::string BORROWERS_FILE = "borrowers.csv";
+    static constexpr uint64_t DECISION_LOG_COMPACT_THRESHOLD = 1 << 20;
 
-public:
-    LibraryManager() {
-        loadData();
-    }
+    struct Shard {
+        std::string address;
+        int fd = -1;
+        std::string in;  // received bytes not yet consumed
+    };
 
-    // Data persistence methods
-    void loadData() {
-        loadBooks();
-        loadBorrowers();
+    // A transfer whose shards have not both acknowledged the decision and
+    // been told to forget it
+    struct PendingDecision {
+        enum class Outcome { Undecided, Commit, Abort };
+        std::string addresses[2];  // book's shard, borrower's shard
+        Outcome outcome = Outcome::Undecided;
+        bool acknowledged[2] = {false, false};
+        bool forgotten[2] = {false, false};
+        bool warned = false;  // a shard's refusal has been reported
+    };
+
+    std::vector<Shard> shards;
+    std::string transactionPrefix;
+    uint64_t transactions = 0;
+    TransactionLog decisions{"router.wal", 1};
+    std::map<std::string, PendingDecision> pending;
+    std::chrono::steady_clock::time_point lastResolve;
+
+    void disconnect(Shard& shard) {
+        if (shard.fd >= 0) ::close(shard.fd);
+        shard.fd = -1;
+        shard.in.clear();
     }
 
-    void saveData() {
-        saveBooks();
-        saveBorrowers();
+    // Connects on first use and again after a shard has gone away, including
+    // one that restarted since the last request (its old connection reads EOF)
+    bool send(Shard& shard, const std::string& line) {
+        char probe;
+        if (shard.fd >= 0 && shard.in.empty() && ::recv(shard.fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT) >= 0) {
+            disconnect(shard);
+        }
+        if (shard.fd < 0) {
+            if ((shard.fd = net::connectTo(shard.address)) < 0) return false;
+            timeval timeout{SHARD_TIMEOUT_SECONDS, 0};
+            ::setsockopt(shard.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            ::setsockopt(shard.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        }
+        if (net::writeAll(shard.fd, line + "\n")) return true;
+        disconnect(shard);
+        return false;
     }
 
-    // Book management
-    void addBook(const Book& book) {
-        books.push_back(book);
-        updateCategoryGraph(book);
+    bool readLine(Shard& shard, std::string& line) {
+        while (true) {
+            size_t nl = shard.in.find('\n');
+            if (nl != std::string::npos) {
+                line.assign(shard.in, 0, nl);
+                shard.in.erase(0, nl + 1);
+                return true;
+            }
+            char buffer[64 * 1024];
+            ssize_t n = ::recv(shard.fd, buffer, sizeof(buffer), 0);
+            if (n <= 0) {  // closed, failed or timed out; a late reply must not be read as the next one
+                disconnect(shard);
+                return false;
+            }
+            shard.in.append(buffer, static_cast<size_t>(n));
+        }
     }
 
-    void removeBook(const std::string& isbn) {
-        books.erase(
-            std::remove_if(books.begin(), books.end(),
-                [&isbn](const Book& b) { return b.getISBN() == isbn; }),
-            books.end());
+    // The reply to a request already sent: the status line and, for a
+    // listing ("OK <n>"), the n lines after it. Empty if the shard is down.
+    std::vector<std::string> receive(Shard& shard, bool listing) {
+        std::vector<std::string> reply(1);
+        if (shard.fd < 0 || !readLine(shard, reply[0])) return {};
+        if (listing && reply[0].compare(0, 3, "OK ") == 0) {
+            reply.resize(1 + std::strtoul(reply[0].c_str() + 3, nullptr, 10));
+            for (size_t i = 1; i < reply.size(); ++i) {
+                if (!readLine(shard, reply[i])) return {};
+            }
+        }
+        return reply;
     }
 
-    // Borrower management
-    void addBorrower(const Borrower& borrower) {
-        borrowers.push_back(borrower);
+    std::vector<std::string> call(size_t shard, const std::string& line, bool listing) {
+        if (!send(shards[shard], line)) return {};
+        return receive(shards[shard], listing);
     }
 
-    // Borrowing operations
-    bool borrowBook(const std::string& isbn, const std::string& borrowerId) {
-        auto bookIt = std::find_if(books.begin(), books.end(),
-            [&isbn](const Book& b) { return b.getISBN() == isbn; });
-        
-        if (bookIt != books.end() && bookIt->getAvailability()) {
-            auto borrowerIt = std::find_if(borrowers.begin(), borrowers.end(),
-                [&borrowerId](const Borrower& b) { return b.getID() == borrowerId; });
-            
-            if (borrowerIt != borrowers.end()) {
-                bookIt->setAvailability(false);
-                borrowerIt->borrowBook(isbn);
-                recentTransactions.push("Borrow: " + isbn + " by " + borrowerId);
-                return true;
-            }
+    // The listing lines from every shard, or nullopt if any shard is down
+    std::optional<std::vector<std::vector<std::string>>> callAll(const std::string& line) {
+        std::vector<bool> sent(shards.size());
+        for (size_t i = 0; i < shards.size(); ++i) sent[i] = send(shards[i], line);
+        std::vector<std::vector<std::string>> replies(shards.size());
+        bool complete = true;
+        for (size_t i = 0; i < shards.size(); ++i) {
+            replies[i] = sent[i] ? receive(shards[i], true) : std::vector<std::string>{};
+            if (replies[i].empty() || replies[i][0].compare(0, 2, "OK") != 0) complete = false;
+            if (!replies[i].empty()) replies[i].erase(replies[i].begin());
         }
-        return false;
+        if (!complete) return std::nullopt;
+        return replies;
     }
 
-    bool returnBook(const std::string& isbn, const std::string& borrowerId) {
-        auto bookIt = std::find_if(books.begin(), books.end(),
-            [&isbn](const Book& b) { return b.getISBN() == isbn; });
-        
-        if (bookIt != books.end()) {
-            auto borrowerIt = std::find_if(borrowers.begin(), borrowers.end(),
-                [&borrowerId](const Borrower& b) { return b.getID() == borrowerId; });
-            
-            if (borrowerIt != borrowers.end()) {
-                bookIt->setAvailability(true);
-                borrowerIt->returnBook(isbn);
-                recentTransactions.push("Return: " + isbn + " by " + borrowerId);
-                return true;
-            }
+    static void appendReply(std::string& out, const std::vector<std::string>& reply) {
+        if (reply.empty()) {
+            out += "ERR shard unavailable\n";
+            return;
+        }
+        for (const auto& line : reply) {
+            out += line;
+            out += '\n';
         }
-        return false;
     }
 
-    // Display methods
-    void displayBooks() const {
-        std::cout << "\nLibrary Books:\n";
-        std::cout << "----------------------------------------\n";
-        for (const auto& book : books) {
-            std::cout << "Title: " << book.getTitle() << "\n"
-                     << "Author: " << book.getAuthor() << "\n"
-                     << "ISBN: " << book.getISBN() << "\n"
-                     << "Status: " << (book.getAvailability() ? "Available" : "Borrowed") << "\n"
-                     << "Category: " << book.getCategory() << "\n"
-                     << "----------------------------------------\n";
+    static void appendListing(std::string& out, const std::vector<std::string>& lines) {
+        out += "OK " + std::to_string(lines.size()) + "\n";
+        for (const auto& line : lines) {
+            out += line;
+            out += '\n';
         }
     }
 
-    void displayBooksByCategory() {
-        // Create root node
-        CategoryNode* root = new CategoryNode("Root");
-        
-        // Create category map
-        std::map<std::string, CategoryNode*> categoryMap;
-        
-        // First pass: Create category nodes
-        for (const auto& book : books) {
-            std::string category = book.getCategory();
-            if (categoryMap.find(category) == categoryMap.end()) {
-                CategoryNode* node = new CategoryNode(category);
-                categoryMap[category] = node;
-                root->subcategories.push_back(node);
-            }
+    // Both shards vote on PREPARE; both get COMMIT if both agreed, otherwise
+    // both get ABORT. Nothing is sent until the record it depends on is in
+    // router.wal: the transfer before PREPARE, the decision before it is
+    // delivered.
+    std::string transfer(bool borrowing, const std::string& isbn, const std::string& borrowerId,
+                         size_t bookShard, size_t borrowerShard) {
+        std::string txid = transactionPrefix + std::to_string(++transactions);
+        const size_t parts[2] = {bookShard, borrowerShard};
+        PendingDecision& decision = pending[txid];
+        for (int i = 0; i < 2; ++i) decision.addresses[i] = shards[parts[i]].address;
+        decisions.append(TransactionLog::Op::TransferBegun, {txid, decision.addresses[0], decision.addresses[1]});
+        if (!decisions.commit()) {
+            // No shard has heard of it; it is aborted once the log can be written
+            decision.outcome = PendingDecision::Outcome::Abort;
+            decisions.append(TransactionLog::Op::AbortDecision, {txid});
+            return "ERR log write failed\n";
         }
-        
-        // Second pass: Add books to categories
-        for (const auto& book : books) {
-            categoryMap[book.getCategory()]->addBook(book);
+
+        bool sent[2], agreed[2];
+        std::string prepare = "PREPARE\t" + txid + (borrowing ? "\tBORROW\t" : "\tRETURN\t") + isbn + "\t" + borrowerId;
+        for (int i = 0; i < 2; ++i) sent[i] = send(shards[parts[i]], prepare);
+        for (int i = 0; i < 2; ++i) {
+            std::vector<std::string> vote = sent[i] ? receive(shards[parts[i]], false) : std::vector<std::string>{};
+            agreed[i] = !vote.empty() && vote[0] == "OK";
         }
-        
-        // Sort subcategories alphabetically
-        std::sort(root->subcategories.begin(), root->subcategories.end(),
-            [](const CategoryNode* a, const CategoryNode* b) {
-                return a->category < b->category;
-            });
-        
-        // Display the tree
-        std::cout << "\nLibrary Books by Category:\n";
-        std::cout << "========================\n";
-        for (const auto& catNode : root->subcategories) {
-            catNode->display();
-            std::cout << "------------------------\n";
+
+        bool commit = agreed[0] && agreed[1];
+        decision.outcome = commit ? PendingDecision::Outcome::Commit : PendingDecision::Outcome::Abort;
+        if (commit) {
+            decisions.append(TransactionLog::Op::CommitDecision, {txid, decision.addresses[0], decision.addresses[1]});
+        } else {
+            decisions.append(TransactionLog::Op::AbortDecision, {txid});
         }
-        
-        // Cleanup
-        delete root;
+        bool delivered = deliver(txid);
+        if (!commit) return borrowing ? "ERR unavailable\n" : "ERR not on loan\n";
+        return delivered ? "OK\n" : "ERR transaction " + txid + " incomplete\n";
     }
 
-    void searchByCategory() {
-        std::cout << "\nAvailable Categories:\n";
-        std::set<std::string> categories;
-        for (const auto& book : books) {
-            categories.insert(book.getCategory());
+    // Sends a decision to the shards that have not acknowledged it, once it
+    // is on disk, and then FORGET to both. Only "OK" counts as an answer;
+    // anything else is retried. True once both shards have acknowledged the
+    // decision; the router forgets it once both have forgotten it.
+    bool deliver(const std::string& txid) {
+        PendingDecision& decision = pending.at(txid);
+        if (!decisions.commit()) return false;  // the decision may not be on disk yet
+        Shard* targets[2] = {nullptr, nullptr};
+        for (int i = 0; i < 2; ++i) {
+            for (auto& shard : shards) {
+                if (shard.address == decision.addresses[i]) targets[i] = &shard;
+            }
         }
-        
-        for (const auto& category : categories) {
-            std::cout << "- " << category << "\n";
+        auto exchange = [&](const std::string& line, bool (&done)[2]) {
+            bool sent[2];
+            for (int i = 0; i < 2; ++i) sent[i] = !done[i] && targets[i] && send(*targets[i], line);
+            for (int i = 0; i < 2; ++i) {
+                if (!sent[i]) continue;
+                std::vector<std::string> reply = receive(*targets[i], false);
+                if (reply.empty()) continue;
+                if (reply[0] == "OK") {
+                    done[i] = true;
+                } else if (!decision.warned) {
+                    // A shard that refuses the decision needs a librarian's
+                    // attention; it is asked again meanwhile
+                    std::cout << "Warning: shard " << decision.addresses[i] << " answered " << reply[0]
+                              << " to " << line << "\n";
+                    decision.warned = true;
+                }
+            }
+            return done[0] && done[1];
+        };
+
+        bool committed = decision.outcome == PendingDecision::Outcome::Commit;
+        if (!decision.acknowledged[0] || !decision.acknowledged[1]) {
+            if (!exchange((committed ? "COMMIT\t" : "ABORT\t") + txid, decision.acknowledged)) return false;
+            decisions.append(TransactionLog::Op::DecisionDelivered, {txid});
         }
-        
-        std::string searchCategory;
-        std::cout << "\nEnter category to search: ";
-        std::getline(std::cin, searchCategory);
-        
-        std::cout << "\nBooks in category '" << searchCategory << "':\n";
-        std::cout << "----------------------------------------\n";
-        bool found = false;
-        
-        for (const auto& book : books) {
-            if (book.getCategory() == searchCategory) {
-                std::cout << "Title: " << book.getTitle() << "\n"
-                         << "Author: " << book.getAuthor() << "\n"
-                         << "ISBN: " << book.getISBN() << "\n"
-                         << "Status: " << (book.getAvailability() ? "Available" : "Borrowed") << "\n"
-                         << "----------------------------------------\n";
-                found = true;
+        // Shards may drop the outcome only once no restart of the router can
+        // ask them about it again
+        if (decisions.commit() && exchange("FORGET\t" + txid, decision.forgotten)) {
+            decisions.append(TransactionLog::Op::ForgetTransfer, {txid});
+            pending.erase(txid);
+        }
+        return true;
+    }
+
+public:
+    // Transaction ids carry the start time and process id, so a restarted
+    // router never reuses one a shard may still remember
+    explicit ShardRouter(const std::vector<std::string>& addresses)
+        : transactionPrefix("R" + std::to_string(std::time(nullptr)) + "." + std::to_string(::getpid()) + "-") {
+        shards.resize(addresses.size());
+        for (size_t i = 0; i < addresses.size(); ++i) shards[i].address = addresses[i];
+        decisions.replay([this](TransactionLog::Op op, const std::vector<std::string_view>& f) {
+            if ((op == TransactionLog::Op::TransferBegun || op == TransactionLog::Op::CommitDecision) &&
+                f.size() >= 3) {
+                PendingDecision& decision = pending[std::string(f[0])];
+                decision.addresses[0] = std::string(f[1]);
+                decision.addresses[1] = std::string(f[2]);
+                if (op == TransactionLog::Op::CommitDecision) decision.outcome = PendingDecision::Outcome::Commit;
+            } else if (op == TransactionLog::Op::AbortDecision && f.size() >= 1) {
+                auto it = pending.find(std::string(f[0]));
+                if (it != pending.end()) it->second.outcome = PendingDecision::Outcome::Abort;
+            } else if (op == TransactionLog::Op::DecisionDelivered && f.size() >= 1) {
+                auto it = pending.find(std::string(f[0]));
+                if (it != pending.end()) it->second.acknowledged[0] = it->second.acknowledged[1] = true;
+            } else if (op == TransactionLog::Op::ForgetTransfer && f.size() >= 1) {
+                pending.erase(std::string(f[0]));
             }
+        });
+        // Begun but never decided: no shard can have heard COMMIT, so abort it
+        for (auto& [txid, decision] : pending) {
+            if (decision.outcome != PendingDecision::Outcome::Undecided) continue;
+            decision.outcome = PendingDecision::Outcome::Abort;
+            decisions.append(TransactionLog::Op::AbortDecision, {txid});
         }
-        
-        if (!found) {
-            std::cout << "No books found in category '" << searchCategory << "'\n";
+        if (!pending.empty()) {
+            std::cout << "Delivering " << pending.size() << " transfer decisions from router.wal\n";
         }
     }
 
-    // Sorting methods
-    void sortBooksByTitle() {
-        std::sort(books.begin(), books.end(),
-            [](const Book& a, const Book& b) { return a.getTitle() < b.getTitle(); });
+    ShardRouter(const ShardRouter&) = delete;
+    ShardRouter& operator=(const ShardRouter&) = delete;
+
+    ~ShardRouter() {
+        for (auto& shard : shards) disconnect(shard);
     }
 
-    void sortBooksByAuthor() {
-        std::sort(books.begin(), books.end(),
-            [](const Book& a, const Book& b) { return a.getAuthor() < b.getAuthor(); });
+    // Retries undelivered decisions, at most once a second. Once none are
+    // left an oversized decision log is emptied.
+    void resolvePending() {
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastResolve < std::chrono::seconds(1)) return;
+        lastResolve = now;
+        std::vector<std::string> txids;
+        for (const auto& entry : pending) txids.push_back(entry.first);
+        for (const auto& txid : txids) deliver(txid);
+        if (pending.empty() && decisions.size() > DECISION_LOG_COMPACT_THRESHOLD && decisions.rotate()) {
+            decisions.dropRotated();
+        }
     }
 
-    void analyzeCategories() {
-        std::cout << "\nAnalyzing Library Categories...\n\n";
-        
-        // First, display category statistics
-        std::map<std::string, int> categoryCount;
-        for (const auto& book : books) {
-            categoryCount[book.getCategory()]++;
+    // Shard that owns an ISBN or a borrower ID (FNV-1a hash)
+    static size_t shardFor(std::string_view key, size_t count) {
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c : key) {
+            hash ^= c;
+            hash *= 1099511628211ull;
         }
-        
-        std::cout << "Category Statistics:\n";
-        std::cout << "===================\n";
-        for (const auto& [category, count] : categoryCount) {
-            std::cout << category << ": " << count << " books\n";
+        return static_cast<size_t>(hash % count);
+    }
+
+    // Writes the catalog out as 'count' shard directories (dir/shard-0, ...).
+    // Each book goes to its ISBN's shard and each borrower, loans included,
+    // to its ID's shard. A loan's due date and a book's hold queue go with the
+    // book and a fine balance with the borrower. Holds are filled by the
+    // book's shard, so only patrons kept by that shard are served from them.
+    static bool split(LibraryManager& library, size_t count, const std::string& dir) {
+        std::shared_ptr<const CatalogVersion> catalog = library.snapshot();
+        std::vector<DueDates::Loan> loans = library.outstandingLoans();
+        std::vector<std::pair<std::string, int64_t>> balances = library.fineBalances();
+        std::vector<HoldQueues::HoldRecord> holdRecords = library.outstandingHolds();
+        std::vector<std::ofstream> books(count), borrowers(count), dueDates(count), fines(count), holds(count);
+        for (size_t i = 0; i < count; ++i) {
+            std::filesystem::path shardDir = std::filesystem::path(dir) / ("shard-" + std::to_string(i));
+            std::error_code ec;
+            std::filesystem::create_directories(shardDir, ec);
+            books[i].open(shardDir / "books.csv");
+            borrowers[i].open(shardDir / "borrowers.csv");
+            dueDates[i].open(shardDir / "loans.csv");
+            fines[i].open(shardDir / "fines.csv");
+            holds[i].open(shardDir / "holds.csv");
+            if (!books[i].is_open() || !borrowers[i].is_open() || !dueDates[i].is_open() || !fines[i].is_open() ||
+                !holds[i].is_open()) {
+                std::cout << "Error: Could not write shard files in " << shardDir.string() << "\n";
+                return false;
+            }
+            books[i] << "Title,Author,ISBN,Available,Category\n";
+            borrowers[i] << "ID,Name,BorrowedBooks\n";
+            dueDates[i] << "ISBN,BorrowerID,CheckedOut,Due\n";
+            fines[i] << "BorrowerID,Cents\n";
+            holds[i] << "ISBN,BorrowerID,Tier,ExpiresAt\n";
         }
-        std::cout << "\n";
+        for (size_t i = 0; i < catalog->bookCount(); ++i) {
+            const Book& book = catalog->book(i);
+            books[shardFor(book.getISBN(), count)] << book.toCSV() << "\n";
+        }
+        for (size_t i = 0; i < catalog->borrowerCount(); ++i) {
+            const Borrower& borrower = catalog->borrower(i);
+            borrowers[shardFor(borrower.getID(), count)] << borrower.toCSV() << "\n";
+        }
+        for (const auto& loan : loans) {
+            dueDates[shardFor(loan.isbn, count)] << csvEscape(loan.isbn) << "," << csvEscape(loan.borrowerId)
+                                                  << "," << loan.checkedOut << "," << loan.due << "\n";
+        }
+        for (const auto& [borrowerId, cents] : balances) {
+            fines[shardFor(borrowerId, count)] << csvEscape(borrowerId) << "," << cents << "\n";
+        }
+        for (const auto& hold : holdRecords) {
+            holds[shardFor(hold.isbn, count)] << csvEscape(hold.isbn) << "," << csvEscape(hold.borrowerId) << ","
+                                              << static_cast<int>(hold.tier) << "," << hold.expiresAt << "\n";
+        }
+        bool ok = true;
+        for (size_t i = 0; i < count; ++i) {
+            books[i].close();
+            borrowers[i].close();
+            dueDates[i].close();
+            fines[i].close();
+            holds[i].close();
+            ok = ok && books[i] && borrowers[i] && dueDates[i] && fines[i] && holds[i];
+        }
+        if (!ok) {
+            std::cout << "Error: Could not write the shard files under " << dir << "\n";
+            return false;
+        }
+        std::cout << "Split " << catalog->bookCount() << " books and " << catalog->borrowerCount()
+                  << " borrowers into " << count << " shards under " << dir << "\n";
+        return true;
+    }
 
-        // Create and populate the category graph
-        CategoryGraph graph;
-        
-        // Define category relationships and their strengths
-        const std::vector<std::tuple<std::string, std::string, int>> relationships = {
-            {"Fiction", "Fantasy", 3},
-            {"Fiction", "Mystery", 2},
-            {"Fiction", "Romance", 2},
-            {"Fantasy", "Science Fiction", 3},
-            {"Science Fiction", "Fiction", 2},
-            {"Technical", "Science Fiction", 1}
-        };
+    // Handles one request line the way RequestHandler would for the whole
+    // catalog. LIST by category, METRICS and the batch requests are not
+    // available here.
+    void handle(std::string_view line, std::string& out) {
+        std::vector<std::string_view> f = RequestHandler::fields(line);
+        std::string_view op = f[0];
+        std::string request(f[0]);
+        for (size_t i = 1; i < f.size(); ++i) {
+            request += '\t';
+            request += f[i];
+        }
+        auto owner = [this](std::string_view key) { return shardFor(key, shards.size()); };
 
-        // Add edges for defined relationships
-        for (const auto& [cat1, cat2, strength] : relationships) {
-            // Only add edge if both categories exist in our library
-            if (categoryCount.find(cat1) != categoryCount.end() && 
-                categoryCount.find(cat2) != categoryCount.end()) {
-                graph.addEdge(cat1, cat2, strength);
+        if (op == "PING") {
+            out += "OK\n";
+        } else if ((op == "BORROW" || op == "RETURN") && f.size() >= 3) {
+            size_t bookShard = owner(f[1]), borrowerShard = owner(f[2]);
+            if (bookShard == borrowerShard) {
+                appendReply(out, call(bookShard, request, false));
+            } else {
+                out += transfer(op == "BORROW", std::string(f[1]), std::string(f[2]), bookShard, borrowerShard);
+            }
+        } else if (op == "ADD" && f.size() >= 5) {
+            appendReply(out, call(owner(f[3]), request, false));
+        } else if ((op == "ADDBORROWER" || op == "LOANS") && f.size() >= 2) {
+            appendReply(out, call(owner(f[1]), request, false));
+        } else if (op == "SETCATEGORY" && f.size() >= 3) {
+            appendReply(out, call(owner(f[1]), request, false));
+        } else if (op == "ALSO" && f.size() >= 2) {
+            appendReply(out, call(owner(f[1]), request, true));
+        } else if (op == "CATEGORIES" || op == "BROWSE" || op == "TOP" || op == "OVERDUE" || op == "FINES" ||
+                   ((op == "CATEGORY" || op == "RECOMMEND" || op == "SEARCH" || op == "DUE") && f.size() >= 2) ||
+                   (op == "LIST" && f.size() >= 2 && (f[1] == "title" || f[1] == "author"))) {
+            mergeListings(f, request, out);
+        } else if (op == "STATS") {
+            std::vector<bool> sent(shards.size());
+            for (size_t i = 0; i < shards.size(); ++i) sent[i] = send(shards[i], request);
+            uint64_t totals[3] = {0, 0, 0};
+            bool complete = true;
+            for (size_t i = 0; i < shards.size(); ++i) {
+                std::vector<std::string> reply = sent[i] ? receive(shards[i], false) : std::vector<std::string>{};
+                if (reply.empty() || reply[0].compare(0, 3, "OK ") != 0) {
+                    complete = false;
+                    continue;
+                }
+                std::vector<std::string_view> counts = RequestHandler::fields(std::string_view(reply[0]).substr(3));
+                for (size_t k = 0; k < 3 && k < counts.size(); ++k) {
+                    totals[k] += RequestHandler::parseLimit(counts, k, 0);
+                }
             }
+            out += complete ? "OK " + std::to_string(totals[0]) + "\t" + std::to_string(totals[1]) + "\t" +
+                                  std::to_string(totals[2]) + "\n"
+                            : "ERR shard unavailable\n";
+        } else {
+            out += "ERR bad request\n";
         }
+    }
 
-        // Display category relationships
-        std::cout << "Category Relationships:\n";
-        std::cout << "=====================\n";
-        for (const auto& [category, edges] : graph.adjacencyList) {
-            if (!edges.empty()) {
-                std::cout << category << " is connected to:\n";
-                for (const auto& edge : edges) {
-                    std::cout << "  - " << edge.to;
-                    switch (edge.weight) {
-                        case 3:
-                            std::cout << " (Strong relationship)\n";
-                            break;
-                        case 2:
-                            std::cout << " (Moderate relationship)\n";
-                            break;
-                        case 1:
-                            std::cout << " (Weak relationship)\n";
-                            break;
-                    }
+private:
+    // Fans a listing request out to every shard and merges the replies
+    void mergeListings(const std::vector<std::string_view>& f, const std::string& request, std::string& out) {
+        std::string_view op = f[0];
+        size_t page = 0, pageSize = 0;
+        std::string sent = request;
+        if (op == "LIST") {
+            // Page p of the whole catalog lies within the first (p + 1) pages of every shard
+            page = RequestHandler::parseLimit(f, 2, 0);
+            pageSize = RequestHandler::parseLimit(f, 3, 20);
+            sent = "LIST\t" + std::string(f[1]) + "\t0\t" + std::to_string((page + 1) * pageSize);
+        } else if (op == "FINES") {
+            // A borrower's late loans can be spread over several shards, so every partial sum is needed
+            sent = "FINES\t" + std::to_string(std::numeric_limits<uint32_t>::max());
+        } else if (op == "SEARCH" || op == "RECOMMEND") {
+            // Each shard's best 'limit' with their scores, merged below by score
+            sent = std::string(op) + "\t" + std::string(f[1]) + "\t" +
+                   std::to_string(RequestHandler::parseLimit(f, 2, op == "SEARCH" ? 10 : 20)) + "\tSCORED";
+        }
+        auto replies = callAll(sent);
+        if (!replies) {
+            out += "ERR shard unavailable\n";
+            return;
+        }
+        std::vector<std::string> merged;
+
+        if (op == "CATEGORIES") {
+            std::set<std::string> names;
+            for (const auto& reply : *replies) names.insert(reply.begin(), reply.end());
+            merged.assign(names.begin(), names.end());
+        } else if (op == "BROWSE") {
+            std::map<std::string, size_t> counts;
+            for (const auto& reply : *replies) {
+                for (const auto& entry : reply) {
+                    std::vector<std::string_view> parts = RequestHandler::fields(entry);
+                    counts[std::string(parts[0])] += RequestHandler::parseLimit(parts, 1, 0);
                 }
-                std::cout << "\n";
             }
-        }
-
-        // Display book recommendations based on relationships
-        std::cout << "Sample Cross-Category Recommendations:\n";
-        std::cout << "===================================\n";
-        for (const auto& [category, edges] : graph.adjacencyList) {
-            if (!edges.empty()) {
-                std::cout << "If you like " << category << ", you might also enjoy:\n";
-                std::set<std::string> recommended;
-                
-                // Get books from related categories
-                for (const auto& edge : edges) {
-                    for (const auto& book : books) {
-                        if (book.getCategory() == edge.to && book.getAvailability()) {
-                            recommended.insert(book.getTitle() + " (" + edge.to + ")");
-                            if (recommended.size() >= 2) break;  // Limit to 2 recommendations per category
-                        }
-                    }
+            for (const auto& [path, count] : counts) merged.push_back(path + "\t" + std::to_string(count));
+        } else if (op == "TOP") {
+            std::vector<std::pair<uint64_t, std::string>> titles;  // (checkouts, line)
+            for (const auto& reply : *replies) {
+                for (const auto& entry : reply) {
+                    titles.emplace_back(RequestHandler::parseLimit(RequestHandler::fields(entry), 1, 0), entry);
+                }
+            }
+            std::sort(titles.begin(), titles.end(), [](const auto& a, const auto& b) {
+                return a.first > b.first || (a.first == b.first && a.second < b.second);
+            });
+            titles.resize(std::min(titles.size(), RequestHandler::parseLimit(f, 1, 10)));
+            for (auto& title : titles) merged.push_back(std::move(title.second));
+        } else if (op == "OVERDUE" || op == "DUE") {
+            // Loan lines are "isbn\tborrower id\tcheckout\tdue"; each shard sent its earliest
+            std::vector<std::pair<uint64_t, std::string>> loans;  // (due, line)
+            for (const auto& reply : *replies) {
+                for (const auto& entry : reply) {
+                    loans.emplace_back(RequestHandler::parseLimit(RequestHandler::fields(entry), 3, 0), entry);
+                }
+            }
+            std::sort(loans.begin(), loans.end());
+            loans.resize(std::min(loans.size(), RequestHandler::parseLimit(f, op == "OVERDUE" ? 1 : 2, 100)));
+            for (auto& loan : loans) merged.push_back(std::move(loan.second));
+        } else if (op == "FINES") {
+            std::map<std::string, std::pair<uint64_t, uint64_t>> totals;  // borrower -> (late loans, cents)
+            for (const auto& reply : *replies) {
+                for (const auto& entry : reply) {
+                    std::vector<std::string_view> parts = RequestHandler::fields(entry);
+                    auto& total = totals[std::string(parts[0])];
+                    total.first += RequestHandler::parseLimit(parts, 1, 0);
+                    total.second += RequestHandler::parseLimit(parts, 2, 0);
+                }
+            }
+            std::vector<std::pair<uint64_t, std::string>> fines;  // (cents, line)
+            for (const auto& [borrowerId, total] : totals) {
+                fines.emplace_back(total.second, borrowerId + "\t" + std::to_string(total.first) + "\t" +
+                                                     std::to_string(total.second));
+            }
+            std::sort(fines.begin(), fines.end(), [](const auto& a, const auto& b) {
+                return a.first > b.first || (a.first == b.first && a.second < b.second);
+            });
+            fines.resize(std::min(fines.size(), RequestHandler::parseLimit(f, 1, 100)));
+            for (auto& fine : fines) merged.push_back(std::move(fine.second));
+        } else if (op == "LIST") {
+            // Book lines are "isbn\ttitle\tauthor\tA|B"; sort as the shards' own views do
+            bool byTitle = f[1] == "title";
+            std::vector<std::pair<std::string, std::string>> books;  // (sort key, line)
+            for (const auto& reply : *replies) {
+                for (const auto& entry : reply) {
+                    std::vector<std::string_view> parts = RequestHandler::fields(entry);
+                    if (parts.size() < 3) continue;
+                    std::string key(byTitle ? parts[1] : parts[2]);
+                    ((key += '\0') += byTitle ? parts[2] : parts[1]) += '\0';
+                    key += parts[0];
+                    books.emplace_back(std::move(key), entry);
+                }
+            }
+            std::sort(books.begin(), books.end());
+            for (size_t i = page * pageSize; i < books.size() && i < (page + 1) * pageSize; ++i) {
+                merged.push_back(std::move(books[i].second));
+            }
+        } else if (op == "SEARCH" || op == "RECOMMEND") {
+            // Lines end in "\tscore"; best score first, ties in shard order
+            std::vector<std::pair<double, std::string>> scored;
+            for (const auto& reply : *replies) {
+                for (const auto& entry : reply) {
+                    size_t tab = entry.rfind('\t');
+                    if (tab == std::string::npos) continue;
+                    scored.emplace_back(std::strtod(entry.c_str() + tab + 1, nullptr), entry.substr(0, tab));
                 }
-                
-                for (const auto& title : recommended) {
-                    std::cout << "  - " << title << "\n";
+            }
+            std::stable_sort(scored.begin(), scored.end(),
+                             [](const auto& a, const auto& b) { return a.first > b.first; });
+            scored.resize(std::min(scored.size(), RequestHandler::parseLimit(f, 2, op == "SEARCH" ? 10 : 20)));
+            for (auto& entry : scored) merged.push_back(std::move(entry.second));
+        } else {
+            // CATEGORY: take from each shard in turn, keeping each one's order
+            size_t limit = RequestHandler::parseLimit(f, 2, 100);
+            for (size_t rank = 0; merged.size() < limit; ++rank) {
+                bool any = false;
+                for (const auto& reply : *replies) {
+                    if (rank >= reply.size() || merged.size() >= limit) continue;
+                    merged.push_back(reply[rank]);
+                    any = true;
                 }
-                std::cout << "\n";
+                if (!any) break;
             }
         }
+        appendListing(out, merged);
     }
-    
-    void recommendBooks(const std::string& category, std::set<std::string>& visited, 
-                       std::vector<std::string>& recommendations, int depth = 0) {
-        if (depth >= 3 || visited.count(category) > 0) return;  // Limit recursion depth
-        
-        visited.insert(category);
-        
-        // Add books from current category
-        for (const auto& book : books) {
-            if (book.getCategory() == category && book.getAvailability()) {
-                recommendations.push_back(book.getTitle());
+};
+
+// Single-threaded epoll event loop serving RequestHandler over a loopback TCP
+// port or a Unix socket. Every complete line in a read is handled before the
+// responses go out in one write, and the transaction log is committed once per
+// loop iteration, so pipelined clients get group commit for free.
+class LibraryServer {
+private:
+    // A client that sends faster than it reads stops being read once this
+    // much is queued, so a connection's memory stays bounded. A request line
+    // longer than the input limit is answered with an error and closes it.
+    static constexpr size_t MAX_BUFFERED_REQUESTS = 1 << 20;
+    static constexpr size_t MAX_BUFFERED_REPLIES = 4 << 20;
+
+    struct Connection {
+        std::string in;
+        std::string out;
+        uint32_t events = EPOLLIN;  // interest registered with epoll
+        bool finished = false;      // peer shut down its sending side
+    };
+
+    std::function<void(std::string_view, std::string&)> handle;
+    std::function<bool()> commit;  // runs before replies are sent; false if changes are not durable
+    std::function<void()> tick;    // housekeeping between rounds of events, at least twice a second
+    std::unordered_map<int, Connection> connections;
+    int epollFd = -1;
+    int listenFd = -1;
+
+    void closeConnection(int fd) {
+        ::epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        connections.erase(fd);
+    }
+
+    void updateInterest(int fd, Connection& conn) {
+        bool wantRead = !conn.finished && conn.in.size() < MAX_BUFFERED_REQUESTS &&
+                        conn.out.size() < MAX_BUFFERED_REPLIES;
+        uint32_t events = (wantRead ? static_cast<uint32_t>(EPOLLIN) : 0u) |
+                          (conn.out.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+        if (events == conn.events) return;
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        ::epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev);
+        conn.events = events;
+    }
+
+    // Returns false when the connection should be closed
+    bool flush(int fd, Connection& conn) {
+        while (!conn.out.empty()) {
+            ssize_t n = ::send(fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+            if (n > 0) {
+                conn.out.erase(0, static_cast<size_t>(n));
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                return false;
             }
         }
-        
-        // Recursively explore related categories
-        std::vector<std::string> relatedCategories;
-        if (category == "Fiction") {
-            relatedCategories = {"Fantasy", "Mystery", "Romance"};
-        } else if (category == "Fantasy") {
-            relatedCategories = {"Fiction", "Science Fiction"};
-        } else if (category == "Science Fiction") {
-            relatedCategories = {"Fantasy", "Fiction"};
-        } else if (category == "Technical") {
-            relatedCategories = {"Science Fiction"};
-        }
-        
-        for (const auto& relatedCategory : relatedCategories) {
-            recommendBooks(relatedCategory, visited, recommendations, depth + 1);
-        }
+        return true;
     }
-    
-    void getBookRecommendations() {
-        std::cout << "\nAvailable Categories:\n";
-        std::set<std::string> categories;
-        for (const auto& book : books) {
-            categories.insert(book.getCategory());
+
+    // Returns false when the connection should be closed. On end of file the
+    // requests already received are still answered before it is.
+    bool readRequests(int fd, Connection& conn) {
+        char buffer[64 * 1024];
+        while (conn.in.size() < MAX_BUFFERED_REQUESTS) {
+            ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                conn.in.append(buffer, static_cast<size_t>(n));
+            } else if (n == 0) {
+                conn.finished = true;
+                break;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else {
+                return false;
+            }
         }
-        
-        for (const auto& category : categories) {
-            std::cout << "- " << category << "\n";
+        return true;
+    }
+
+    // Handles complete lines until the reply limit is reached; returns how
+    // many replies were added
+    size_t handleRequests(Connection& conn) {
+        size_t start = 0, replies = 0;
+        while (conn.out.size() < MAX_BUFFERED_REPLIES) {
+            size_t nl = conn.in.find('\n', start);
+            if (nl == std::string::npos) break;
+            handle(std::string_view(conn.in).substr(start, nl - start), conn.out);
+            start = nl + 1;
+            ++replies;
         }
-        
-        std::string startCategory;
-        std::cout << "\nEnter starting category for recommendations: ";
-        std::getline(std::cin, startCategory);
-        
-        // Check if category exists
-        if (categories.find(startCategory) == categories.end()) {
-            std::cout << "Category not found!\n";
-            return;
+        conn.in.erase(0, start);
+        if (conn.in.size() >= MAX_BUFFERED_REQUESTS && conn.in.find('\n') == std::string::npos) {
+            conn.out += "ERR request too long\n";
+            conn.in.clear();
+            conn.finished = true;
+            ++replies;
         }
-        
-        std::set<std::string> visited;
-        std::vector<std::string> recommendations;
-        recommendBooks(startCategory, visited, recommendations);
-        
-        std::cout << "\nRecommended Books (based on category '" << startCategory << "'):\n";
-        std::cout << "=================================================\n";
-        if (recommendations.empty()) {
-            std::cout << "No recommendations found.\n";
-        } else {
-            for (size_t i = 0; i < recommendations.size(); ++i) {
-                std::cout << (i + 1) << ". " << recommendations[i] << "\n";
+        return replies;
+    }
+
+    // Answers what has been read, resuming buffered requests as replies drain.
+    // Returns false when the connection should be closed.
+    bool serve(int fd, Connection& conn) {
+        while (true) {
+            size_t answered = conn.out.size();
+            size_t replies = handleRequests(conn);
+            if (!commit()) {
+                // The replies promise durability, so none of them can go out;
+                // which of the requests changed anything is not known here
+                conn.out.resize(answered);
+                for (size_t i = 0; i < replies; ++i) conn.out += "ERR log write failed\n";
             }
+            if (!flush(fd, conn)) return false;
+            if (!conn.out.empty() || conn.in.find('\n') == std::string::npos) break;
         }
+        if (conn.finished && conn.out.empty()) return false;
+        updateInterest(fd, conn);
+        return true;
     }
 
-private:
-    void loadBooks() {
-        std::ifstream file(BOOKS_FILE);
-        if (!file.is_open()) {
-            std::cout << "Warning: Could not open " << BOOKS_FILE << ". Starting with empty book list.\n";
-            return;
+public:
+    explicit LibraryServer(LibraryManager& lib)
+        : handle([handler = RequestHandler(lib)](std::string_view line, std::string& out) mutable {
+              handler.handle(line, out);
+          }),
+          commit([&lib] { return lib.commitLog(); }),
+          tick([] {}) {}
+
+    // Front end for a sharded catalog; the shards make their own replies durable
+    explicit LibraryServer(ShardRouter& router)
+        : handle([&router](std::string_view line, std::string& out) { router.handle(line, out); }),
+          commit([] { return true; }),
+          tick([&router] { router.resolvePending(); }) {}
+
+    ~LibraryServer() {
+        for (auto& entry : connections) ::close(entry.first);
+        if (listenFd >= 0) ::close(listenFd);
+        if (epollFd >= 0) ::close(epollFd);
+    }
+
+    // Serves until SIGINT/SIGTERM; returns false if the address cannot be bound
+    bool run(const std::string& address) {
+        listenFd = net::listenOn(address);
+        if (listenFd < 0) {
+            std::cout << "Error: Could not listen on " << address << "\n";
+            return false;
         }
+        net::setNonBlocking(listenFd);
+        epollFd = ::epoll_create1(0);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = listenFd;
+        ::epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
 
-        std::string line;
-        // Skip header line
-        std::getline(file, line);
-        
-        while (std::getline(file, line)) {
-            size_t pos = 0;
-            std::vector<std::string> tokens;
-            std::string token;
-            
-            // Split the line by commas, handling potential commas in the title/author
-            while ((pos = line.find(",")) != std::string::npos) {
-                token = line.substr(0, pos);
-                tokens.push_back(token);
-                line.erase(0, pos + 1);
-            }
-            tokens.push_back(line);  // Add the last token
+        std::signal(SIGINT, net::onSignal);
+        std::signal(SIGTERM, net::onSignal);
+        std::cout << "Serving library on " << address << " (Ctrl+C to stop)\n";
 
-            if (tokens.size() >= 5) {
-                Book book(tokens[0], tokens[1], tokens[2], tokens[4]);
-                book.setAvailability(tokens[3] == "1");
-                books.push_back(book);
+        std::vector<epoll_event> events(256);
+        while (!net::stopRequested) {
+            int ready = ::epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), 500);
+            for (int i = 0; i < ready; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd) {
+                    int client;
+                    while ((client = ::accept(listenFd, nullptr, nullptr)) >= 0) {
+                        net::setNonBlocking(client);
+                        int one = 1;
+                        ::setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                        epoll_event cev{};
+                        cev.events = EPOLLIN;
+                        cev.data.fd = client;
+                        ::epoll_ctl(epollFd, EPOLL_CTL_ADD, client, &cev);
+                        connections[client];
+                    }
+                    continue;
+                }
+                auto it = connections.find(fd);
+                if (it == connections.end()) continue;
+                bool keep = true;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    keep = readRequests(fd, it->second);
+                }
+                if (keep) keep = serve(fd, it->second);
+                if (!keep) closeConnection(fd);
             }
+            tick();
         }
-        file.close();
-        std::cout << "Loaded " << books.size() << " books from " << BOOKS_FILE << "\n";
+        std::cout << "\nShutting down server...\n";
+        if (net::isUnixAddress(address)) ::unlink(address.c_str());
+        return true;
     }
+};
 
-    void loadBorrowers() {
-        std::ifstream file(BORROWERS_FILE);
-        if (!file.is_open()) {
-            std::cout << "Warning: Could not open " << BORROWERS_FILE << ". Starting with empty borrower list.\n";
-            return;
+// Loopback load generator: each connection registers its own borrower, then
+// repeatedly sends pipelined batches of BORROW/RETURN/CATEGORY/SEARCH requests
+// and measures the time from sending a batch to each response arriving.
+inline int runLoadGenerator(const std::string& address, size_t connections, size_t requests,
+                            size_t pipeline) {
+    using Clock = std::chrono::steady_clock;
+
+    // Discover ISBNs and categories through the protocol itself
+    int probe = net::connectTo(address);
+    if (probe < 0) {
+        std::cout << "Error: Could not connect to " << address << "\n";
+        return 1;
+    }
+    auto request = [](int fd, const std::string& line) {
+        std::string reply;
+        net::writeAll(fd, line + "\n");
+        char c;
+        size_t lines = 0, expected = 1;
+        while (lines < expected && ::recv(fd, &c, 1, 0) == 1) {
+            reply += c;
+            if (c != '\n') continue;
+            if (++lines == 1 && reply.compare(0, 3, "OK ") == 0) expected += std::stoul(reply.substr(3));
+        }
+        return reply;
+    };
+    std::vector<std::string> categories, isbns;
+    {
+        std::string reply = request(probe, "CATEGORIES");
+        size_t pos = reply.find('\n') + 1;
+        while (pos < reply.size()) {
+            size_t nl = reply.find('\n', pos);
+            categories.push_back(reply.substr(pos, nl - pos));
+            pos = nl + 1;
+        }
+        for (const auto& category : categories) {
+            std::string books = request(probe, "CATEGORY\t" + category + "\t1000");
+            size_t p = books.find('\n') + 1;
+            while (p < books.size()) {
+                size_t nl = books.find('\n', p);
+                isbns.push_back(books.substr(p, books.find('\t', p) - p));
+                p = nl + 1;
+            }
         }
+    }
+    ::close(probe);
+    if (isbns.empty()) {
+        std::cout << "Error: the server has no books to exercise\n";
+        return 1;
+    }
 
-        std::string line;
-        // Skip header line
-        std::getline(file, line);
-        
-        while (std::getline(file, line)) {
-            size_t pos = 0;
-            std::vector<std::string> tokens;
-            
-            // Split by comma
-            while ((pos = line.find(",")) != std::string::npos) {
-                tokens.push_back(line.substr(0, pos));
-                line.erase(0, pos + 1);
-            }
-            tokens.push_back(line);
-
-            if (tokens.size() >= 2) {
-                Borrower borrower(tokens[0], tokens[1]);
-                // If there are borrowed books (tokens[2]), parse them
-                if (tokens.size() > 2 && !tokens[2].empty()) {
-                    std::string books = tokens[2];
-                    size_t pos = 0;
-                    while ((pos = books.find(";")) != std::string::npos) {
-                        std::string isbn = books.substr(0, pos);
-                        if (!isbn.empty()) {
-                            borrower.borrowBook(isbn);
-                        }
-                        books.erase(0, pos + 1);
+    std::vector<std::vector<double>> latencies(connections);
+    std::vector<std::thread> workers;
+    auto start = Clock::now();
+    for (size_t c = 0; c < connections; ++c) {
+        workers.emplace_back([&, c] {
+            int fd = net::connectTo(address);
+            if (fd < 0) return;
+            std::string borrower = "LOADGEN-" + std::to_string(c);
+            request(fd, "ADDBORROWER\t" + borrower + "\tLoad Generator");
+            uint64_t seed = 0x9E3779B97F4A7C15ull * (c + 1);
+            auto next = [&seed] { seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17; return seed; };
+
+            std::string batch, in;
+            char buffer[64 * 1024];
+            for (size_t sent = 0; sent < requests; sent += pipeline) {
+                size_t count = std::min(pipeline, requests - sent);
+                batch.clear();
+                for (size_t k = 0; k < count; ++k) {
+                    uint64_t r = next();
+                    const std::string& isbn = isbns[r % isbns.size()];
+                    switch ((r >> 32) % 4) {
+                        case 0: batch += "BORROW\t" + isbn + "\t" + borrower + "\n"; break;
+                        case 1: batch += "RETURN\t" + isbn + "\t" + borrower + "\n"; break;
+                        case 2: batch += "CATEGORY\t" + categories[(r >> 40) % categories.size()] + "\t5\n"; break;
+                        default: batch += "SEARCH\tthe\t5\n"; break;
                     }
-                    if (!books.empty()) {
-                        borrower.borrowBook(books);
+                }
+                auto sentAt = Clock::now();
+                if (!net::writeAll(fd, batch)) break;
+
+                // Each response is "OK", "ERR ..." or "OK <n>" followed by n lines
+                size_t answered = 0, pendingLines = 0;
+                in.clear();
+                size_t pos = 0;
+                while (answered < count) {
+                    ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+                    if (n <= 0) { answered = count; break; }
+                    in.append(buffer, static_cast<size_t>(n));
+                    size_t nl;
+                    while (answered < count && (nl = in.find('\n', pos)) != std::string::npos) {
+                        if (pendingLines > 0) {
+                            --pendingLines;
+                        } else if (in.compare(pos, 3, "OK ") == 0) {
+                            pendingLines = std::stoul(in.substr(pos + 3, nl - pos - 3));
+                        }
+                        pos = nl + 1;
+                        if (pendingLines == 0) {
+                            ++answered;
+                            latencies[c].push_back(
+                                std::chrono::duration<double, std::micro>(Clock::now() - sentAt).count());
+                        }
                     }
                 }
-                borrowers.push_back(borrower);
             }
-        }
-        file.close();
-        std::cout << "Loaded " << borrowers.size() << " borrowers from " << BORROWERS_FILE << "\n";
+            ::close(fd);
+        });
     }
+    for (auto& worker : workers) worker.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
 
-    void saveBooks() {
-        std::ofstream file(BOOKS_FILE);
-        if (!file.is_open()) {
-            std::cout << "Error: Could not save books to " << BOOKS_FILE << "\n";
-            return;
-        }
+    std::vector<double> all;
+    for (const auto& l : latencies) all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    auto percentile = [&all](double p) {
+        return all.empty() ? 0.0 : all[std::min(all.size() - 1, static_cast<size_t>(p * all.size()))];
+    };
+    std::cout << "Requests:   " << all.size() << " over " << connections << " connections, pipeline "
+              << pipeline << "\n"
+              << "Throughput: " << static_cast<uint64_t>(all.size() / seconds) << " req/s\n"
+              << "Latency:    p50 " << percentile(0.50) << " us, p99 " << percentile(0.99)
+              << " us, max " << (all.empty() ? 0.0 : all.back()) << " us\n";
+    return 0;
+}
+#endif // LIBRARY_HAVE_EPOLL
 
-        // Write header
-        file << "Title,Author,ISBN,Available,Category\n";
-        
-        // Write book data
-        for (const auto& book : books) {
-            file << book.toCSV() << "\n";
-        }
-        file.close();
-        std::cout << "Saved " << books.size() << " books to " << BOOKS_FILE << "\n";
+// Synthetic catalogs and micro-benchmarks (--generate, --bench). Generation is
+// deterministic for a given seed and size, so runs on different commits see
+// identical data. Results print as a table and can be written as Google
+// Benchmark-compatible JSON, so existing comparison tooling works on them.
+namespace bench {
+
+inline uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+class Rng {
+private:
+    uint64_t state;
+
+public:
+    explicit Rng(uint64_t seed) : state(seed) {}
+    uint64_t next() { return state = mix(state); }
+    double unit() { return static_cast<double>(next() >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+// Draws 0..n-1 with probability proportional to 1 / (k + 1)^s
+class Zipf {
+private:
+    std::vector<double> cdf;
+
+public:
+    Zipf(size_t n, double s) : cdf(n) {
+        double sum = 0;
+        for (size_t k = 0; k < n; ++k) cdf[k] = sum += 1.0 / std::pow(static_cast<double>(k + 1), s);
+        for (double& c : cdf) c /= sum;
+    }
+    size_t draw(Rng& rng) const {
+        return std::min(cdf.size() - 1,
+                        static_cast<size_t>(std::lower_bound(cdf.begin(), cdf.end(), rng.unit()) - cdf.begin()));
     }
+};
 
-    void saveBorrowers() {
-        std::ofstream file(BORROWERS_FILE);
-        if (!file.is_open()) {
-            std::cout << "Error: Could not save borrowers to " << BORROWERS_FILE << "\n";
-            return;
-        }
+const std::vector<std::string> CATEGORIES = {
+    "Fiction", "Fiction/Mystery", "Fantasy", "Romance", "Science Fiction", "Fiction/Thriller",
+    "Technical", "History", "Biography", "Children", "Technical/Programming", "Self-Help",
+    "Poetry", "Travel", "Cooking", "Art", "Philosophy", "Science", "Religion", "Reference"};
+const std::vector<std::string> TITLE_WORDS = {
+    "The", "of", "Night", "House", "Love", "Secret", "Last", "World", "Time", "Dark", "Life", "Girl",
+    "Man", "War", "City", "Story", "Book", "Shadow", "Heart", "King", "Road", "Sea", "Fire", "Garden",
+    "Blood", "Queen", "River", "Stars", "Winter", "Summer", "Lost", "Game", "Silent", "Golden", "Wild",
+    "Stone", "Mountain", "Light", "Truth", "Dream", "Empire", "Island", "Journey", "Storm", "Iron",
+    "Glass", "Moon", "Forest", "Code", "Data", "Design", "Patterns", "Practical", "Modern", "Art",
+    "Science", "History", "Guide", "Introduction", "Systems", "Mind", "Kingdom", "Promise", "Memory"};
+const std::vector<std::string> FIRST_NAMES = {
+    "James", "Mary", "John", "Patricia", "Robert", "Jennifer", "Michael", "Linda", "David", "Elizabeth",
+    "William", "Susan", "Richard", "Jessica", "Joseph", "Sarah", "Thomas", "Karen", "Humayun", "Anita",
+    "Haruki", "Chinua", "Gabriel", "Isabel", "Leo", "Virginia", "Fyodor", "Toni", "Jorge", "Zadie"};
+const std::vector<std::string> LAST_NAMES = {
+    "Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller", "Davis", "Rodriguez", "Martinez",
+    "Hernandez", "Lopez", "Wilson", "Anderson", "Thomas", "Taylor", "Moore", "Jackson", "Martin", "Lee",
+    "Ahmed", "Murakami", "Achebe", "Marquez", "Allende", "Tolstoy", "Woolf", "Morrison", "Borges", "Smith-Jones",
+    "Khan", "Nguyen", "Kim", "Singh", "Rossi", "Muller", "Dubois", "Silva", "Kowalski", "Novak"};
 
-        // Write header
-        file << "ID,Name,BorrowedBooks\n";
-        
-        // Write borrower data
-        for (const auto& borrower : borrowers) {
-            file << borrower.toCSV() << "\n";
+constexpr double LOAN_RATE = 0.1;  // share of books checked out in a generated catalog
+
+// Unique for i < 10^10: the multiplier is coprime to 10^10
+inline std::string isbnFor(uint64_t i) {
+    char buffer[24];
+    std::snprintf(buffer, sizeof(buffer), "978-%010llu",
+                  static_cast<unsigned long long>((i * 2654435761ull) % 10000000000ull));
+    return buffer;
+}
+
+inline std::string borrowerIdFor(uint64_t j) {
+    char buffer[24];
+    std::snprintf(buffer, sizeof(buffer), "P%08llu", static_cast<unsigned long long>(j));
+    return buffer;
+}
+
+inline bool onLoan(uint64_t seed, uint64_t i, uint64_t borrowerCount) {
+    return borrowerCount > 0 && Rng(mix(seed ^ (i * 0xD1B54A32D192ED03ull))).unit() < LOAN_RATE;
+}
+
+// Writes books.csv and borrowers.csv into 'dir'. Titles, authors and categories
+// are Zipf-distributed; about LOAN_RATE of the books are on loan, each to a
+// random borrower, and the two files agree on who has what.
+inline bool generate(const std::string& dir, uint64_t bookCount, uint64_t borrowerCount, uint64_t seed) {
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    const std::string booksPath = (std::filesystem::path(dir) / "books.csv").string();
+    const std::string borrowersPath = (std::filesystem::path(dir) / "borrowers.csv").string();
+    std::FILE* out = std::fopen(booksPath.c_str(), "wb");
+    if (!out) {
+        std::cout << "Error: Could not write " << booksPath << "\n";
+        return false;
+    }
+
+    const Zipf category(CATEGORIES.size(), 1.0), word(TITLE_WORDS.size(), 1.1);
+    const Zipf first(FIRST_NAMES.size(), 0.8), last(LAST_NAMES.size(), 0.8);
+    std::vector<std::pair<uint32_t, uint64_t>> loans;  // (borrower, book)
+    std::string buffer = "Title,Author,ISBN,Available,Category\n";
+    bool ok = true;
+    for (uint64_t i = 0; i < bookCount; ++i) {
+        Rng rng(mix(seed + i));
+        size_t words = 1 + rng.next() % 4;
+        for (size_t w = 0; w < words; ++w) {
+            if (w > 0) buffer += ' ';
+            buffer += TITLE_WORDS[word.draw(rng)];
+        }
+        if (rng.unit() < 0.2) {
+            buffer += " Volume ";
+            buffer += std::to_string(1 + rng.next() % 9);
+        }
+        buffer += ',';
+        buffer += FIRST_NAMES[first.draw(rng)];
+        buffer += ' ';
+        buffer += LAST_NAMES[last.draw(rng)];
+        buffer += ',';
+        buffer += isbnFor(i);
+        bool loaned = onLoan(seed, i, borrowerCount);
+        buffer += loaned ? ",0," : ",1,";
+        buffer += CATEGORIES[category.draw(rng)];
+        buffer += '\n';
+        if (loaned) loans.emplace_back(static_cast<uint32_t>(rng.next() % borrowerCount), i);
+        if (buffer.size() >= 1 << 20) {
+            ok = std::fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size() && ok;
+            buffer.clear();
         }
-        file.close();
-        std::cout << "Saved " << borrowers.size() << " borrowers to " << BORROWERS_FILE << "\n";
     }
+    ok = std::fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size() && ok;
+    ok = std::fclose(out) == 0 && ok;
 
-    void updateCategoryGraph(const Book& book) {
-        categoryGraph[book.getCategory()].push_back(book.getISBN());
+    out = std::fopen(borrowersPath.c_str(), "wb");
+    if (!out) {
+        std::cout << "Error: Could not write " << borrowersPath << "\n";
+        return false;
+    }
+    std::sort(loans.begin(), loans.end());
+    buffer = "ID,Name,BorrowedBooks\n";
+    auto loan = loans.begin();
+    for (uint64_t j = 0; j < borrowerCount; ++j) {
+        Rng rng(mix(seed ^ (j + 0x5EED)));
+        buffer += borrowerIdFor(j);
+        buffer += ',';
+        buffer += FIRST_NAMES[first.draw(rng)];
+        buffer += ' ';
+        buffer += LAST_NAMES[last.draw(rng)];
+        buffer += ',';
+        for (bool firstLoan = true; loan != loans.end() && loan->first == j; ++loan, firstLoan = false) {
+            if (!firstLoan) buffer += ';';
+            buffer += isbnFor(loan->second);
+        }
+        buffer += '\n';
+        if (buffer.size() >= 1 << 20) {
+            ok = std::fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size() && ok;
+            buffer.clear();
+        }
     }
+    ok = std::fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size() && ok;
+    ok = std::fclose(out) == 0 && ok;
+    if (!ok) std::cout << "Error: Could not write the generated catalog to " << dir << "\n";
+    return ok;
+}
+
+struct Result {
+    std::string name;
+    uint64_t iterations;
+    double realNs;  // per iteration
+    double cpuNs;
+    double itemsPerSecond;
 };
 
+// Swallows std::cout while the library prints progress and reports; the
+// results table goes straight to stdout instead
+class Quiet {
+private:
+    struct NullBuffer : std::streambuf {
+        int overflow(int c) override { return c; }
+    } sink;
+    std::streambuf* saved;
+
+public:
+    Quiet() : saved(std::cout.rdbuf(&sink)) {}
+    Quiet(const Quiet&) = delete;
+    Quiet& operator=(const Quiet&) = delete;
+    ~Quiet() { std::cout.rdbuf(saved); }
+};
+
+// Runs fn() in doubling batches until minSeconds have passed (at least once)
+template <typename Fn>
+Result measure(const std::string& name, double itemsPerIteration, Fn&& fn, double minSeconds = 0.5) {
+    using Clock = std::chrono::steady_clock;
+    uint64_t iterations = 0, batch = 1;
+    double elapsed = 0, cpu = 0;
+    while (elapsed < minSeconds) {
+        std::clock_t cpuStart = std::clock();
+        auto start = Clock::now();
+        for (uint64_t i = 0; i < batch; ++i) fn();
+        elapsed += std::chrono::duration<double>(Clock::now() - start).count();
+        cpu += static_cast<double>(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+        iterations += batch;
+        batch *= 2;
+    }
+    Result result{name, iterations, elapsed * 1e9 / iterations, cpu * 1e9 / iterations,
+                  itemsPerIteration * iterations / elapsed};
+    std::printf("%-32s %14.0f ns %14.0f ns %12llu %14.0f items/s\n", name.c_str(), result.realNs,
+                result.cpuNs, static_cast<unsigned long long>(iterations), result.itemsPerSecond);
+    std::fflush(stdout);
+    return result;
+}
+
+inline bool writeJson(const std::string& path, const std::vector<Result>& results) {
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        std::cout << "Error: Could not write benchmark results to " << path << "\n";
+        return false;
+    }
+    file.precision(15);
+    std::time_t now = std::time(nullptr);
+    char date[32];
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+    file << "{\n  \"context\": {\n    \"date\": \"" << date << "\",\n    \"num_cpus\": "
+         << std::thread::hardware_concurrency() << ",\n    \"library_build_type\": \""
+#ifdef NDEBUG
+         << "release"
+#else
+         << "debug"
+#endif
+         << "\"\n  },\n  \"benchmarks\": [\n";
+    // Benchmark names are plain ASCII without quotes, so they need no escaping
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        file << "    {\n      \"name\": \"" << r.name << "\",\n      \"run_name\": \"" << r.name
+             << "\",\n      \"run_type\": \"iteration\",\n      \"iterations\": " << r.iterations
+             << ",\n      \"real_time\": " << r.realNs << ",\n      \"cpu_time\": " << r.cpuNs
+             << ",\n      \"time_unit\": \"ns\",\n      \"items_per_second\": " << r.itemsPerSecond
+             << "\n    }" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    file << "  ]\n}\n";
+    return file.good();
+}
+
+// Generates a catalog of each size under dir/<size> and benchmarks the main
+// operations on it. Returns the process exit code.
+inline int run(const std::string& dir, const std::vector<uint64_t>& sizes, uint64_t seed,
+               const std::string& jsonPath) {
+    const std::filesystem::path home = std::filesystem::current_path();
+    const std::string resultsPath = jsonPath.empty() ? "" : std::filesystem::absolute(jsonPath).string();
+    std::vector<Result> results;
+    std::printf("%-32s %17s %17s %12s %22s\n%s\n", "Benchmark", "Time", "CPU", "Iterations", "Throughput",
+                std::string(104, '-').c_str());
+
+    for (uint64_t size : sizes) {
+        const uint64_t borrowerCount = std::max<uint64_t>(10, size / 10);
+        const std::string suffix = "/" + std::to_string(size);
+        const std::filesystem::path where = std::filesystem::absolute(std::filesystem::path(dir) / suffix.substr(1));
+        std::error_code ec;
+        std::filesystem::remove_all(where, ec);
+        if (!generate(where.string(), size, borrowerCount, seed)) return 1;
+        std::filesystem::current_path(where);
+
+        // Checkouts that always succeed: available books, borrowed and returned by one patron
+        std::vector<std::pair<std::string, std::string>> loans;
+        for (uint64_t i = 0; i < size && loans.size() < 1024; i += 1 + size / 1024) {
+            if (!onLoan(seed, i, borrowerCount)) loans.emplace_back(isbnFor(i), borrowerIdFor(i % borrowerCount));
+        }
+#ifdef _WIN32
+        std::FILE* sink = std::fopen("NUL", "wb");
+#else
+        std::FILE* sink = std::fopen("/dev/null", "wb");
+#endif
+        const double items = static_cast<double>(size);
+        size_t step = 0;
+        {
+            Quiet quiet;
+            results.push_back(measure("BM_LoadCSV" + suffix, items, [] {
+                LibraryManager library(0, DataSource::CSV);
+            }));
+            LibraryManager library(0, DataSource::CSV);
+            results.push_back(measure("BM_SaveData" + suffix, items, [&] { library.saveData(); }));
+            results.push_back(measure("BM_LoadSnapshot" + suffix, items, [] {
+                LibraryManager snapshotLibrary(0, DataSource::Snapshot);
+            }));
+            results.push_back(measure("BM_BorrowReturn" + suffix, 2, [&] {
+                const auto& loan = loans[step++ % loans.size()];
+                library.borrowBook(loan.first, loan.second);
+                library.returnBook(loan.first, loan.second);
+            }));
+            results.push_back(measure("BM_BooksInCategory" + suffix, 1, [&] {
+                library.booksInCategory(CATEGORIES[step++ % CATEGORIES.size()], 50);
+            }));
+            if (sink) results.push_back(measure("BM_ListByTitle" + suffix, items, [&] {
+                ReportWriter out(sink);
+                library.writeBooks(out, BookOrder::Title);
+            }));
+            results.push_back(measure("BM_PageByTitle" + suffix, 1, [&] {
+                library.booksPage(BookOrder::Title, mix(step++) % (size / 50 + 1), 50);
+            }));
+            results.push_back(measure("BM_Search" + suffix, 1, [&] {
+                library.searchBooks(TITLE_WORDS[step++ % TITLE_WORDS.size()], 10);
+            }));
+            results.push_back(measure("BM_Recommend" + suffix, 1, [&] {
+                library.recommendBooks(CATEGORIES[step++ % CATEGORIES.size()], 20);
+            }));
+            results.push_back(measure("BM_AnalyzeCategories" + suffix, 1, [&] { library.analyzeCategories(); }));
+            library.commitLog();
+        }
+        if (sink) std::fclose(sink);
+        std::filesystem::current_path(home);
+    }
+    return resultsPath.empty() || writeJson(resultsPath, results) ? 0 : 1;
+}
+
+} // namespace bench
+
 // Helper functions for user input
 void displayMenu() {
     std::cout << "\nLibrary Management System\n";
@@ -624,13 +7313,18 @@ void displayMenu() {
     std::cout << "3. Borrow Book\n";
     std::cout << "4. Return Book\n";
     std::cout << "5. Display Books\n";
-    std::cout << "6. Sort Books by Title\n";
-    std::cout << "7. Sort Books by Author\n";
+    std::cout << "6. List Books by Title\n";
+    std::cout << "7. List Books by Author\n";
     std::cout << "8. Display Books by Category\n";
     std::cout << "9. Search Books by Category\n";
     std::cout << "10. Show Category Analytics\n";
     std::cout << "11. Get Book Recommendations\n";
     std::cout << "12. Exit\n";
+    std::cout << "13. Search Books by Title/Author\n";
+    std::cout << "14. Place Hold\n";
+    std::cout << "15. Transaction History\n";
+    std::cout << "16. Undo Recent Transactions\n";
+    std::cout << "17. Overdue Loans and Fines\n";
     std::cout << "Enter your choice: ";
 }
 
@@ -664,14 +7358,263 @@ Borrower inputBorrowerDetails() {
     return Borrower(id, name);
 }
 
+// Parses a whole command-line value as a non-negative integer. Unlike stoul it
+// rejects "-1" (which stoul wraps), trailing junk such as "8x", and overflow.
+template <typename T>
+bool parseCount(std::string_view text, T& value) {
+    T parsed{};
+    const char* end = text.data() + text.size();
+    auto result = std::from_chars(text.data(), end, parsed);
+    if (text.empty() || result.ec != std::errc() || result.ptr != end) return false;
+    value = parsed;
+    return true;
+}
+
 // Main function
-int main() {
-    LibraryManager library;
+int main(int argc, char* argv[]) {
+    // --threads N caps the number of parser threads used at startup (0 = all cores)
+    // --import-csv rebuilds library.snap from the CSV files and exits
+    // --export-csv rewrites the CSV files from library.snap and exits
+    // --serve ADDR serves the request protocol on a loopback port or Unix socket path
+    // --loadgen ADDR [--connections C] [--requests N] [--pipeline D] benchmarks a running server
+    // --add-books FILE adds the books in a books.csv-style feed, saves and exits
+    // --report text|csv|jsonl [--order title|author|category] [--offset N] [--limit N]
+    //          [--output FILE] lists the catalog and exits
+    // --generate DIR [--books N] [--borrowers M] [--seed S] writes a synthetic catalog and exits
+    // --bench DIR [--sizes N,N,...] [--seed S] [--output FILE] benchmarks generated catalogs
+    //          (JSON results go to FILE) and exits
+    // --metrics FILE writes operation metrics on exit (JSON for *.json, else Prometheus text)
+    // --dir DIR uses the data files in DIR (e.g. one shard of a split catalog)
+    // --split N --output DIR writes the catalog as N shard directories and exits
+    // --route ADDR --shards ADDR,ADDR,... serves one catalog spread over running shard servers
+    unsigned loadThreads = 0;
+    bool importCSV = false, exportCSV = false;
+    std::string serveAddress, loadgenAddress;
+    size_t connections = 4, requests = 100000, pipeline = 32;
+    std::string reportFormat, reportOrder = "title", reportOutput, feedPath;
+    size_t reportOffset = 0, reportLimit = 0;
+    std::string generateDir, benchDir, benchSizes = "1000,10000,100000";
+    uint64_t generateBooks = 10000, generateBorrowers = 1000, seed = 42;
+    std::string dataDir, routeAddress, shardList;
+    size_t splitCount = 0;
+    // Written by the destructor, so every way out of main below produces the dump
+    struct MetricsDump {
+        std::string path;
+        ~MetricsDump() {
+            if (path.empty()) return;
+#ifdef LIBRARY_HAVE_METRICS
+            bool asJson = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+            std::ofstream file(path);
+            file << (asJson ? metrics::json() : metrics::prometheus());
+            if (!file) std::cout << "Error: Could not write metrics to " << path << "\n";
+#else
+            std::cout << "Warning: Metrics were compiled out; " << path << " not written\n";
+#endif
+        }
+    } metricsDump;
+    bool badArgument = false;
+    auto count = [&badArgument](const std::string& flag, std::string_view text, auto& value, uint64_t minimum = 0) {
+        if (!parseCount(text, value) || value < minimum) {
+            std::cout << "Error: " << flag << " expects a whole number"
+                      << (minimum > 0 ? " of at least " + std::to_string(minimum) : std::string())
+                      << ", got '" << text << "'\n";
+            badArgument = true;
+        }
+    };
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            count(arg, argv[++i], loadThreads);
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            count("--threads", std::string_view(arg).substr(10), loadThreads);
+        } else if (arg == "--import-csv") {
+            importCSV = true;
+        } else if (arg == "--export-csv") {
+            exportCSV = true;
+        } else if (arg == "--serve" && i + 1 < argc) {
+            serveAddress = argv[++i];
+        } else if (arg == "--loadgen" && i + 1 < argc) {
+            loadgenAddress = argv[++i];
+        } else if (arg == "--connections" && i + 1 < argc) {
+            count(arg, argv[++i], connections, 1);
+        } else if (arg == "--requests" && i + 1 < argc) {
+            count(arg, argv[++i], requests);
+        } else if (arg == "--pipeline" && i + 1 < argc) {
+            count(arg, argv[++i], pipeline, 1);
+        } else if (arg == "--add-books" && i + 1 < argc) {
+            feedPath = argv[++i];
+        } else if (arg == "--report" && i + 1 < argc) {
+            reportFormat = argv[++i];
+        } else if (arg == "--order" && i + 1 < argc) {
+            reportOrder = argv[++i];
+        } else if (arg == "--offset" && i + 1 < argc) {
+            count(arg, argv[++i], reportOffset);
+        } else if (arg == "--limit" && i + 1 < argc) {
+            count(arg, argv[++i], reportLimit);
+        } else if (arg == "--output" && i + 1 < argc) {
+            reportOutput = argv[++i];
+        } else if (arg == "--generate" && i + 1 < argc) {
+            generateDir = argv[++i];
+        } else if (arg == "--books" && i + 1 < argc) {
+            count(arg, argv[++i], generateBooks);
+        } else if (arg == "--borrowers" && i + 1 < argc) {
+            count(arg, argv[++i], generateBorrowers);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            count(arg, argv[++i], seed);
+        } else if (arg == "--bench" && i + 1 < argc) {
+            benchDir = argv[++i];
+        } else if (arg == "--sizes" && i + 1 < argc) {
+            benchSizes = argv[++i];
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            metricsDump.path = argv[++i];
+        } else if (arg == "--dir" && i + 1 < argc) {
+            dataDir = argv[++i];
+        } else if (arg == "--split" && i + 1 < argc) {
+            count(arg, argv[++i], splitCount, 1);
+        } else if (arg == "--route" && i + 1 < argc) {
+            routeAddress = argv[++i];
+        } else if (arg == "--shards" && i + 1 < argc) {
+            shardList = argv[++i];
+        }
+    }
+    std::vector<uint64_t> sizes;
+    if (!benchDir.empty()) {
+        for (size_t start = 0; start < benchSizes.size();) {
+            size_t end = std::min(benchSizes.find(',', start), benchSizes.size());
+            if (end > start) {
+                sizes.emplace_back();
+                count("--sizes", std::string_view(benchSizes).substr(start, end - start), sizes.back(), 1);
+            }
+            start = end + 1;
+        }
+    }
+    if (badArgument) return 1;
+
+    if (!dataDir.empty()) {
+        std::error_code ec;
+        std::filesystem::current_path(dataDir, ec);
+        if (ec) {
+            std::cout << "Error: Could not open data directory " << dataDir << "\n";
+            return 1;
+        }
+    }
+
+    if (!generateDir.empty()) {
+        if (!bench::generate(generateDir, generateBooks, generateBorrowers, seed)) return 1;
+        std::cout << "Generated " << generateBooks << " books and " << generateBorrowers
+                  << " borrowers in " << generateDir << "\n";
+        return 0;
+    }
+
+    if (!benchDir.empty()) {
+        return bench::run(benchDir, sizes, seed, reportOutput);
+    }
+
+    if (!serveAddress.empty() || !loadgenAddress.empty() || !routeAddress.empty() || splitCount > 0) {
+#ifdef LIBRARY_HAVE_EPOLL
+        if (!loadgenAddress.empty()) {
+            return runLoadGenerator(loadgenAddress, connections, requests, pipeline);
+        }
+        if (splitCount > 0) {
+            if (reportOutput.empty()) {
+                std::cout << "Error: --split needs --output DIR\n";
+                return 1;
+            }
+            LibraryManager library(loadThreads);
+            return ShardRouter::split(library, splitCount, reportOutput) ? 0 : 1;
+        }
+        if (!routeAddress.empty()) {
+            std::vector<std::string> shards;
+            for (size_t start = 0; start < shardList.size();) {
+                size_t end = std::min(shardList.find(',', start), shardList.size());
+                if (end > start) shards.push_back(shardList.substr(start, end - start));
+                start = end + 1;
+            }
+            if (shards.empty()) {
+                std::cout << "Error: --route needs --shards ADDR,ADDR,...\n";
+                return 1;
+            }
+            ShardRouter router(shards);
+            LibraryServer server(router);
+            return server.run(routeAddress) ? 0 : 1;
+        }
+        LibraryManager library(loadThreads);
+        LibraryServer server(library);
+        if (!server.run(serveAddress)) return 1;
+        library.saveData();
+        return 0;
+#else
+        std::cout << "Server mode is only available on Linux builds.\n";
+        return 1;
+#endif
+    }
+
+    if (!reportFormat.empty()) {
+        if (reportFormat != "text" && reportFormat != "csv" && reportFormat != "jsonl") {
+            std::cout << "Error: Unknown report format '" << reportFormat << "' (use text, csv or jsonl)\n";
+            return 1;
+        }
+        if (reportOrder != "title" && reportOrder != "author" && reportOrder != "category") {
+            std::cout << "Error: Unknown order '" << reportOrder << "' (use title, author or category)\n";
+            return 1;
+        }
+        // A report on stdout must be nothing but the report, so loading
+        // messages and errors go to stderr instead
+        if (reportOutput.empty()) std::cout.rdbuf(std::cerr.rdbuf());
+        LibraryManager library(loadThreads);
+        std::FILE* file = reportOutput.empty() ? stdout : std::fopen(reportOutput.c_str(), "wb");
+        if (!file) {
+            std::cout << "Error: Could not open " << reportOutput << " for writing\n";
+            return 1;
+        }
+        size_t written;
+        bool ok;
+        {
+            ReportWriter out(file, reportFormat == "csv" ? ReportFormat::CSV
+                                 : reportFormat == "jsonl" ? ReportFormat::JSONL : ReportFormat::Text);
+            written = library.writeBooks(out,
+                reportOrder == "author" ? BookOrder::Author
+                : reportOrder == "category" ? BookOrder::Category : BookOrder::Title,
+                reportOffset, reportLimit);
+            ok = out.flush();
+        }
+        if (file != stdout) {
+            ok = std::fclose(file) == 0 && ok;
+            if (ok) std::cout << "Wrote " << written << " books to " << reportOutput << "\n";
+        }
+        if (!ok) {
+            std::cout << "Error: Could not write the report\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!feedPath.empty()) {
+        LibraryManager library(loadThreads);
+        library.importBooks(feedPath);
+        library.saveData();
+        return 0;
+    }
+
+    if (importCSV || exportCSV) {
+        // Either way the loaded state (plus any logged changes) is written to both formats
+        LibraryManager tool(loadThreads, importCSV ? DataSource::CSV : DataSource::Snapshot);
+        tool.saveData();
+        return 0;
+    }
+
+    LibraryManager library(loadThreads);
     int choice;
     
     while (true) {
         displayMenu();
-        std::cin >> choice;
+        if (std::cin.eof()) {
+            choice = 12;  // end of input leaves the way Exit does
+        } else if (!(std::cin >> choice)) {
+            // Not a number: report it as an invalid choice and prompt again
+            std::cin.clear();
+            choice = -1;
+        }
         std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
         
         switch (choice) {
@@ -711,7 +7654,7 @@ int main() {
                 if (library.returnBook(isbn, borrowerId)) {
                     std::cout << "Book returned successfully!\n";
                 } else {
-                    std::cout << "Failed to return book. Please check ISBN and borrower ID.\n";
+                    std::cout << "Failed to return book. It is not on loan to that borrower.\n";
                 }
                 break;
             }
@@ -719,14 +7662,10 @@ int main() {
                 library.displayBooks();
                 break;
             case 6:
-                library.sortBooksByTitle();
-                std::cout << "Books sorted by title!\n";
-                library.displayBooks();
+                library.displayBooksInOrder(BookOrder::Title);
                 break;
             case 7:
-                library.sortBooksByAuthor();
-                std::cout << "Books sorted by author!\n";
-                library.displayBooks();
+                library.displayBooksInOrder(BookOrder::Author);
                 break;
             case 8:
                 library.displayBooksByCategory();
@@ -744,9 +7683,99 @@ int main() {
                 library.saveData();
                 std::cout << "Thank you for using the Library Management System!\n";
                 return 0;
+            case 13:
+                library.searchByTitleOrAuthor();
+                break;
+            case 14: {
+                std::string isbn, borrowerId, priority;
+                std::cout << "Enter ISBN: ";
+                std::getline(std::cin, isbn);
+                std::cout << "Enter borrower ID: ";
+                std::getline(std::cin, borrowerId);
+                std::cout << "Priority (1 = Staff, 2 = Accessibility, 3 = Regular): ";
+                std::getline(std::cin, priority);
+                HoldTier tier = priority == "1" ? HoldTier::Staff
+                              : priority == "2" ? HoldTier::Accessibility : HoldTier::Regular;
+                
+                if (library.placeHold(isbn, borrowerId, tier)) {
+                    std::cout << "Hold placed! Holds waiting for this book: " << library.holdsWaiting(isbn) << "\n";
+                } else {
+                    std::cout << "Failed to place hold. The book must be checked out and not already held by this borrower.\n";
+                }
+                break;
+            }
+            case 15: {
+                std::string key;
+                std::cout << "Enter ISBN or borrower ID (leave empty for all): ";
+                std::getline(std::cin, key);
+                
+                std::vector<TransactionHistory::Entry> entries = library.historyForBook(key);
+                if (!key.empty() && entries.empty()) {
+                    entries = library.historyForBorrower(key);
+                }
+                
+                std::cout << "\nTransaction History:\n";
+                std::cout << "----------------------------------------\n";
+                for (const auto& entry : entries) {
+                    std::time_t when = static_cast<std::time_t>(entry.timestamp);
+                    char stamp[32];
+                    std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", std::localtime(&when));
+                    std::cout << stamp << "  " << TransactionHistory::opName(entry.op) << ": "
+                              << entry.isbn << " by " << entry.borrowerId << "\n";
+                }
+                if (entries.empty()) {
+                    std::cout << "No transactions recorded.\n";
+                }
+                break;
+            }
+            case 16: {
+                std::string count;
+                std::cout << "How many transactions to undo? ";
+                std::getline(std::cin, count);
+                size_t undone = library.undoLastTransactions(std::strtoul(count.c_str(), nullptr, 10));
+                std::cout << "Undid " << undone << " transactions.\n";
+                break;
+            }
+            case 17: {
+                auto printLoans = [](const std::vector<DueDates::Loan>& loans) {
+                    for (const auto& loan : loans) {
+                        std::time_t when = static_cast<std::time_t>(loan.due);
+                        char stamp[32];
+                        std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", std::localtime(&when));
+                        std::cout << stamp << "  " << loan.isbn << " by " << loan.borrowerId << "\n";
+                    }
+                    if (loans.empty()) {
+                        std::cout << "None.\n";
+                    }
+                };
+                std::cout << "\nOverdue Loans:\n";
+                std::cout << "----------------------------------------\n";
+                printLoans(library.overdueLoans());
+                std::cout << "\nDue in the Next 48 Hours:\n";
+                std::cout << "----------------------------------------\n";
+                printLoans(library.loansDueWithin(48 * 3600));
+                std::cout << "\nOutstanding Fines:\n";
+                std::cout << "----------------------------------------\n";
+                std::vector<DueDates::Fine> fines = library.outstandingFines();
+                for (const auto& fine : fines) {
+                    std::cout << fine.borrowerId << ": $" << fine.cents / 100 << "."
+                              << (fine.cents % 100 < 10 ? "0" : "") << fine.cents % 100
+                              << " (" << fine.lateLoans << " late, $" << fine.balance / 100 << "."
+                              << (fine.balance % 100 < 10 ? "0" : "") << fine.balance % 100 << " charged)\n";
+                }
+                if (fines.empty()) {
+                    std::cout << "None.\n";
+                }
+                break;
+            }
             default:
                 std::cout << "Invalid choice. Please try again.\n";
         }
+        // A person is at the desk, so make each change durable before the next prompt
+        if (!library.commitLog()) {
+            std::cout << "Warning: the last change could not be written to library.wal; "
+                      << "it will be retried with the next one.\n";
+        }
     }
     
     return 0;
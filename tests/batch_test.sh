@@ -0,0 +1,66 @@
+#!/usr/bin/env bash
+# Batch requests: BORROWBATCH and RETURNBATCH answer one status per item in
+# request order, apply every item that can go through, and survive a crash;
+# --add-books skips ISBNs already in the catalog.
+# Usage: tests/batch_test.sh [path to library_system]
+
+source "$(dirname "$0")/common.sh"
+
+GATSBY=978-0743273565
+MOCKINGBIRD=978-0446310789
+HOBBIT=978-0547928227
+SHUVRO=980-2343435564  # on loan to B001 in the sample data
+MISSING=978-9999999999
+
+DATA=$WORK/data
+PORT=$(free_port)
+make_data_dir "$DATA"
+start lib "$PORT" --dir "$DATA"
+
+# statuses PORT FIELD... prints a batch reply's status lines joined by "|"
+statuses() {
+    listing "$@" | tr '\n' '|' | sed 's/|$//'
+}
+
+echo "# borrowing"
+expect "per-item status" \
+    "OK|ERR unknown book|ERR unknown borrower|ERR unavailable|ERR unavailable|OK" \
+    "$(statuses "$PORT" BORROWBATCH "$GATSBY" B002 "$MISSING" B002 "$HOBBIT" B999 "$SHUVRO" B003 \
+        "$GATSBY" B004 "$MOCKINGBIRD" B002)"
+expect "applied items only" "$MOCKINGBIRD B002 $GATSBY B002 $SHUVRO B001" "$(open_loans "$PORT" | tr '\n' ' ' | sed 's/ $//')"
+expect "counted" "OK 2" "$(request "$PORT" LOANS B002)"
+expect "single item" "OK 1" "$(request "$PORT" BORROWBATCH "$HOBBIT" B003)"
+expect "missing borrower id" "ERR bad request" "$(request "$PORT" BORROWBATCH "$HOBBIT" B003 "$GATSBY")"
+expect "no items" "ERR bad request" "$(request "$PORT" BORROWBATCH)"
+
+echo "# batch survives a crash"
+crash lib
+start lib "$PORT" --dir "$DATA"
+expect "loans replayed" "4" "$(open_loans "$PORT" | wc -l | tr -d ' ')"
+
+echo "# returning"
+expect "per-item status" "ERR not on loan|OK|OK|ERR unknown book|OK|ERR not on loan" \
+    "$(statuses "$PORT" RETURNBATCH "$GATSBY" B004 "$GATSBY" B002 "$SHUVRO" B001 "$MISSING" B001 \
+        "$MOCKINGBIRD" B002 "$MOCKINGBIRD" B002)"
+expect "hobbit still out" "$HOBBIT B003" "$(open_loans "$PORT")"
+expect "returned book on the shelf" "OK" "$(request "$PORT" BORROW "$SHUVRO" B005)"
+stop lib
+start lib "$PORT" --dir "$DATA"
+expect "returns saved" "$HOBBIT B003 $SHUVRO B005" "$(open_loans "$PORT" | tr '\n' ' ' | sed 's/ $//')"
+stop lib
+
+echo "# acquisitions feed"
+cat >"$WORK/feed.csv" <<CSV
+Title,Author,ISBN,Available,Category
+Code Complete,Steve McConnell,978-0735619678,1,Technical
+The Great Gatsby,F. Scott Fitzgerald,$GATSBY,1,Fiction
+Refactoring,Martin Fowler,978-0201485677,1,Technical
+CSV
+expect "duplicates skipped" "Added 2 books from $WORK/feed.csv (1 already in the catalog)" \
+    "$("$BIN" --dir "$DATA" --add-books "$WORK/feed.csv" | grep '^Added')"
+start lib "$PORT" --dir "$DATA"
+expect "added books listed" "OK 5	0	0" "$(request "$PORT" STATS Technical)"
+expect "existing book left alone" "A" "$(listing "$PORT" SEARCH gatsby | cut -f4)"
+stop lib
+
+exit $FAILED
@@ -0,0 +1,114 @@
+# Helpers shared by the test scripts. Each script runs the binary given as its
+# first argument (default ./library_system) against scratch copies of the
+# sample data and talks to it over loopback TCP.
+
+BIN=$(cd "$(dirname "${1:-./library_system}")" && pwd)/$(basename "${1:-./library_system}")
+REPO=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+WORK=$(mktemp -d)
+FAILED=0
+PIDS=()
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do kill -9 "$pid" 2>/dev/null; done
+    wait 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# Creates a data directory holding the sample CSV files
+make_data_dir() {
+    mkdir -p "$1"
+    cp "$REPO/books.csv" "$REPO/borrowers.csv" "$1/"
+}
+
+free_port() {
+    echo $((20000 + RANDOM % 20000))
+}
+
+# start NAME PORT ARGS... runs the binary in the background and waits until the
+# port accepts connections; its pid is stored in $WORK/NAME.pid
+start() {
+    launch "$1" "$2" "${@:3}" --serve "$2"
+}
+
+# start_router NAME PORT SHARDS ARGS... does the same for a router in front of
+# the comma-separated shard addresses
+start_router() {
+    launch "$1" "$2" "${@:4}" --route "$2" --shards "$3"
+}
+
+# launch NAME PORT ARGS... runs the binary with exactly ARGS
+launch() {
+    local name=$1 port=$2
+    shift 2
+    "$BIN" "$@" </dev/null >>"$WORK/$name.log" 2>&1 &
+    echo $! >"$WORK/$name.pid"
+    PIDS+=($!)
+    for _ in $(seq 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$port") 2>/dev/null; then return 0; fi
+        sleep 0.1
+    done
+    echo "FAIL: $name did not start on port $port"
+    cat "$WORK/$name.log"
+    exit 1
+}
+
+# Shuts a server down cleanly (it saves on SIGTERM)
+stop() {
+    local pid
+    pid=$(cat "$WORK/$1.pid")
+    kill "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+}
+
+# Kills a server without giving it a chance to save
+crash() {
+    local pid
+    pid=$(cat "$WORK/$1.pid")
+    kill -9 "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+}
+
+# request PORT FIELD... sends one tab-separated request and prints the status line
+request() {
+    local port=$1 line reply
+    shift
+    line=$(IFS=$'\t'; echo "$*")
+    exec 3<>"/dev/tcp/127.0.0.1/$port" || return 1
+    printf '%s\n' "$line" >&3
+    IFS= read -r -t 5 reply <&3
+    exec 3<&-
+    echo "$reply"
+}
+
+# listing PORT FIELD... sends a request answered with "OK <n>" and n lines,
+# and prints those lines
+listing() {
+    local port=$1 line reply count
+    shift
+    line=$(IFS=$'\t'; echo "$*")
+    exec 3<>"/dev/tcp/127.0.0.1/$port" || return 1
+    printf '%s\n' "$line" >&3
+    IFS= read -r -t 5 reply <&3
+    count=${reply#OK }
+    case $reply in OK\ [0-9]*) ;; *) count=0 ;; esac
+    for ((i = 0; i < count; ++i)); do
+        IFS= read -r -t 5 line <&3 && echo "$line"
+    done
+    exec 3<&-
+}
+
+# Prints the "isbn borrower" pairs of every open loan, sorted
+open_loans() {
+    listing "$1" DUE 1000000 1000000 | cut -f1,2 | tr '\t' ' ' | sort
+}
+
+# expect DESCRIPTION EXPECTED ACTUAL
+expect() {
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected '$2', got '$3'"
+        FAILED=1
+    fi
+}
@@ -0,0 +1,55 @@
+#!/usr/bin/env bash
+# Hold queues: a returned book goes to the next patron waiting for it, by
+# priority tier and then first come first served, expired holds are passed
+# over, and the queue survives a crash and a clean save.
+# Usage: tests/holds_test.sh [path to library_system]
+
+source "$(dirname "$0")/common.sh"
+
+BOOK=980-2343435564  # on loan to B001 in the sample data
+STAFF=0
+REGULAR=2
+NOW=$(date +%s)
+LATER=$((NOW + 7 * 86400))
+EARLIER=$((NOW - 86400))
+
+DATA=$WORK/data
+PORT=$(free_port)
+make_data_dir "$DATA"
+cat >"$DATA/holds.csv" <<CSV
+ISBN,BorrowerID,Tier,ExpiresAt
+$BOOK,B002,$REGULAR,$LATER
+$BOOK,B003,$STAFF,$EARLIER
+$BOOK,B004,$STAFF,$LATER
+$BOOK,B005,$REGULAR,$LATER
+CSV
+start lib "$PORT" --dir "$DATA"
+
+# holder PORT prints who has the book now
+holder() {
+    open_loans "$1" | awk -v isbn="$BOOK" '$1 == isbn { print $2 }'
+}
+
+echo "# priority, then arrival order"
+expect "return" "OK" "$(request "$PORT" RETURN "$BOOK" B001)"
+expect "staff hold served first, expired one skipped" "B004" "$(holder "$PORT")"
+expect "not on the shelf" "ERR unavailable" "$(request "$PORT" BORROW "$BOOK" B003)"
+crash lib
+start lib "$PORT" --dir "$DATA"
+expect "hand-off survives a crash" "B004" "$(holder "$PORT")"
+expect "return" "OK" "$(request "$PORT" RETURN "$BOOK" B004)"
+expect "oldest regular hold next" "B002" "$(holder "$PORT")"
+stop lib
+start lib "$PORT" --dir "$DATA"
+expect "hand-off survives a save" "B002" "$(holder "$PORT")"
+expect "return" "OK" "$(request "$PORT" RETURN "$BOOK" B002)"
+expect "last hold served" "B005" "$(holder "$PORT")"
+
+echo "# empty queue"
+expect "return" "OK" "$(request "$PORT" RETURN "$BOOK" B005)"
+expect "back on the shelf" "" "$(holder "$PORT")"
+expect "expired holder borrows it normally" "OK" "$(request "$PORT" BORROW "$BOOK" B003)"
+stop lib
+expect "no holds left on file" "1" "$(wc -l <"$DATA/holds.csv" | tr -d ' ')"
+
+exit $FAILED
@@ -0,0 +1,111 @@
+#!/usr/bin/env bash
+# Loans: a borrower's loan list keeps the right books as it grows past the
+# point where it switches to its index and shrinks back; overdue and
+# due-soon listings and fines follow the due dates in loans.csv, and a late
+# return is charged to the borrower's balance.
+# Usage: tests/loans_test.sh [path to library_system]
+
+source "$(dirname "$0")/common.sh"
+
+DAY=86400
+NOW=$(date +%s)
+GATSBY=978-0743273565
+HOBBIT=978-0547928227
+CLEAN=978-0132350884
+PRIDE=978-0141439518
+SHUVRO=980-2343435564  # on loan to B001 in the sample data
+
+DATA=$WORK/data
+PORT=$(free_port)
+make_data_dir "$DATA"
+start lib "$PORT" --dir "$DATA"
+
+# isbn N prints the ISBN of the N-th added book
+isbn() {
+    printf '979-%010d' "$1"
+}
+
+# held PORT BORROWER prints the ISBNs on loan to BORROWER, sorted
+held() {
+    open_loans "$1" | awk -v who="$2" '$2 == who { print $1 }' | tr '\n' ' ' | sed 's/ $//'
+}
+
+# expected_held N... prints the ISBNs of the given added books, sorted
+expected_held() {
+    for n in "$@"; do isbn "$n"; echo; done | sort | tr '\n' ' ' | sed 's/ $//'
+}
+
+echo "# one borrower, many loans"
+for n in $(seq 1 40); do
+    request "$PORT" ADD "Volume $n" "Series Author" "$(isbn "$n")" Reference >/dev/null
+    request "$PORT" BORROW "$(isbn "$n")" B002 >/dev/null
+done
+expect "all 40 on loan" "$(expected_held $(seq 1 40))" "$(held "$PORT" B002)"
+for n in $(seq 3 3 40) 40 1; do
+    request "$PORT" RETURN "$(isbn "$n")" B002 >/dev/null
+done
+KEPT=$(for n in $(seq 2 39); do ((n % 3)) && echo "$n"; done)
+expect "returned in any order" "$(expected_held $KEPT)" "$(held "$PORT" B002)"
+expect "returned book not on loan" "ERR not on loan" "$(request "$PORT" RETURN "$(isbn 3)" B002)"
+expect "someone else's book" "ERR not on loan" "$(request "$PORT" RETURN "$(isbn 2)" B003)"
+expect "returned book lent again" "OK" "$(request "$PORT" BORROW "$(isbn 3)" B003)"
+crash lib
+start lib "$PORT" --dir "$DATA"
+expect "loans after a crash" "$(expected_held $KEPT)" "$(held "$PORT" B002)"
+stop lib
+start lib "$PORT" --dir "$DATA"
+expect "loans after a save" "$(expected_held $KEPT)" "$(held "$PORT" B002)"
+for n in $KEPT; do
+    [ "$n" -gt 5 ] && request "$PORT" RETURN "$(isbn "$n")" B002 >/dev/null
+done
+expect "shrunk back" "$(expected_held 2 4 5)" "$(held "$PORT" B002)"
+expect "borrow after shrinking" "OK" "$(request "$PORT" BORROW "$(isbn 6)" B002)"
+expect "return after shrinking" "OK" "$(request "$PORT" RETURN "$(isbn 4)" B002)"
+expect "short list" "$(expected_held 2 5 6)" "$(held "$PORT" B002)"
+
+echo "# due dates"
+for loan in "$GATSBY B002" "$HOBBIT B003" "$CLEAN B003" "$PRIDE B004"; do
+    request "$PORT" BORROW $loan >/dev/null
+done
+stop lib
+# Back-date the loans: Gatsby 4 started days late, the Hobbit late enough to hit the cap
+awk -F, -v OFS=, -v now="$NOW" -v day=$DAY -v gatsby=$GATSBY -v hobbit=$HOBBIT -v clean=$CLEAN \
+    -v pride=$PRIDE -v shuvro=$SHUVRO '
+    $1 == gatsby { $4 = now - 3 * day - 3600 }
+    $1 == hobbit { $4 = now - 50 * day }
+    $1 == clean { $4 = now + 7200 }
+    $1 == pride { $4 = now + 5 * day }
+    $1 == shuvro { $4 = now + 30 * day }
+    { print }' "$DATA/loans.csv" >"$WORK/loans.csv"
+mv "$WORK/loans.csv" "$DATA/loans.csv"
+start lib "$PORT" --dir "$DATA"
+
+# loans PORT FIELD... prints the "isbn borrower" pairs a loan listing returns, in order
+loans() {
+    listing "$@" | cut -f1,2 | tr '\t\n' ': ' | sed 's/ $//'
+}
+
+expect "overdue, most overdue first" "$HOBBIT:B003 $GATSBY:B002" "$(loans "$PORT" OVERDUE)"
+expect "overdue limit" "$HOBBIT:B003" "$(loans "$PORT" OVERDUE 1)"
+expect "due within a day" "$CLEAN:B003" "$(loans "$PORT" DUE 24)"
+expect "due within a week" "$CLEAN:B003 $PRIDE:B004" "$(loans "$PORT" DUE 168)"
+expect "due limit" "$CLEAN:B003" "$(loans "$PORT" DUE 168 1)"
+expect "nothing due in the next hour" "OK 0" "$(request "$PORT" DUE 1)"
+
+echo "# fines"
+FINES=$(listing "$PORT" FINES | tr '\t\n' ': ' | sed 's/ $//')
+expect "accrued, capped, largest first" "B003:1:1000 B002:1:100" "$FINES"
+expect "fines limit" "B003:1:1000" "$(listing "$PORT" FINES 1 | tr '\t' ':')"
+expect "late return" "OK" "$(request "$PORT" RETURN "$GATSBY" B002)"
+expect "charged to the balance" "B003:1:1000 B002:0:100" "$(listing "$PORT" FINES | tr '\t\n' ': ' | sed 's/ $//')"
+expect "on-time return" "OK" "$(request "$PORT" RETURN "$CLEAN" B003)"
+crash lib
+start lib "$PORT" --dir "$DATA"
+expect "balance after a crash" "B003:1:1000 B002:0:100" "$(listing "$PORT" FINES | tr '\t\n' ': ' | sed 's/ $//')"
+stop lib
+start lib "$PORT" --dir "$DATA"
+expect "balance after a save" "B003:1:1000 B002:0:100" "$(listing "$PORT" FINES | tr '\t\n' ': ' | sed 's/ $//')"
+expect "saved in fines.csv" "B002,100" "$(grep '^B002,' "$DATA/fines.csv")"
+stop lib
+
+exit $FAILED
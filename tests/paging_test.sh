@@ -0,0 +1,80 @@
+#!/usr/bin/env bash
+# Paged listings: each order is sorted, its pages join up into the whole
+# listing, and additions, recategorised books and checkouts show up in the
+# right place straight away and after a crash or a clean save; a generated
+# catalog checks the same across many view blocks.
+# Usage: tests/paging_test.sh [path to library_system]
+
+source "$(dirname "$0")/common.sh"
+
+DATA=$WORK/data
+PORT=$(free_port)
+make_data_dir "$DATA"
+start lib "$PORT" --dir "$DATA"
+
+# column PORT ORDER N prints field N of the whole listing in ORDER
+column() {
+    listing "$1" LIST "$2" 0 1000000 | cut -f"$3"
+}
+
+# pages PORT ORDER SIZE joins the listing back up from pages of SIZE books
+pages() {
+    local page=0 chunk
+    while chunk=$(listing "$1" LIST "$2" "$page" "$3") && [ -n "$chunk" ]; do
+        echo "$chunk"
+        page=$((page + 1))
+    done
+}
+
+echo "# orders"
+expect "titles sorted" "$(column "$PORT" title 2 | LC_ALL=C sort)" "$(column "$PORT" title 2)"
+expect "authors sorted" "$(column "$PORT" author 3 | LC_ALL=C sort)" "$(column "$PORT" author 3)"
+expect "category order starts with Fantasy" "978-0439708180 978-0547928227" \
+    "$(listing "$PORT" LIST category 0 2 | cut -f1 | tr '\n' ' ' | sed 's/ $//')"
+
+echo "# pages"
+for order in title author category; do
+    expect "$order pages join up" "$(listing "$PORT" LIST "$order" 0 1000)" "$(pages "$PORT" "$order" 5)"
+done
+expect "default page size" "12" "$(listing "$PORT" LIST title | wc -l | tr -d ' ')"
+expect "last partial page" "2" "$(listing "$PORT" LIST title 2 5 | wc -l | tr -d ' ')"
+expect "page past the end" "OK 0" "$(request "$PORT" LIST title 3 4)"
+expect "empty page size" "OK 0" "$(request "$PORT" LIST title 0 0)"
+expect "unknown order" "ERR bad request" "$(request "$PORT" LIST isbn)"
+
+echo "# changes show up in place"
+expect "add" "OK" "$(request "$PORT" ADD "Aesop's Fables" "Aesop" 978-0140447491 Fiction)"
+expect "new title ranks second" "978-0140447491" "$(listing "$PORT" LIST title 0 2 | tail -1 | cut -f1)"
+expect "new author ranks first" "978-0140447491" "$(listing "$PORT" LIST author 0 1 | cut -f1)"
+expect "recategorise" "OK" "$(request "$PORT" SETCATEGORY 783-1923092344 Fantasy)"
+expect "moved into Fantasy" "978-0439708180 783-1923092344 978-0547928227" \
+    "$(listing "$PORT" LIST category 0 3 | cut -f1 | tr '\n' ' ' | sed 's/ $//')"
+expect "borrow" "OK" "$(request "$PORT" BORROW 978-0451524935 B002)"
+expect "status follows checkout" "B" "$(listing "$PORT" LIST title 0 1 | cut -f4)"
+
+echo "# orders survive a restart"
+BEFORE=$(for order in title author category; do listing "$PORT" LIST "$order" 0 1000; done)
+crash lib
+start lib "$PORT" --dir "$DATA"
+expect "after a crash" "$BEFORE" "$(for order in title author category; do listing "$PORT" LIST "$order" 0 1000; done)"
+stop lib
+start lib "$PORT" --dir "$DATA"
+expect "after a save" "$BEFORE" "$(for order in title author category; do listing "$PORT" LIST "$order" 0 1000; done)"
+stop lib
+
+echo "# a catalog spread over many blocks"
+BIG=$WORK/big
+"$BIN" --generate "$BIG" --books 5000 --borrowers 50 >"$WORK/generate.log" 2>&1
+start big "$PORT" --dir "$BIG"
+for i in $(seq 100 149); do
+    request "$PORT" ADD "Added $i" "Author $i" "979-00000$i" Fiction >/dev/null
+done
+expect "titles sorted" "$(column "$PORT" title 2 | LC_ALL=C sort)" "$(column "$PORT" title 2)"
+expect "authors sorted" "$(column "$PORT" author 3 | LC_ALL=C sort)" "$(column "$PORT" author 3)"
+for order in title author category; do
+    expect "$order pages join up" "$(listing "$PORT" LIST "$order" 0 1000000)" "$(pages "$PORT" "$order" 700)"
+done
+expect "last page of 700" "150" "$(listing "$PORT" LIST title 7 700 | wc -l | tr -d ' ')"
+stop big
+
+exit $FAILED
@@ -0,0 +1,53 @@
+#!/usr/bin/env bash
+# Title/author search over the protocol: BM25 ranking, prefix and typo-
+# tolerant matching, limits and scores, and a search index that follows
+# additions and checkouts across a crash and a clean save.
+# Usage: tests/search_test.sh [path to library_system]
+
+source "$(dirname "$0")/common.sh"
+
+DATA=$WORK/data
+PORT=$(free_port)
+make_data_dir "$DATA"
+start lib "$PORT" --dir "$DATA"
+
+# isbns PORT QUERY... prints the ISBNs a search returns, best first
+isbns() {
+    listing "$@" | cut -f1 | tr '\n' ' ' | sed 's/ $//'
+}
+
+echo "# ranking"
+expect "shorter title ranks first" "978-0132350884 978-0307474278" "$(isbns "$PORT" SEARCH code)"
+expect "case does not matter" "978-0132350884 978-0307474278" "$(isbns "$PORT" SEARCH CODE)"
+SCORES=$(listing "$PORT" SEARCH code 10 SCORED | cut -f5)
+expect "scores given, best first" "yes" "$(echo "$SCORES" | sort -gr | cmp -s - <(echo "$SCORES") && echo yes)"
+expect "title and author words combine" "978-0201896831" "$(isbns "$PORT" SEARCH "programming knuth")"
+expect "author word" "978-0451524935" "$(isbns "$PORT" SEARCH orwell)"
+
+echo "# prefix and typo matching"
+expect "word prefix" "978-0547928227" "$(isbns "$PORT" SEARCH hob)"
+expect "transposed letters" "978-0547928227" "$(isbns "$PORT" SEARCH tolkein)"
+expect "missing letter" "978-0672323089" "$(isbns "$PORT" SEARCH "data structres")"
+expect "nothing close" "OK 0" "$(request "$PORT" SEARCH zzzzzz)"
+
+echo "# limits and bad requests"
+expect "limit" "978-0132350884" "$(isbns "$PORT" SEARCH code 1)"
+expect "limit 0" "OK 0" "$(request "$PORT" SEARCH code 0)"
+expect "empty query" "OK 0" "$(request "$PORT" SEARCH "")"
+expect "no query" "ERR bad request" "$(request "$PORT" SEARCH)"
+
+echo "# index follows the catalog"
+expect "add" "OK" "$(request "$PORT" ADD "Code Complete" "Steve McConnell" 978-0735619678 Technical)"
+expect "added book found" "3" "$(listing "$PORT" SEARCH code | wc -l | tr -d ' ')"
+expect "borrow" "OK" "$(request "$PORT" BORROW 978-0132350884 B002)"
+expect "status follows checkout" "B" "$(listing "$PORT" SEARCH clean | cut -f4)"
+crash lib
+start lib "$PORT" --dir "$DATA"
+expect "added book found after a crash" "978-0735619678" "$(isbns "$PORT" SEARCH mcconnell)"
+expect "status after a crash" "B" "$(listing "$PORT" SEARCH clean | cut -f4)"
+stop lib
+start lib "$PORT" --dir "$DATA"
+expect "added book found after a save" "978-0735619678" "$(isbns "$PORT" SEARCH mcconnell)"
+stop lib
+
+exit $FAILED
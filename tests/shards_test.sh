@@ -0,0 +1,127 @@
+#!/usr/bin/env bash
+# Cross-shard checkouts and returns: the router runs them as a two-phase
+# commit, a shard's vote survives a kill -9 and a clean save until the
+# decision comes, a shard remembers each outcome until the router says
+# FORGET, and a restarted router delivers the decisions left in router.wal
+# and aborts the transfers it began but never decided.
+# Usage: tests/shards_test.sh [path to library_system]
+
+source "$(dirname "$0")/common.sh"
+
+# append_record LOG OP FIELD... appends one record in the library.wal format
+append_record() {
+    python3 - "$@" <<'EOF'
+import struct, sys, zlib
+path, op, fields = sys.argv[1], int(sys.argv[2]), sys.argv[3:]
+payload = bytes([op]) + b"".join(struct.pack("<I", len(f.encode())) + f.encode() for f in fields)
+with open(path, "ab") as log:
+    log.write(struct.pack("<II", len(payload), zlib.crc32(payload)) + payload)
+EOF
+}
+
+COMMIT_DECISION=12
+TRANSFER_BEGUN=15
+
+DATA=$WORK/data
+SHARDS=$WORK/shards
+make_data_dir "$DATA"
+"$BIN" --dir "$DATA" --split 2 --output "$SHARDS" >"$WORK/split.log" 2>&1
+mkdir -p "$WORK/router"
+
+P0=$(free_port)
+P1=$((P0 + 1))
+PR=$((P0 + 2))
+start shard0 "$P0" --dir "$SHARDS/shard-0"
+start shard1 "$P1" --dir "$SHARDS/shard-1"
+start_router router "$PR" "$P0,$P1" --dir "$WORK/router"
+
+# Available books kept by shard 0, and borrowers kept by each shard
+mapfile -t BOOKS < <(listing "$P0" LIST title 0 100 | awk -F'\t' '$4 == "A" { print $1 }')
+REMOTE=$(tail -n +2 "$SHARDS/shard-1/borrowers.csv" | head -1 | cut -d, -f1)
+LOCAL=$(tail -n +2 "$SHARDS/shard-0/borrowers.csv" | head -1 | cut -d, -f1)
+
+echo "# through the router"
+expect "cross-shard borrow" "OK" "$(request "$PR" BORROW "${BOOKS[0]}" "$REMOTE")"
+expect "loan listed" "1" "$(open_loans "$PR" | grep -c "^${BOOKS[0]} $REMOTE$")"
+expect "book held" "ERR unavailable" "$(request "$PR" BORROW "${BOOKS[0]}" "$LOCAL")"
+expect "cross-shard return" "OK" "$(request "$PR" RETURN "${BOOKS[0]}" "$REMOTE")"
+expect "loan closed" "0" "$(open_loans "$PR" | grep -c "^${BOOKS[0]} $REMOTE$")"
+
+echo "# prepared vote survives a crash"
+expect "book shard votes" "OK" "$(request "$P0" PREPARE T1 BORROW "${BOOKS[1]}" "$REMOTE")"
+expect "borrower shard votes" "OK" "$(request "$P1" PREPARE T1 BORROW "${BOOKS[1]}" "$REMOTE")"
+crash shard0
+crash shard1
+start shard0 "$P0" --dir "$SHARDS/shard-0"
+start shard1 "$P1" --dir "$SHARDS/shard-1"
+expect "book still reserved" "ERR unavailable" "$(request "$P0" BORROW "${BOOKS[1]}" "$LOCAL")"
+expect "commit on book shard" "OK" "$(request "$P0" COMMIT T1)"
+expect "commit on borrower shard" "OK" "$(request "$P1" COMMIT T1)"
+expect "repeated commit" "OK" "$(request "$P0" COMMIT T1)"
+expect "committed loan listed" "1" "$(open_loans "$PR" | grep -c "^${BOOKS[1]} $REMOTE$")"
+
+echo "# abort after a crash"
+expect "vote" "OK" "$(request "$P0" PREPARE T2 BORROW "${BOOKS[2]}" "$REMOTE")"
+crash shard0
+start shard0 "$P0" --dir "$SHARDS/shard-0"
+expect "abort" "OK" "$(request "$P0" ABORT T2)"
+expect "commit after abort" "ERR aborted" "$(request "$P0" COMMIT T2)"
+expect "book released" "OK" "$(request "$P0" BORROW "${BOOKS[2]}" "$LOCAL")"
+
+echo "# prepared vote survives a clean save"
+expect "vote" "OK" "$(request "$P0" PREPARE T3 BORROW "${BOOKS[3]}" "$REMOTE")"
+stop shard0
+start shard0 "$P0" --dir "$SHARDS/shard-0"
+expect "book still reserved" "ERR unavailable" "$(request "$P0" BORROW "${BOOKS[3]}" "$LOCAL")"
+expect "abort" "OK" "$(request "$P0" ABORT T3)"
+
+echo "# a yes vote stands until the router decides"
+expect "vote" "OK" "$(request "$P0" PREPARE T4 BORROW "${BOOKS[4]}" "$REMOTE")"
+crash shard0
+start shard0 "$P0" --dir "$SHARDS/shard-0"
+sleep 1
+expect "book still reserved" "ERR unavailable" "$(request "$P0" BORROW "${BOOKS[4]}" "$LOCAL")"
+
+echo "# restarted router aborts a transfer it never decided"
+crash router
+append_record "$WORK/router/router.wal" $TRANSFER_BEGUN T4 "$P0" "$P1"
+start_router router "$PR" "$P0,$P1" --dir "$WORK/router"
+sleep 2
+expect "book released" "OK" "$(request "$P0" BORROW "${BOOKS[4]}" "$LOCAL")"
+expect "outcome forgotten" "ERR unknown transaction" "$(request "$P0" COMMIT T4)"
+
+echo "# outcome kept until FORGET, across a save"
+expect "vote" "OK" "$(request "$P0" PREPARE T6 BORROW "${BOOKS[6]}" "$REMOTE")"
+expect "commit" "OK" "$(request "$P0" COMMIT T6)"
+stop shard0
+start shard0 "$P0" --dir "$SHARDS/shard-0"
+expect "commit redelivered" "OK" "$(request "$P0" COMMIT T6)"
+expect "abort refused" "ERR committed" "$(request "$P0" ABORT T6)"
+expect "forget" "OK" "$(request "$P0" FORGET T6)"
+crash shard0
+start shard0 "$P0" --dir "$SHARDS/shard-0"
+expect "forgotten after a crash" "ERR unknown transaction" "$(request "$P0" COMMIT T6)"
+
+echo "# router delivers logged decisions after a restart"
+expect "book shard votes" "OK" "$(request "$P0" PREPARE T5 BORROW "${BOOKS[5]}" "$REMOTE")"
+expect "borrower shard votes" "OK" "$(request "$P1" PREPARE T5 BORROW "${BOOKS[5]}" "$REMOTE")"
+crash router
+append_record "$WORK/router/router.wal" $COMMIT_DECISION T5 "$P0" "$P1"
+start_router router "$PR" "$P0,$P1" --dir "$WORK/router"
+sleep 2
+expect "decision delivered" "1" "$(open_loans "$PR" | grep -c "^${BOOKS[5]} $REMOTE$")"
+expect "borrower side applied" "OK" "$(request "$PR" RETURN "${BOOKS[5]}" "$REMOTE")"
+expect "shards told to forget" "ERR unknown transaction" "$(request "$P1" COMMIT T5)"
+
+echo "# a refusal is never taken as an acknowledgement"
+crash router
+append_record "$WORK/router/router.wal" $COMMIT_DECISION T7 "$P0" "$P1"
+start_router router "$PR" "$P0,$P1" --dir "$WORK/router"
+sleep 3
+stop router
+expect "refusal reported once" "1" "$(grep -c "answered ERR unknown transaction to COMMIT	T7" "$WORK/router.log")"
+start_router router "$PR" "$P0,$P1" --dir "$WORK/router"
+stop router
+expect "still pending after a restart" "2" "$(grep -c "Delivering 1 transfer decisions" "$WORK/router.log")"
+
+exit $FAILED
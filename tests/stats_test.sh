@@ -0,0 +1,77 @@
+#!/usr/bin/env bash
+# Circulation figures: STATS totals and per-category counts, checkouts per
+# borrower, and the most-borrowed list, including a heavily borrowed title
+# among more distinct titles than the Space-Saving summary has counters.
+# Usage: tests/stats_test.sh [path to library_system]
+
+source "$(dirname "$0")/common.sh"
+
+GATSBY=978-0743273565
+HOBBIT=978-0547928227
+CLEAN=978-0132350884
+SHUVRO=980-2343435564  # on loan to B001 in the sample data
+
+DATA=$WORK/data
+PORT=$(free_port)
+make_data_dir "$DATA"
+start lib "$PORT" --dir "$DATA"
+
+# cycle PORT ISBN BORROWER N borrows and returns the book N times
+cycle() {
+    for _ in $(seq "$4"); do
+        request "$1" BORROW "$2" "$3" >/dev/null
+        request "$1" RETURN "$2" "$3" >/dev/null
+    done
+}
+
+# top PORT N prints the most-borrowed list on one line
+top() {
+    listing "$1" TOP "$2" | tr '\t\n' ': ' | sed 's/ $//'
+}
+
+echo "# at startup"
+expect "totals" "OK 12	1	0" "$(request "$PORT" STATS)"
+expect "category" "OK 2	0	0" "$(request "$PORT" STATS Fantasy)"
+expect "unknown category" "OK 0	0	0" "$(request "$PORT" STATS Poetry)"
+expect "nothing borrowed yet" "OK 0" "$(request "$PORT" TOP)"
+expect "borrower" "OK 0" "$(request "$PORT" LOANS B001)"
+
+echo "# counted checkouts"
+cycle "$PORT" "$GATSBY" B002 3
+cycle "$PORT" "$HOBBIT" B003 2
+cycle "$PORT" "$CLEAN" B002 2
+expect "refused checkout not counted" "ERR unavailable" "$(request "$PORT" BORROW "$SHUVRO" B002)"
+expect "borrow" "OK" "$(request "$PORT" BORROW "$HOBBIT" B004)"
+expect "most borrowed first, ties by ISBN" "$HOBBIT:3 $GATSBY:3 $CLEAN:2" "$(top "$PORT" 3)"
+expect "limit" "$HOBBIT:3" "$(top "$PORT" 1)"
+expect "totals" "OK 12	2	8" "$(request "$PORT" STATS)"
+expect "category" "OK 2	1	3" "$(request "$PORT" STATS Fantasy)"
+expect "checkouts by borrower" "OK 5" "$(request "$PORT" LOANS B002)"
+expect "other borrower" "OK 2" "$(request "$PORT" LOANS B003)"
+expect "unknown borrower" "OK 0" "$(request "$PORT" LOANS B999)"
+
+echo "# restart"
+crash lib
+start lib "$PORT" --dir "$DATA"
+expect "loans on file kept, counts start afresh" "OK 12	2	0" "$(request "$PORT" STATS)"
+expect "category" "OK 2	1	0" "$(request "$PORT" STATS Fantasy)"
+expect "most borrowed cleared" "OK 0" "$(request "$PORT" TOP)"
+expect "added books counted" "OK" "$(request "$PORT" ADD "Poems" "Anon" 978-0000000001 Poetry)"
+expect "new category" "OK 1	0	0" "$(request "$PORT" STATS Poetry)"
+
+echo "# a heavy hitter among many titles"
+for i in $(seq 100 299); do
+    request "$PORT" ADD "Title $i" "Author $i" "979-0000000$i" Poetry >/dev/null
+done
+cycle "$PORT" "$GATSBY" B002 10
+for i in $(seq 100 299); do
+    request "$PORT" BORROW "979-0000000$i" B005 >/dev/null
+    if ((i % 2 == 0)); then cycle "$PORT" "$GATSBY" B002 1; fi
+done
+expect "heavy hitter counted exactly" "$GATSBY:110" "$(top "$PORT" 1)"
+expect "list bounded by the counters" "64" "$(listing "$PORT" TOP 1000 | wc -l | tr -d ' ')"
+expect "totals" "OK 213	202	310" "$(request "$PORT" STATS)"
+expect "borrower" "OK 200" "$(request "$PORT" LOANS B005)"
+stop lib
+
+exit $FAILED
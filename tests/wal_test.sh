@@ -0,0 +1,46 @@
+#!/usr/bin/env bash
+# Crash recovery through library.wal: changes acknowledged before a kill -9
+# come back on restart, a torn record at the end of the log is cut off without
+# losing the records before it, and a clean save folds the log into the files.
+# Usage: tests/wal_test.sh [path to library_system]
+
+source "$(dirname "$0")/common.sh"
+
+DATA=$WORK/data
+PORT=$(free_port)
+make_data_dir "$DATA"
+
+echo "# replay after a crash"
+start lib "$PORT" --dir "$DATA"
+expect "borrow" "OK" "$(request "$PORT" BORROW 978-0743273565 B002)"
+expect "return" "OK" "$(request "$PORT" RETURN 978-0743273565 B002)"
+expect "borrow again" "OK" "$(request "$PORT" BORROW 978-0743273565 B003)"
+expect "add borrower" "OK" "$(request "$PORT" ADDBORROWER B900 Test Reader)"
+crash lib
+start lib "$PORT" --dir "$DATA"
+expect "replayed loan held" "ERR unavailable" "$(request "$PORT" BORROW 978-0743273565 B002)"
+expect "replayed loan open" "1" "$(open_loans "$PORT" | grep -c "^978-0743273565 B003$")"
+expect "replayed borrower exists" "OK" "$(request "$PORT" BORROW 978-0446310789 B900)"
+crash lib
+
+echo "# torn tail"
+printf '\x40\x00\x00\x00\xde\xad\xbe\xef\x04partial' >>"$DATA/library.wal"
+start lib "$PORT" --dir "$DATA"
+expect "records before the tear replayed" "1" "$(open_loans "$PORT" | grep -c "^978-0446310789 B900$")"
+expect "borrow after the tear" "OK" "$(request "$PORT" BORROW 978-0451524935 B004)"
+crash lib
+start lib "$PORT" --dir "$DATA"
+expect "record appended after the tear replayed" "1" "$(open_loans "$PORT" | grep -c "^978-0451524935 B004$")"
+expect "earlier records still replayed" "1" "$(open_loans "$PORT" | grep -c "^978-0743273565 B003$")"
+
+echo "# clean save"
+stop lib
+expect "log emptied by the save" "0" "$(cat "$DATA/library.wal" 2>/dev/null | wc -c | tr -d ' ')"
+expect "no rotated log left" "no" "$([ -e "$DATA/library.wal.1" ] && echo yes || echo no)"
+expect "no temp files left" "" "$(ls "$DATA" | grep '\.tmp$')"
+expect "loan saved to loans.csv" "1" "$(grep -c '^978-0451524935,B004,' "$DATA/loans.csv")"
+start lib "$PORT" --dir "$DATA"
+expect "saved loan loaded" "1" "$(open_loans "$PORT" | grep -c "^978-0451524935 B004$")"
+stop lib
+
+exit $FAILED